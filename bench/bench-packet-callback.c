@@ -0,0 +1,130 @@
+/* Packet rate benchmark for the DVBReader data path.
+ *
+ * Feeds a stream through dvb_reader_process_buffer() as the data thread does, with listeners attached, and
+ * reports packets/s when the TsReader hands the packets to dvb_reader_handle_packets() in batches, against the
+ * per-packet path it replaced. The reader is not tuned; its pids are activated directly, like a PMT would.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-stream.h"
+#include "dvbreader-internal.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_LISTENERS 2
+#define BENCH_ACTIVE_PIDS 20
+#define BENCH_MAIN_SERVICE 1
+
+struct BenchListener {
+    DVBFilterType filter;
+    gsize delivered;    /* packets passed to the callback, added by the worker thread */
+};
+
+/* The per-packet path before batching took listener_mutex for every packet. The reader's mutex is private, an
+ * uncontended one here costs the same. */
+static GMutex bench_listener_mutex;
+
+static void bench_listener_callback(const guint8 *data, gsize size, gpointer userdata)
+{
+    struct BenchListener *listener = (struct BenchListener *)userdata;
+
+    g_atomic_pointer_add(&listener->delivered, size / TS_SIZE);
+}
+
+/* the old per-packet path: one callback, one lock and one pass over the listeners per packet */
+static gboolean bench_handle_packet(const uint8_t *packet, void *userdata)
+{
+    gboolean result;
+
+    g_mutex_lock(&bench_listener_mutex);
+    result = dvb_reader_handle_packets(packet, 1, userdata);
+    g_mutex_unlock(&bench_listener_mutex);
+
+    return result;
+}
+
+/* Returns the best packets/s of the rounds. */
+static double bench_run(struct BenchStream *stream, const char *name, TsReaderClass *klass,
+                        DVBFilterType filter0, DVBFilterType filter1)
+{
+    struct BenchListener listeners[BENCH_LISTENERS] = { { filter0, 0 }, { filter1, 0 } };
+    DVBReaderListenerOptions options = {
+        .overflow_policy = DVB_READER_OVERFLOW_DROP_NEWEST,
+        .high_water = 65536,
+    };
+    DVBReader *reader;
+    TsReader *ts_reader;
+    double start, elapsed, best = 0.0;
+    size_t offset, len;
+    gsize delivered[BENCH_LISTENERS] = { 0 };
+    int round, i;
+
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        if (!(reader = dvb_reader_new(NULL, NULL))) {
+            fprintf(stderr, "Could not create the reader\n");
+            exit(1);
+        }
+        for (i = 0; i < BENCH_ACTIVE_PIDS; ++i)
+            dvb_reader_add_active_pid(reader, 0x100 + i, (DVBFilterType)(1 << (i % 4)), BENCH_MAIN_SERVICE);
+        for (i = 0; i < BENCH_LISTENERS; ++i) {
+            listeners[i].delivered = 0;
+            dvb_reader_set_listener(reader, listeners[i].filter, -1, bench_listener_callback, &listeners[i],
+                                    &options);
+            dvb_reader_listener_set_running(reader, -1, bench_listener_callback, &listeners[i], TRUE);
+        }
+        ts_reader = ts_reader_new(klass, reader);
+
+        start = bench_now();
+        for (offset = 0; offset < stream->size; offset += len) {
+            len = MIN(BENCH_CHUNK_SIZE, stream->size - offset);
+            dvb_reader_process_buffer(reader, ts_reader, &stream->data[offset], len);
+        }
+        elapsed = bench_now() - start;
+
+        ts_reader_free(ts_reader);
+        for (i = 0; i < BENCH_LISTENERS; ++i)
+            dvb_reader_remove_listener(reader, -1, bench_listener_callback, &listeners[i]);
+        dvb_reader_destroy(reader);
+
+        if (best == 0.0 || elapsed < best) {
+            best = elapsed;
+            for (i = 0; i < BENCH_LISTENERS; ++i)
+                delivered[i] = (gsize)g_atomic_pointer_get(&listeners[i].delivered);
+        }
+    }
+
+    printf("%-26s %12.0f packets/s  delivered %zu + %zu of %zu packets\n", name, stream->size / TS_SIZE / best,
+           delivered[0], delivered[1], stream->size / TS_SIZE);
+
+    return stream->size / TS_SIZE / best;
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchStream stream = { "clean", 0, 0, BENCH_ACTIVE_PIDS, NULL, 0 };
+    TsReaderClass per_packet = {
+        .handle_packet = bench_handle_packet,
+    };
+    TsReaderClass batched = {
+        .handle_packets = dvb_reader_handle_packets,
+    };
+
+    double before, after;
+
+    bench_stream_generate(&stream);
+
+    /* one listener wanting everything, one only video and audio */
+    before = bench_run(&stream, "before: per-packet", &per_packet, DVB_FILTER_ALL, DVB_FILTER_VIDEO | DVB_FILTER_AUDIO);
+    after = bench_run(&stream, "after: batched", &batched, DVB_FILTER_ALL, DVB_FILTER_VIDEO | DVB_FILTER_AUDIO);
+    printf("%-26s %12.2fx\n", "speedup", after / before);
+    /* all listeners want everything: the passthrough path */
+    before = bench_run(&stream, "before: per-packet (pass)", &per_packet, DVB_FILTER_ALL, DVB_FILTER_ALL);
+    after = bench_run(&stream, "after: batched (pass)", &batched, DVB_FILTER_ALL, DVB_FILTER_ALL);
+    printf("%-26s %12.2fx\n", "speedup", after / before);
+
+    g_free(stream.data);
+
+    return 0;
+}
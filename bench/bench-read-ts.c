@@ -0,0 +1,77 @@
+/* Throughput benchmark for the TS reader.
+ *
+ * Feeds generated streams through ts_reader_push_buffer() in DVR sized chunks and reports MB/s for each
+ * available resync implementation:
+ *   clean    -- valid packets only
+ *   light    -- a few bytes of garbage inserted every 1000 packets
+ *   heavy    -- up to one packet of garbage inserted every 10 packets
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench-stream.h"
+
+#define BENCH_ROUNDS 5
+
+static gboolean bench_count_packet(const uint8_t *packet, void *userdata)
+{
+    ++*(guint64 *)userdata;
+    return TRUE;
+}
+
+static void bench_run(struct BenchStream *stream, TsReaderSyncMethod method)
+{
+    TsReaderClass klass = {
+        .handle_packet = bench_count_packet,
+    };
+    guint64 packets = 0;
+    double start, elapsed, best = 0.0;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        TsReader *reader = ts_reader_new(&klass, &packets);
+        if (!ts_reader_set_sync_method(reader, method)) {
+            ts_reader_free(reader);
+            return;
+        }
+
+        packets = 0;
+        start = bench_now();
+        bench_stream_push(reader, stream);
+        elapsed = bench_now() - start;
+        ts_reader_free(reader);
+
+        if (best == 0.0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("%-6s %-7s %10.1f MB/s  %10" G_GUINT64_FORMAT " packets\n",
+           stream->name, ts_reader_sync_method_name(method),
+           stream->size / best / (1024.0 * 1024.0), packets);
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchStream streams[] = {
+        { "clean", 0, 0, 0, NULL, 0 },
+        { "light", 1000, 16, 0, NULL, 0 },
+        { "heavy", 10, TS_SIZE, 0, NULL, 0 },
+    };
+    TsReaderSyncMethod methods[] = {
+        TS_READER_SYNC_SCALAR,
+        TS_READER_SYNC_SSE2,
+        TS_READER_SYNC_AVX2,
+    };
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(streams); ++i) {
+        bench_stream_generate(&streams[i]);
+        for (j = 0; j < G_N_ELEMENTS(methods); ++j)
+            bench_run(&streams[i], methods[j]);
+        g_free(streams[i].data);
+    }
+
+    return 0;
+}
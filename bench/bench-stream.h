@@ -0,0 +1,79 @@
+#pragma once
+
+/* Helpers shared by the benchmarks: deterministic stream generation and timing. */
+
+#include <glib.h>
+#include <time.h>
+
+#include "read-ts.h"
+
+#define BENCH_STREAM_SIZE (64 * 1024 * 1024)
+#define BENCH_CHUNK_SIZE 65536
+
+struct BenchStream {
+    const char *name;
+    guint32 garbage_interval;    /* insert garbage every n packets, 0 for none */
+    guint32 garbage_max;         /* maximum number of garbage bytes */
+    guint16 pid_count;           /* number of distinct pids, starting at 0x100 */
+    uint8_t *data;
+    size_t size;
+};
+
+static guint32 bench_random_state = 0x2545f491;
+
+static inline guint32 bench_random(void)
+{
+    /* xorshift32, deterministic across runs */
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 17;
+    bench_random_state ^= bench_random_state << 5;
+    return bench_random_state;
+}
+
+static inline void bench_stream_generate(struct BenchStream *stream)
+{
+    size_t offset = 0;
+    guint32 packet = 0;
+    guint32 i, garbage;
+    guint16 pid_count = stream->pid_count ? stream->pid_count : 4;
+
+    stream->data = g_malloc(BENCH_STREAM_SIZE);
+
+    while (offset + 2 * TS_SIZE <= BENCH_STREAM_SIZE) {
+        if (stream->garbage_interval && packet % stream->garbage_interval == stream->garbage_interval - 1) {
+            garbage = 1 + bench_random() % stream->garbage_max;
+            for (i = 0; i < garbage && offset < BENCH_STREAM_SIZE - TS_SIZE; ++i)
+                stream->data[offset++] = (uint8_t)bench_random();
+        }
+
+        ts_init(&stream->data[offset]);
+        ts_set_pid(&stream->data[offset], 0x100 + packet % pid_count);
+        ts_set_payload(&stream->data[offset]);
+        ts_set_cc(&stream->data[offset], packet);
+        /* random payload, contains stray sync bytes like real data */
+        for (i = TS_HEADER_SIZE; i < TS_SIZE; ++i)
+            stream->data[offset + i] = (uint8_t)bench_random();
+
+        offset += TS_SIZE;
+        ++packet;
+    }
+
+    stream->size = offset;
+}
+
+static inline void bench_stream_push(TsReader *reader, struct BenchStream *stream)
+{
+    size_t offset, len;
+
+    for (offset = 0; offset < stream->size; offset += len) {
+        len = MIN(BENCH_CHUNK_SIZE, stream->size - offset);
+        ts_reader_push_buffer(reader, &stream->data[offset], len);
+    }
+}
+
+static inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -512,6 +512,27 @@ err:
     free(filter);
 }
 
+void dvb_tuner_remove_pid(DVBTuner *tuner, uint16_t pid)
+{
+    if (tuner == NULL)
+        return;
+
+    struct PIDFilterList **link = &tuner->pid_filters;
+    struct PIDFilterList *filter;
+
+    while ((filter = *link) != NULL) {
+        if (filter->filter.pid != pid) {
+            link = &filter->next;
+            continue;
+        }
+        *link = filter->next;
+        ioctl(filter->filter.fd, DMX_STOP);
+        close(filter->filter.fd);
+        free(filter);
+        LOG(tuner->logger, "Removed pid %u\n", pid);
+    }
+}
+
 int dvb_tuner_get_fd(DVBTuner *tuner)
 {
     if (tuner)
@@ -613,6 +634,12 @@ void dvb_tuner_add_pid(DVBTuner *tuner, uint16_t pid)
     LOG(tuner->logger, "[Tuner dummy] Add pid %u\n", pid);
 }
 
+/* Dummy */
+void dvb_tuner_remove_pid(DVBTuner *tuner, uint16_t pid)
+{
+    LOG(tuner->logger, "[Tuner dummy] Remove pid %u\n", pid);
+}
+
 /* Dummy */
 int dvb_tuner_get_fd(DVBTuner *tuner)
 {
@@ -29,6 +29,7 @@ int dvb_tuner_tune(DVBTuner *tuner,
 /* Stop the tuner and close all file descriptors, including frontend. */
 void dvb_tuner_stop(DVBTuner *tuner);
 void dvb_tuner_add_pid(DVBTuner *tuner, uint16_t pid);
+void dvb_tuner_remove_pid(DVBTuner *tuner, uint16_t pid);
 
 int dvb_tuner_get_fd(DVBTuner *tuner);
 
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "dvbreader.h"
+#include "read-ts.h"
+
+/* Entry points of the data thread, also driven directly by the benchmarks. */
+
+/* Process a buffer read from the tuner, handing its packets to ts_reader. */
+void dvb_reader_process_buffer(DVBReader *reader, TsReader *ts_reader, const uint8_t *buffer, size_t size);
+/* The handle_packets callback of the reader's TsReader, userdata is the reader. */
+gboolean dvb_reader_handle_packets(const uint8_t *packets, size_t count, void *userdata);
+/* Activate a pid as a PMT would. */
+void dvb_reader_add_active_pid(DVBReader *reader, uint16_t pid, DVBFilterType type, guint8 services);
@@ -1,15 +1,25 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "dvbreader.h"
+#include "dvbreader-internal.h"
 #include "dvbrecorder.h"
 #include "events.h"
 #include "read-ts.h"
+#include <bitstream/mpeg/pes.h>
 #include "dvb-tuner.h"
 
 #include <dvbpsi/dvbpsi.h>
@@ -25,12 +35,106 @@
 #include "descriptors.h"
 #include "epg.h"
 #include "epg-internal.h"
+#include "timeshift-internal.h"
 #include "logging-internal.h"
 
 #ifndef DVB_BUFFER_SIZE
 #define DVB_BUFFER_SIZE 65536
 #endif
 
+#define DVB_READER_PID_COUNT 8192
+#define DVB_READER_MAX_LISTENERS 32
+/* The tuned service and up to seven more of the same transponder. Service i is bit i of a services mask. */
+#define DVB_READER_MAX_SERVICES 8
+#define DVB_READER_MAIN_SERVICE 1
+#define DVB_READER_ALL_SERVICES 0xff
+#define DVB_READER_NO_SERVICE 0xff     /* slot_service of a listener whose program is not demultiplexed */
+#define DVB_READER_PACKET_BATCH 64
+
+#define DVB_LISTENER_BUFFER_SIZE 4096
+#define DVB_READER_CHUNK_PACKETS (DVB_LISTENER_BUFFER_SIZE / TS_SIZE)
+#define DVB_READER_CHUNK_SIZE (DVB_READER_CHUNK_PACKETS * TS_SIZE)
+#define DVB_LISTENER_RAP_WORDS(size) ((size) / TS_SIZE / 32 + 1)
+#define DVB_READER_PAGE_SIZE 4096
+
+#ifndef DVB_READER_MESSAGE_POOL_SIZE
+#define DVB_READER_MESSAGE_POOL_SIZE 256
+#endif
+
+#define DVB_READER_DEFAULT_WRITER_THREADS 2
+#define DVB_READER_RAP_TIMEOUT (5 * G_TIME_SPAN_SECOND)
+#define DVB_READER_DEFAULT_GOP_CACHE_SIZE (4 * 1024 * 1024)
+/* pids of the service kept in the GOP cache; PAT and PMT are sent from the current tables */
+#define DVB_READER_GOP_CACHE_TYPES (DVB_FILTER_VIDEO | DVB_FILTER_AUDIO | DVB_FILTER_TELETEXT | \
+                                    DVB_FILTER_SUBTITLES | DVB_FILTER_PCR | DVB_FILTER_OTHER)
+/* pids listed in a PMT; listeners wanting only some of them get a PMT listing only those */
+#define DVB_READER_PMT_TYPES DVB_READER_GOP_CACHE_TYPES
+#define DVB_READER_PMT_CACHE_SIZE 4
+
+/* Video codec of a pid, telling where its random access points are. */
+enum DVBReaderCodec {
+    DVB_READER_CODEC_NONE = 0,
+    DVB_READER_CODEC_MPEG2,
+    DVB_READER_CODEC_H264,
+    DVB_READER_CODEC_HEVC
+};
+
+/* Per pid dispatch information, indexed by pid. Classifying a packet is a single load. */
+struct DVBPidEntry {
+    guint16 type;        /* DVBFilterType of an active pid, 0 if the pid is not active */
+    guint8  psi_table;   /* DVBRecorderTSTableType decoding this pid, N_TS_TABLE_TYPES if none */
+    guint8  codec;       /* enum DVBReaderCodec of video pids */
+    guint8  services;    /* services the pid belongs to; 0 for inactive pids, which go with the tuned service */
+    guint8  service_pmt; /* additional services whose PMT is on this pid */
+};
+
+/* The current PMT of a service as received, and PMTs rewritten for listener filters, listing only the streams a
+ * filter keeps. These are made when first sent and kept until the next version of the PMT. Written by the data
+ * thread under table_mutex. */
+struct DVBReaderPmtCache {
+    dvbpsi_pmt_t *pmt;
+    struct {
+        guint16 filter;          /* DVB_READER_PMT_TYPES of the filter */
+        uint8_t packet_count;    /* 0 if the entry is unused */
+        uint8_t *data;
+    } entries[DVB_READER_PMT_CACHE_SIZE];
+    guint8 next;                 /* entry replaced next */
+};
+
+/* Another service of the transponder, demultiplexed along with the tuned one. Added and removed under
+ * service_mutex, otherwise owned by the data thread; the tables are replaced under table_mutex. */
+struct DVBReaderService {
+    DVBReader *reader;
+    guint16 program_number;
+    guint8 index;            /* bit of the service in the services masks */
+    guint8 removed;          /* under service_mutex, the data thread frees it */
+    dvbpsi_t *pmt_handle;    /* NULL until the program is found in the PAT */
+    uint16_t pmt_pid;
+    guint8 have_pmt;
+    uint8_t pat_packet_count;
+    uint8_t *pat_data;
+    uint8_t pmt_packet_count;
+    uint8_t *pmt_data;
+    struct DVBReaderPmtCache pmt_cache;
+};
+
+/* Immutable view of the listeners, published by the writers and used by the data thread without locking.
+ * A snapshot holds a reference on each of its listeners. */
+struct DVBReaderListenerSnapshot {
+    gint refcount;
+    guint32 slots_used;
+    struct DVBReaderListener *slots[DVB_READER_MAX_LISTENERS];
+    /* index of the service of each listener */
+    guint8 slot_service[DVB_READER_MAX_LISTENERS];
+    /* listeners wanting a pid, indexed by the type of its pid entry; 0 (inactive pid) is treated as OTHER */
+    guint32 type_listeners[DVB_FILTER_ALL + 1];
+    /* listeners of any of the services in the mask, indexed by the services of a pid entry */
+    guint32 service_listeners[DVB_READER_ALL_SERVICES + 1];
+    /* every listener wants every packet but the original PAT and PMT */
+    gboolean passthrough;
+    DVBTimeshift *timeshift;
+};
+
 struct _DVBReader {
     DVBRecorderEventCallback event_cb;
     gpointer event_data;
@@ -61,8 +165,61 @@ struct _DVBReader {
     guint32 dvbpsi_have_pat : 1;
     guint32 dvbpsi_have_pmt : 1;
     guint32 dvbpsi_have_sdt : 1;
+    guint32 have_video : 1;
+    guint8 video_services;   /* services whose PMT lists video, data thread only */
+
+    struct DVBPidEntry pid_table[DVB_READER_PID_COUNT];
+
+    /* Additional services; slot 0 stands for the tuned one and stays empty. The data thread applies the changes
+     * flagged in service_changes with the next buffer, or when the stream is stopped. */
+    GMutex service_mutex;
+    struct DVBReaderService *services[DVB_READER_MAX_SERVICES];
+    guint service_changes;
+    GArray *pat_programs;    /* struct DVBReaderProgram of the last PAT, data thread only */
+    guint16 ts_id;
+    guint32 listener_slots_used;
+
+    struct DVBReaderListenerSnapshot *listener_snapshot;  /* current snapshot, replaced under listener_mutex */
+    struct DVBReaderListenerSnapshot *snapshot_hazard;    /* snapshot the data thread is using, or NULL */
+    struct DVBReaderListenerSnapshot *active_snapshot;    /* data thread only, valid in the psi callbacks */
+    guint listener_reset;                                 /* slots to reset and send the tables to */
+
+    /* Pool of DATA messages. Only the data thread takes messages, any thread returns them. */
+    struct DVBReaderListenerMessage *message_slab;
+    struct DVBReaderListenerMessage *message_free;        /* returned messages */
+    struct DVBReaderListenerMessage *message_cache;       /* data thread only */
+    guint message_pool_exhausted;
+
+    /* Chunk shared by all listeners, filled by the data thread with the packets wanted by any listener.
+     * chunk_masks holds the listeners wanting each packet. */
+    struct DVBReaderListenerMessage *chunk;
+    guint chunk_packets;
+    guint32 chunk_masks[DVB_READER_CHUNK_PACKETS];
+    gboolean chunk_passthrough;   /* the chunk was filled by the fast path, chunk_masks are unused */
+    gsize passthrough_bytes;
+    guint shared_chunks;
+    guint copied_packets;
+    guint spliced_chunks;
+    guint random_access_points;
+
+    guint32 rap_waiting;   /* data thread only: listeners held back until the next random access point */
+
+    /* Packets of the service since the last random access point, passed to listeners starting at one. Owned by
+     * the data thread, gop_cache_limit is set by any thread and applied at the next random access point. */
+    uint8_t *gop_cache;
+    gsize gop_cache_capacity;
+    gsize gop_cache_size;
+    gsize gop_cache_limit;
+    gboolean gop_cache_valid;
+    guint gop_cache_overflows;
+    guint gop_cache_replays;
+    DVBTimeshift *timeshift;   /* replaced under listener_mutex, the data thread uses the snapshot's */
+    gint64 read_time;      /* when the buffer being processed was read */
+
+    /* Workers shared by the listeners without a thread of their own, under listener_mutex. */
+    GPtrArray *writer_pool;
+    guint writer_threads;
 
-    GList *active_pids;
     DVBTuner *tuner;
     GMutex tuner_mutex;
 
@@ -70,21 +227,58 @@ struct _DVBReader {
     int control_pipe_stream[2];
     GThread *data_thread;
 
+    /* written by the data thread; replaced under table_mutex for the getters called from other threads */
+    GMutex table_mutex;
     uint8_t pat_packet_count;
     uint8_t *pat_data;
     uint8_t pmt_packet_count;
     uint8_t *pmt_data;
+    struct DVBReaderPmtCache pmt_cache;
 
     GList *eit_tables;     /* each entry contains a list of events belonging to the same table*/
 };
 
+struct DVBReaderProgram {
+    guint16 number;
+    guint16 pmt_pid;
+};
+
 struct EITable {
     guint8 table_id;
     guint8 version;
     GList *events;
 };
 
-#define DVB_LISTENER_BUFFER_SIZE 4096
+#define DVB_LISTENER_RING_SIZE 256    /* power of two */
+#define DVB_LISTENER_DEFAULT_HIGH_WATER 1024
+#define DVB_LISTENER_REPORT_INTERVAL (G_TIME_SPAN_SECOND)
+#define DVB_LISTENER_DEFAULT_MAX_LATENCY 200     /* ms */
+#define DVB_LISTENER_WRITE_TIMEOUT (10 * G_TIME_SPAN_SECOND)
+#define DVB_LISTENER_SERVICE_BUDGET 64          /* messages handled in a row before the next listener's turn */
+#define DVB_LISTENER_GATHER_MAX 64              /* queued chunks written by one syscall, at most IOV_MAX */
+#define DVB_LISTENER_SPLICE_HELD 256
+#define DVB_LISTENER_SPLICE_RECLAIM_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+/* Chunk mapped into a pipe by vmsplice. Its memory must not be reused until the pipe reader consumed it. */
+struct DVBReaderSplicedChunk {
+    struct DVBReaderListenerMessage *msg;
+    guint64 end;             /* output position after the chunk */
+};
+
+/* Thread serving listeners. Each listener's eventfd and, while a write is pending, its fd are registered with the
+ * epoll instance. Events only wake the worker up, it then looks at all of its listeners. */
+struct DVBReaderWorker {
+    DVBReader *reader;
+    GThread *thread;
+    int epoll_fd;
+    int wakeup_fd;
+    GMutex lock;
+    GCond detach_cond;
+    GPtrArray *listeners;    /* under lock; added by any thread, removed by the worker only */
+    guint quit;
+    guint orphaned;          /* the worker frees itself when quitting */
+    guint8 dedicated;
+};
 
 struct DVBReaderListener {
     int fd;
@@ -94,22 +288,81 @@ struct DVBReaderListener {
     DVBReader *reader;
 
     DVBFilterType filter;
+    guint16 program_number;  /* 0 for the tuned service */
+    guint8 slot;             /* index into the listener bitmasks of the snapshot */
+    gint refcount;
 
     guint32 error_count;
-    GQueue message_queue;
-    GCond  message_cond;
-    GMutex message_lock;
-    GThread *worker_thread;
-
+    struct DVBReaderWorker *worker;
+    guint8 detached;         /* under worker->lock */
+
+    /* DATA messages. The data thread is the only producer, the worker thread the only consumer. Messages not
+     * fitting into the ring go to the overflow queue, and so do all following until the consumer emptied it. */
+    struct DVBReaderListenerMessage *ring[DVB_LISTENER_RING_SIZE];
+    guint ring_head;         /* written by the producer */
+    guint ring_tail;         /* written by the consumer */
+    guint pushed;            /* messages pushed, producer */
+    guint popped;            /* messages popped, consumer */
+    GQueue overflow;
+    guint overflow_length;
+    GMutex message_lock;     /* protects overflow */
+
+    /* Control messages are passed out of band, bit (1 << type) is set while a message is pending. */
+    guint control;
+    guint drop_before;       /* DROP and SKIP discard the messages pushed before this one */
+    guint running;
+
+    DVBReaderOverflowPolicy overflow_policy;
+    guint high_water;
+    guint low_water;
+    guint dropped;           /* DATA messages dropped, counted by both threads */
+    gsize chunk_size;
+    gint64 max_latency;      /* us */
+    guint8 start_at_rap;
+
+    /* The data thread wakes up the worker through the eventfd only if waiting was set when the worker last looked
+     * for work. Control messages always wake it up. */
+    int wakeup_fd;
+    guint waiting;
+
+    /* owned by the data thread */
     gsize buffer_size;
+    gint64 buffer_time;      /* read time of the first packet in buffer */
+    guint32 buffer_raps;     /* random access points in buffer, as in a message */
     uint8_t buffer[DVB_LISTENER_BUFFER_SIZE];
-
-    guint32 have_pat    : 1;
-    guint32 have_pmt    : 1;
+    guint8 have_pat;
+    guint8 have_pmt;
+    guint8 dropping;
+    gint64 rap_wait_since;   /* read time the listener started waiting for a random access point, 0 before */
+
+    /* owned by the worker thread; messages are collected here if chunk_size exceeds a message */
+    uint8_t *coalesce_buffer;
+    guint32 *coalesce_raps;  /* random access points in coalesce_buffer, bit n % 32 of word n / 32 for packet n */
+    gsize coalesce_capacity;
+    gsize coalesce_size;
+    gint64 coalesce_deadline;
+    guint dropped_reported;
+    gint64 dropped_report_time;
+    /* Chunks handed to the fd but not completely written yet, gathered into one syscall. out_msgs[i] is NULL
+     * for the coalesce buffer. out_iov[out_index] is advanced as it is written. */
+    struct iovec out_iov[DVB_LISTENER_GATHER_MAX];
+    struct DVBReaderListenerMessage *out_msgs[DVB_LISTENER_GATHER_MAX];
+    guint out_count;         /* 0 if nothing is pending */
+    guint out_index;
+    gint64 out_since;        /* last progress */
+    guint64 out_total;       /* bytes written to the fd */
+    gsize write_bytes;       /* statistics, read by any thread */
+    gsize write_calls;
+    /* vmsplice output: chunks still referenced by the pipe, oldest at spliced_tail */
+    struct DVBReaderSplicedChunk spliced[DVB_LISTENER_SPLICE_HELD];
+    guint spliced_head;
+    guint spliced_tail;
     guint32 write_error : 1;
     guint32 eos         : 1;
-    guint32 terminate   : 1;
-    guint32 running     : 1;
+    guint32 out_polling : 1;
+    guint32 splice      : 1;  /* set when added, cleared if the kernel refuses vmsplice */
+    guint32 out_splice  : 1;  /* the pending output goes out by vmsplice */
+    guint32 out_spliced : 1;  /* and some of it already did */
 };
 
 enum DVBReaderListenerMessageType {
@@ -117,21 +370,35 @@ enum DVBReaderListenerMessageType {
     DVB_READER_LISTENER_MESSAGE_DROP,
     DVB_READER_LISTENER_MESSAGE_QUIT,
     DVB_READER_LISTENER_MESSAGE_EOS,
-    DVB_READER_LISTENER_MESSAGE_CONTINUE
+    DVB_READER_LISTENER_MESSAGE_CONTINUE,
+    DVB_READER_LISTENER_MESSAGE_SKIP
 };
 
+/* Messages are page aligned, so a chunk is mapped into a pipe as a single page. */
 struct DVBReaderListenerMessage {
-    enum DVBReaderListenerMessageType type;
+    uint8_t data[DVB_READER_CHUNK_SIZE] __attribute__((aligned(DVB_READER_PAGE_SIZE)));
+    struct DVBReaderListenerMessage *next;   /* free list link */
+    gint refcount;                           /* shared chunks are queued to several listeners */
+    gint64 timestamp;                        /* read time of the first packet */
     gsize data_size;
-    uint8_t data[DVB_LISTENER_BUFFER_SIZE];
+    guint32 raps;                            /* bit n set if packet n is a random access point */
 };
 
-struct DVBPidDescription {
-    uint16_t pid;
-    DVBFilterType type;
+/* Data passed to a listener callback on this thread, for dvb_reader_packet_is_random_access_point(). */
+struct DVBReaderDelivery {
+    const uint8_t *data;
+    gsize size;
+    const guint32 *raps;                     /* bit n % 32 of word n / 32 for packet n */
 };
 
+static GPrivate dvb_reader_delivery = G_PRIVATE_INIT(NULL);
+
 void dvb_reader_reset(DVBReader *reader);
+void dvb_reader_set_table_pid(DVBReader *reader, DVBRecorderTSTableType table, uint16_t pid);
+struct DVBReaderListenerSnapshot *dvb_reader_listener_snapshot_new(DVBReader *reader);
+struct DVBReaderListenerSnapshot *dvb_reader_listener_snapshot_ref(struct DVBReaderListenerSnapshot *snapshot);
+void dvb_reader_listener_snapshot_unref(struct DVBReaderListenerSnapshot *snapshot);
+struct DVBReaderListenerSnapshot *dvb_reader_publish_listener_snapshot(DVBReader *reader);
 
 void dvb_reader_push_event(DVBReader *reader, DVBRecorderEvent *event);
 void dvb_reader_push_event_next(DVBReader *reader, DVBRecorderEvent *event);
@@ -140,31 +407,49 @@ DVBRecorderEvent *dvb_reader_pop_event(DVBReader *reader);
 gpointer dvb_reader_event_thread_proc(DVBReader *reader);
 gpointer dvb_reader_data_thread_proc(DVBReader *reader);
 
+static guint8 dvb_reader_find_service(DVBReader *reader, guint16 program_number);
+static void dvb_reader_update_services(DVBReader *reader);
+static void dvb_reader_reset_services(DVBReader *reader);
+static void dvb_reader_generate_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt, uint16_t pid, uint8_t **data, uint8_t *count);
+static void dvb_reader_pmt_cache_set(DVBReader *reader, struct DVBReaderPmtCache *cache, dvbpsi_pmt_t *pmt);
 void dvb_reader_rewrite_pat(DVBReader *reader, uint16_t ts_id, uint16_t program_number, uint16_t program_map_pid);
 void dvb_reader_rewrite_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt);
 void dvb_reader_listener_send_pat(DVBReader *reader, struct DVBReaderListener *listener);
 void dvb_reader_listener_send_pmt(DVBReader *reader, struct DVBReaderListener *listener);
-gpointer dvb_reader_listener_thread_proc(struct DVBReaderListener *listener);
-void dvb_reader_listener_send_message(struct DVBReaderListener *listener, enum DVBReaderListenerMessageType type,
-                                      uint8_t *data, gsize size, gboolean immediately);
-void dvb_reader_listener_broadcast_message(DVBReader *reader, enum DVBReaderListenerMessageType type,
-                                           uint8_t *data, gsize size, gboolean immediately);
+struct DVBReaderWorker *dvb_reader_worker_new(DVBReader *reader, gboolean dedicated);
+void dvb_reader_worker_free(struct DVBReaderWorker *worker);
+void dvb_reader_worker_attach(struct DVBReaderWorker *worker, struct DVBReaderListener *listener);
+void dvb_reader_worker_detach(struct DVBReaderWorker *worker, struct DVBReaderListener *listener);
+gpointer dvb_reader_worker_thread_proc(struct DVBReaderWorker *worker);
+struct DVBReaderListenerMessage *dvb_reader_listener_message_new(DVBReader *reader);
+void dvb_reader_listener_message_free(struct DVBReaderListenerMessage *msg, DVBReader *reader);
+void dvb_reader_listener_queue_message(struct DVBReaderListener *listener, struct DVBReaderListenerMessage *msg);
+void dvb_reader_listener_send_data(struct DVBReaderListener *listener, const uint8_t *data, gsize size);
+void dvb_reader_listener_send_control(struct DVBReaderListener *listener, enum DVBReaderListenerMessageType type);
+void dvb_reader_listener_broadcast_control(DVBReader *reader, enum DVBReaderListenerMessageType type);
+void dvb_reader_listener_drop_data(struct DVBReaderListener *listener);
 struct DVBReaderListenerMessage *dvb_reader_listener_pop_message(struct DVBReaderListener *listener);
-void dvb_reader_listener_drop_data_messages(struct DVBReaderListener *listener);
-void dvb_reader_listener_push_packet(struct DVBReaderListener *listener, DVBFilterType type, const uint8_t *packet);
-gint dvb_reader_listener_write_data_full(struct DVBReaderListener *listener, const uint8_t *data, gsize size);
+guint dvb_reader_listener_drop_data_messages(struct DVBReaderListener *listener, gboolean all);
+void dvb_reader_listener_push_packet(struct DVBReaderListener *listener, const uint8_t *packet, gboolean rap);
+void dvb_reader_listener_wait_for_rap(DVBReader *reader, struct DVBReaderListener *listener, guint8 service);
+void dvb_reader_listener_setup_coalescing(struct DVBReaderListener *listener);
+void dvb_reader_listener_poll_output(struct DVBReaderListener *listener, gboolean enable);
 void dvb_reader_listener_clear_queue(struct DVBReaderListener *listener);
+struct DVBReaderListener *dvb_reader_listener_ref(struct DVBReaderListener *listener);
+void dvb_reader_listener_unref(struct DVBReaderListener *listener);
 void dvb_reader_listener_free(struct DVBReaderListener *listener);
 
 void dvb_reader_dvbpsi_message(dvbpsi_t *handle, const dvbpsi_msg_level_t level, const char *msg);
 void dvb_reader_dvbpsi_pat_cb(DVBReader *reader, dvbpsi_pat_t *pat);
 void dvb_reader_dvbpsi_pmt_cb(DVBReader *reader, dvbpsi_pmt_t *pmt);
+void dvb_reader_dvbpsi_service_pmt_cb(struct DVBReaderService *service, dvbpsi_pmt_t *pmt);
 void dvb_reader_dvbpsi_eit_cb(DVBReader *reader, dvbpsi_eit_t *eit);
 void dvb_reader_dvbpsi_sdt_cb(DVBReader *reader, dvbpsi_sdt_t *sdt);
 void dvb_reader_dvbpsi_rst_cb(DVBReader *reader, dvbpsi_rst_t *rst);
 void dvb_reader_dvbpsi_demux_new_subtable(dvbpsi_t *handle, uint8_t table_id, uint16_t extension, void *userdata);
-gboolean dvb_reader_write_packet(DVBReader *reader, const uint8_t *packet);
-gboolean dvb_reader_handle_packet(const uint8_t *packet, void *userdata);
+void dvb_reader_write_packets(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot,
+                              const uint8_t *packets, size_t count);
+void dvb_reader_flush_chunk(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot);
 
 void dvb_reader_set_logger(DVBReader *reader, DVBRecorderLogger *logger)
 {
@@ -208,12 +493,32 @@ DVBReader *dvb_reader_new(DVBRecorderEventCallback cb, gpointer userdata)
     g_mutex_init(&reader->listener_mutex);
     g_mutex_init(&reader->event_mutex);
     g_mutex_init(&reader->tuner_mutex);
+    g_mutex_init(&reader->table_mutex);
+    g_mutex_init(&reader->service_mutex);
     g_cond_init(&reader->event_cond);
     g_queue_init(&reader->event_queue);
 
     reader->control_pipe_stream[0] = -1;
     reader->control_pipe_stream[1] = -1;
 
+    int i;
+    if (posix_memalign((void **)&reader->message_slab, DVB_READER_PAGE_SIZE,
+                       DVB_READER_MESSAGE_POOL_SIZE * sizeof(struct DVBReaderListenerMessage)) != 0)
+        g_error("Could not allocate the message pool\n");
+    for (i = 0; i < DVB_READER_MESSAGE_POOL_SIZE; ++i) {
+        reader->message_slab[i].next = reader->message_cache;
+        reader->message_cache = &reader->message_slab[i];
+    }
+
+    reader->listener_snapshot = dvb_reader_listener_snapshot_new(reader);
+
+    reader->writer_pool = g_ptr_array_new();
+    reader->writer_threads = DVB_READER_DEFAULT_WRITER_THREADS;
+
+    reader->gop_cache_limit = DVB_READER_DEFAULT_GOP_CACHE_SIZE;
+
+    reader->pat_programs = g_array_new(FALSE, FALSE, sizeof(struct DVBReaderProgram));
+
     dvb_reader_reset(reader);
 
     reader->tuner = dvb_tuner_new(0);
@@ -269,41 +574,65 @@ void dvb_reader_reset(DVBReader *reader)
         }
     }
 
-    reader->dvbpsi_table_pids[TS_TABLE_PAT] = 0;
+    for (i = 0; i < DVB_READER_PID_COUNT; ++i) {
+        reader->pid_table[i].type = 0;
+        reader->pid_table[i].psi_table = N_TS_TABLE_TYPES;
+        reader->pid_table[i].codec = DVB_READER_CODEC_NONE;
+        reader->pid_table[i].services = 0;
+        reader->pid_table[i].service_pmt = 0;
+    }
+
     reader->dvbpsi_table_pids[TS_TABLE_PMT] = 0xffff;
-    reader->dvbpsi_table_pids[TS_TABLE_EIT] = 18;
-    reader->dvbpsi_table_pids[TS_TABLE_SDT] = 17;
-    reader->dvbpsi_table_pids[TS_TABLE_RST] = 19;
+    dvb_reader_set_table_pid(reader, TS_TABLE_PAT, 0);
+    dvb_reader_set_table_pid(reader, TS_TABLE_EIT, 18);
+    dvb_reader_set_table_pid(reader, TS_TABLE_SDT, 17);
+    dvb_reader_set_table_pid(reader, TS_TABLE_RST, 19);
 
     reader->dvbpsi_have_pat = 0;
     reader->dvbpsi_have_pmt = 0;
     reader->dvbpsi_have_sdt = 0;
+    reader->have_video = 0;
+    reader->video_services = 0;
+    reader->gop_cache_size = 0;
+    reader->gop_cache_valid = FALSE;
 
     /* tuner_fd */
     reader->tuner_fd = -1;
 
+    g_mutex_lock(&reader->table_mutex);
     reader->pat_packet_count = 0;
     reader->pmt_packet_count = 0;
     g_free(reader->pat_data);
     g_free(reader->pmt_data);
     reader->pat_data = NULL;
     reader->pmt_data = NULL;
+    g_mutex_unlock(&reader->table_mutex);
+    dvb_reader_pmt_cache_set(reader, &reader->pmt_cache, NULL);
+
+    dvb_reader_reset_services(reader);
 
+    /* The data thread is not running, so its part of the listeners may be reset here. */
     GList *tmp;
     struct DVBReaderListener *listener;
+    g_mutex_lock(&reader->listener_mutex);
+    reader->rap_waiting = 0;
     for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
         listener = (struct DVBReaderListener *)tmp->data;
         if (listener) {
-            dvb_reader_listener_clear_queue(listener);
+            dvb_reader_listener_drop_data(listener);
+            listener->buffer_size = 0;
             listener->have_pat = 0;
             listener->have_pmt = 0;
+            dvb_reader_listener_wait_for_rap(reader, listener, reader->listener_snapshot->slot_service[listener->slot]);
         }
     }
+    g_atomic_int_set(&reader->listener_reset, 0);
+    if (reader->timeshift)
+        dvb_timeshift_discontinuity(reader->timeshift);
+    g_mutex_unlock(&reader->listener_mutex);
 
     dvb_reader_free_eit_tables(reader->eit_tables);
     reader->eit_tables = NULL;
-    g_list_free_full(reader->active_pids, g_free);
-    reader->active_pids = NULL;
 
     dvb_tuner_stop(reader->tuner);
 }
@@ -328,8 +657,25 @@ void dvb_reader_destroy(DVBReader *reader)
     g_queue_foreach(&reader->event_queue, (GFunc)dvb_recorder_event_destroy, NULL);
     g_queue_clear(&reader->event_queue);
 
-    g_list_free_full(reader->listeners, (GDestroyNotify)dvb_reader_listener_free);
-    g_list_free_full(reader->active_pids, g_free);
+    dvb_reader_listener_snapshot_unref(reader->listener_snapshot);
+    g_list_free_full(reader->listeners, (GDestroyNotify)dvb_reader_listener_unref);
+    dvb_timeshift_unref(reader->timeshift);
+
+    guint i;
+    for (i = 1; i < DVB_READER_MAX_SERVICES; ++i) {
+        if (reader->services[i])
+            reader->services[i]->removed = 1;
+    }
+    dvb_reader_reset_services(reader);
+    g_array_free(reader->pat_programs, TRUE);
+    dvb_reader_pmt_cache_set(reader, &reader->pmt_cache, NULL);
+
+    for (i = 0; i < reader->writer_pool->len; ++i)
+        dvb_reader_worker_free(g_ptr_array_index(reader->writer_pool, i));
+    g_ptr_array_free(reader->writer_pool, TRUE);
+
+    free(reader->message_slab);
+    g_free(reader->gop_cache);
 
     dvb_tuner_free(reader->tuner);
 
@@ -344,50 +690,165 @@ DVBStreamStatus dvb_reader_get_stream_status(DVBReader *reader)
     return reader->status;
 }
 
-static gint _dvb_reader_find_pid(struct DVBPidDescription *desc, uint16_t pid)
+/* Set the pid a psi table is decoded from. */
+void dvb_reader_set_table_pid(DVBReader *reader, DVBRecorderTSTableType table, uint16_t pid)
+{
+    uint16_t old_pid = reader->dvbpsi_table_pids[table];
+
+    if (old_pid < DVB_READER_PID_COUNT && reader->pid_table[old_pid].psi_table == table)
+        reader->pid_table[old_pid].psi_table = N_TS_TABLE_TYPES;
+
+    reader->dvbpsi_table_pids[table] = pid;
+    if (pid < DVB_READER_PID_COUNT)
+        reader->pid_table[pid].psi_table = table;
+}
+
+/* PAT and PMT are never passed through, listeners get the rewritten tables instead. */
+static inline gboolean dvb_reader_listener_wants_type(struct DVBReaderListener *listener, DVBFilterType type)
+{
+    return ((listener->filter & (DVB_FILTER_ALL & ~(DVB_FILTER_PAT | DVB_FILTER_PMT))) & type) != 0;
+}
+
+/* Index of the service of a program, 0 for the tuned one. Call with service_mutex held. */
+static guint8 dvb_reader_find_service(DVBReader *reader, guint16 program_number)
 {
-    if (desc->pid == pid)
+    guint8 i;
+
+    if (program_number == 0)
         return 0;
-    return 1;
+    for (i = 1; i < DVB_READER_MAX_SERVICES; ++i) {
+        if (reader->services[i] && !reader->services[i]->removed &&
+                reader->services[i]->program_number == program_number)
+            return i;
+    }
+
+    return DVB_READER_NO_SERVICE;
 }
 
-void dvb_reader_add_active_pid(DVBReader *reader, uint16_t pid, DVBFilterType type)
+/* Build a snapshot of the current listeners. Call with listener_mutex held. */
+struct DVBReaderListenerSnapshot *dvb_reader_listener_snapshot_new(DVBReader *reader)
 {
-    FLOG("\n");
-    LOG(reader->logger, "Add active pid: %u, type 0x%04x\n", pid, type);
+    struct DVBReaderListenerSnapshot *snapshot = g_malloc0(sizeof(struct DVBReaderListenerSnapshot));
+    struct DVBReaderListener *listener;
+    GList *tmp;
+    guint32 type, services;
+    guint8 service;
 
-    struct DVBPidDescription *desc = NULL;
-    GList *link;
-    if ((link = g_list_find_custom(reader->active_pids,
-                                   GUINT_TO_POINTER(pid),
-                                   (GCompareFunc)_dvb_reader_find_pid)) != NULL
-            && link->data != NULL) {
-        desc = (struct DVBPidDescription *)link->data;
-        LOG(reader->logger, "Double PID added, adding type: %u (type 0x%04x | 0x%04x)\n", pid, desc->type, type);
-        desc->type |= type;
-        return;
+    snapshot->refcount = 1;
+
+    g_mutex_lock(&reader->service_mutex);
+    for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
+        listener = (struct DVBReaderListener *)tmp->data;
+        snapshot->slots[listener->slot] = dvb_reader_listener_ref(listener);
+        snapshot->slots_used |= 1u << listener->slot;
+
+        service = dvb_reader_find_service(reader, listener->program_number);
+        snapshot->slot_service[listener->slot] = service;
+        for (services = 0; service != DVB_READER_NO_SERVICE && services <= DVB_READER_ALL_SERVICES; ++services) {
+            if ((services ? services : DVB_READER_MAIN_SERVICE) & (1u << service))
+                snapshot->service_listeners[services] |= 1u << listener->slot;
+        }
+
+        for (type = 1; type <= DVB_FILTER_ALL; ++type) {
+            if (dvb_reader_listener_wants_type(listener, (DVBFilterType)type))
+                snapshot->type_listeners[type] |= 1u << listener->slot;
+        }
+    }
+    g_mutex_unlock(&reader->service_mutex);
+    snapshot->type_listeners[0] = snapshot->type_listeners[DVB_FILTER_OTHER];
+    snapshot->timeshift = dvb_timeshift_ref(reader->timeshift);
+
+    /* listeners of other services want other pids, those wanting a stream only for its PCR fewer packets */
+    snapshot->passthrough = snapshot->slots_used != 0 &&
+                            snapshot->service_listeners[DVB_READER_MAIN_SERVICE] == snapshot->slots_used;
+    for (type = 0; type <= DVB_FILTER_ALL; ++type) {
+        if (snapshot->type_listeners[type] != 0 && snapshot->type_listeners[type] != snapshot->slots_used)
+            snapshot->passthrough = FALSE;
+        if ((type & DVB_FILTER_PCR) && type != DVB_FILTER_PCR &&
+                (snapshot->type_listeners[type] & ~snapshot->type_listeners[type & ~DVB_FILTER_PCR]))
+            snapshot->passthrough = FALSE;
     }
-    desc = g_malloc0(sizeof(struct DVBPidDescription));
 
-    desc->pid = pid;
-    desc->type = type;
+    return snapshot;
+}
 
-    g_mutex_lock(&reader->tuner_mutex);
-    dvb_tuner_add_pid(reader->tuner, pid);
-    g_mutex_unlock(&reader->tuner_mutex);
+struct DVBReaderListenerSnapshot *dvb_reader_listener_snapshot_ref(struct DVBReaderListenerSnapshot *snapshot)
+{
+    if (snapshot)
+        g_atomic_int_inc(&snapshot->refcount);
+    return snapshot;
+}
+
+void dvb_reader_listener_snapshot_unref(struct DVBReaderListenerSnapshot *snapshot)
+{
+    guint32 used;
+
+    if (!snapshot || !g_atomic_int_dec_and_test(&snapshot->refcount))
+        return;
 
-    reader->active_pids = g_list_prepend(reader->active_pids, desc);
+    for (used = snapshot->slots_used; used; used &= used - 1)
+        dvb_reader_listener_unref(snapshot->slots[__builtin_ctz(used)]);
+    dvb_timeshift_unref(snapshot->timeshift);
+    g_free(snapshot);
 }
 
-DVBFilterType dvb_reader_get_active_pid_type(DVBReader *reader, uint16_t pid)
+/* The data thread announces the snapshot it uses in snapshot_hazard, and checks that it is still the current
+ * one afterwards. A writer replacing the snapshot therefore knows that the old one is no longer used as soon as
+ * the hazard points elsewhere. */
+static struct DVBReaderListenerSnapshot *dvb_reader_acquire_listener_snapshot(DVBReader *reader)
 {
-    GList *tmp;
-    for (tmp = reader->active_pids; tmp; tmp = g_list_next(tmp)) {
-        if (((struct DVBPidDescription *)tmp->data)->pid == pid)
-            return ((struct DVBPidDescription *)tmp->data)->type;
+    struct DVBReaderListenerSnapshot *snapshot;
+
+    do {
+        snapshot = g_atomic_pointer_get(&reader->listener_snapshot);
+        g_atomic_pointer_set(&reader->snapshot_hazard, snapshot);
+    } while (snapshot != g_atomic_pointer_get(&reader->listener_snapshot));
+
+    return snapshot;
+}
+
+static inline void dvb_reader_release_listener_snapshot(DVBReader *reader)
+{
+    g_atomic_pointer_set(&reader->snapshot_hazard, NULL);
+}
+
+/* Publish a snapshot of the current listeners. Call with listener_mutex held. Returns the old snapshot once the
+ * data thread has stopped using it; the caller drops it, preferably after releasing the lock, since this may free
+ * listeners. The data thread holds a snapshot for a single batch only, so the wait is short. */
+struct DVBReaderListenerSnapshot *dvb_reader_publish_listener_snapshot(DVBReader *reader)
+{
+    struct DVBReaderListenerSnapshot *snapshot = dvb_reader_listener_snapshot_new(reader);
+    struct DVBReaderListenerSnapshot *old = reader->listener_snapshot;
+
+    g_atomic_pointer_set(&reader->listener_snapshot, snapshot);
+
+    while (g_atomic_pointer_get(&reader->snapshot_hazard) == old)
+        g_usleep(50);
+
+    return old;
+}
+
+void dvb_reader_add_active_pid(DVBReader *reader, uint16_t pid, DVBFilterType type, guint8 services)
+{
+    FLOG("\n");
+    LOG(reader->logger, "Add active pid: %u, type 0x%04x\n", pid, type);
+
+    if (pid >= DVB_READER_PID_COUNT)
+        return;
+
+    struct DVBPidEntry *entry = &reader->pid_table[pid];
+
+    if (entry->type) {
+        LOG(reader->logger, "Double PID added, adding type: %u (type 0x%04x | 0x%04x)\n", pid, entry->type, type);
+    }
+    else {
+        g_mutex_lock(&reader->tuner_mutex);
+        dvb_tuner_add_pid(reader->tuner, pid);
+        g_mutex_unlock(&reader->tuner_mutex);
     }
 
-    return DVB_FILTER_OTHER;
+    entry->type |= type;
+    entry->services |= services;
 }
 
 static gint dvb_reader_compare_listener_fd(struct DVBReaderListener *listener, gpointer fd)
@@ -400,18 +861,217 @@ static gint dvb_reader_compare_listener_fd(struct DVBReaderListener *listener, g
     return 1;
 }
 
-static gint dvb_reader_compare_listener_cb(struct DVBReaderListener *listener, gpointer callback)
+struct DVBReaderListenerKey {
+    DVBReaderListenerCallback callback;
+    gpointer userdata;
+};
+
+static gint dvb_reader_compare_listener_cb(struct DVBReaderListener *listener, struct DVBReaderListenerKey *key)
 {
     FLOG("\n");
     if (listener == NULL)
         return -1;
-    if (listener->callback == callback)
+    if (listener->callback == key->callback && listener->userdata == key->userdata)
         return 0;
     return 1;
 }
 
+/* Listeners are identified by their fd, or by callback and userdata if they have none, so one callback may serve
+ * several listeners. Call with listener_mutex held. */
+static GList *dvb_reader_find_listener(DVBReader *reader, int fd, DVBReaderListenerCallback callback,
+                                       gpointer userdata)
+{
+    struct DVBReaderListenerKey key = { callback, userdata };
+
+    if (fd >= 0)
+        return g_list_find_custom(reader->listeners, GINT_TO_POINTER(fd), (GCompareFunc)dvb_reader_compare_listener_fd);
+    return g_list_find_custom(reader->listeners, &key, (GCompareFunc)dvb_reader_compare_listener_cb);
+}
+
+static void dvb_reader_listener_set_options(struct DVBReaderListener *listener, const DVBReaderListenerOptions *options)
+{
+    listener->overflow_policy = options ? options->overflow_policy : DVB_READER_OVERFLOW_DROP_NEWEST;
+    listener->high_water = options && options->high_water ? options->high_water : DVB_LISTENER_DEFAULT_HIGH_WATER;
+    listener->low_water = options && options->low_water ? options->low_water : listener->high_water / 2;
+    if (listener->low_water >= listener->high_water)
+        listener->low_water = listener->high_water - 1;
+
+    /* Chunks are never smaller than a message; larger chunks are collected by the worker thread. */
+    if (options && options->chunk_size > DVB_LISTENER_BUFFER_SIZE)
+        g_atomic_pointer_set(&listener->chunk_size, (options->chunk_size / TS_SIZE) * TS_SIZE);
+    else
+        g_atomic_pointer_set(&listener->chunk_size, (DVB_LISTENER_BUFFER_SIZE / TS_SIZE) * TS_SIZE);
+    listener->max_latency = (options && options->max_latency ? options->max_latency
+                                                             : DVB_LISTENER_DEFAULT_MAX_LATENCY) * G_TIME_SPAN_MILLISECOND;
+    listener->start_at_rap = options && options->start_at_rap;
+    listener->program_number = options ? options->program_number : 0;
+}
+
+/* Pick the least loaded shared worker, starting another one while the pool is not full. Call with
+ * listener_mutex held. */
+static struct DVBReaderWorker *dvb_reader_get_pool_worker(DVBReader *reader)
+{
+    struct DVBReaderWorker *worker, *best = NULL;
+    guint i, load, best_load = G_MAXUINT;
+
+    for (i = 0; i < reader->writer_pool->len && i < reader->writer_threads; ++i) {
+        worker = g_ptr_array_index(reader->writer_pool, i);
+        g_mutex_lock(&worker->lock);
+        load = worker->listeners->len;
+        g_mutex_unlock(&worker->lock);
+        if (load < best_load) {
+            best = worker;
+            best_load = load;
+        }
+    }
+
+    if (!best || (best_load > 0 && reader->writer_pool->len < reader->writer_threads)) {
+        best = dvb_reader_worker_new(reader, FALSE);
+        g_ptr_array_add(reader->writer_pool, best);
+    }
+
+    return best;
+}
+
+void dvb_reader_set_gop_cache_size(DVBReader *reader, gsize size)
+{
+    FLOG("\n");
+    g_return_if_fail(reader != NULL);
+
+    g_atomic_pointer_set(&reader->gop_cache_limit, size);
+}
+
+gboolean dvb_reader_set_timeshift_size(DVBReader *reader, gsize size)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    struct DVBReaderListenerSnapshot *old_snapshot;
+    DVBTimeshift *old_timeshift;
+    DVBTimeshift *timeshift = NULL;
+
+    if (size) {
+        timeshift = dvb_timeshift_new(size, reader->logger);
+        if (!timeshift)
+            return FALSE;
+    }
+
+    g_mutex_lock(&reader->listener_mutex);
+    old_timeshift = reader->timeshift;
+    reader->timeshift = timeshift;
+    old_snapshot = dvb_reader_publish_listener_snapshot(reader);
+    g_mutex_unlock(&reader->listener_mutex);
+
+    /* cursors keep the old ring until they are freed */
+    dvb_reader_listener_snapshot_unref(old_snapshot);
+    dvb_timeshift_unref(old_timeshift);
+
+    return TRUE;
+}
+
+DVBTimeshift *dvb_reader_get_timeshift(DVBReader *reader)
+{
+    g_return_val_if_fail(reader != NULL, NULL);
+
+    DVBTimeshift *timeshift;
+
+    g_mutex_lock(&reader->listener_mutex);
+    timeshift = dvb_timeshift_ref(reader->timeshift);
+    g_mutex_unlock(&reader->listener_mutex);
+
+    return timeshift;
+}
+
+gboolean dvb_reader_add_service(DVBReader *reader, guint16 program_number)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+    g_return_val_if_fail(program_number != 0, FALSE);
+
+    struct DVBReaderListenerSnapshot *old_snapshot;
+    struct DVBReaderService *service;
+    guint8 i;
+
+    g_mutex_lock(&reader->listener_mutex);
+    g_mutex_lock(&reader->service_mutex);
+
+    for (i = 1; i < DVB_READER_MAX_SERVICES; ++i) {
+        if (reader->services[i] && reader->services[i]->program_number == program_number)
+            break;
+    }
+    if (i < DVB_READER_MAX_SERVICES) {
+        /* possibly added again before the data thread dropped it */
+        reader->services[i]->removed = 0;
+    }
+    else {
+        for (i = 1; i < DVB_READER_MAX_SERVICES && reader->services[i]; ++i)
+            ;
+        if (i == DVB_READER_MAX_SERVICES) {
+            g_mutex_unlock(&reader->service_mutex);
+            g_mutex_unlock(&reader->listener_mutex);
+            LOG(reader->logger, "Too many services, cannot add program %u\n", program_number);
+            return FALSE;
+        }
+        service = g_malloc0(sizeof(struct DVBReaderService));
+        service->reader = reader;
+        service->program_number = program_number;
+        service->index = i;
+        g_atomic_pointer_set(&reader->services[i], service);
+    }
+    g_atomic_int_or(&reader->service_changes, 1u << i);
+
+    g_mutex_unlock(&reader->service_mutex);
+
+    /* listeners of the program get its packets from now on */
+    old_snapshot = dvb_reader_publish_listener_snapshot(reader);
+    g_mutex_unlock(&reader->listener_mutex);
+
+    dvb_reader_listener_snapshot_unref(old_snapshot);
+
+    return TRUE;
+}
+
+void dvb_reader_remove_service(DVBReader *reader, guint16 program_number)
+{
+    FLOG("\n");
+    g_return_if_fail(reader != NULL);
+
+    struct DVBReaderListenerSnapshot *old_snapshot;
+    guint8 i;
+
+    g_mutex_lock(&reader->listener_mutex);
+    g_mutex_lock(&reader->service_mutex);
+
+    i = dvb_reader_find_service(reader, program_number);
+    if (i == 0 || i == DVB_READER_NO_SERVICE) {
+        g_mutex_unlock(&reader->service_mutex);
+        g_mutex_unlock(&reader->listener_mutex);
+        return;
+    }
+    reader->services[i]->removed = 1;
+    g_atomic_int_or(&reader->service_changes, 1u << i);
+
+    g_mutex_unlock(&reader->service_mutex);
+
+    old_snapshot = dvb_reader_publish_listener_snapshot(reader);
+    g_mutex_unlock(&reader->listener_mutex);
+
+    dvb_reader_listener_snapshot_unref(old_snapshot);
+}
+
+void dvb_reader_set_writer_threads(DVBReader *reader, guint count)
+{
+    FLOG("\n");
+    g_return_if_fail(reader != NULL);
+
+    g_mutex_lock(&reader->listener_mutex);
+    reader->writer_threads = MAX(count, 1);
+    g_mutex_unlock(&reader->listener_mutex);
+}
+
 void dvb_reader_set_listener(DVBReader *reader, DVBFilterType filter, int fd,
-                             DVBReaderListenerCallback callback, gpointer userdata)
+                             DVBReaderListenerCallback callback, gpointer userdata,
+                             const DVBReaderListenerOptions *options)
 {
     FLOG("\n");
     fprintf(stderr, "dvb_reader_set_listener\n");
@@ -421,85 +1081,158 @@ void dvb_reader_set_listener(DVBReader *reader, DVBFilterType filter, int fd,
 
     g_mutex_lock(&reader->listener_mutex);
 
-    GList *element = NULL;
-    if (fd >= 0)
-        element = g_list_find_custom(reader->listeners, GINT_TO_POINTER(fd), (GCompareFunc)dvb_reader_compare_listener_fd);
-    else
-        element = g_list_find_custom(reader->listeners, callback, (GCompareFunc)dvb_reader_compare_listener_cb);
+    GList *element = dvb_reader_find_listener(reader, fd, callback, userdata);
 
     struct DVBReaderListener *listener = NULL;
+    struct DVBReaderListenerSnapshot *old_snapshot;
 
     if (element) {
         listener = (struct DVBReaderListener *)element->data;
-        g_mutex_lock(&listener->message_lock);
-        g_queue_foreach(&listener->message_queue, (GFunc)g_free, NULL);
-        g_queue_clear(&listener->message_queue);
-        listener->terminate = 0;
-        listener->write_error = 0;
-        listener->eos = 0;
-        listener->have_pat = 0;
-        listener->have_pmt = 0;
-        listener->running = 0;
         listener->filter = filter;
         listener->userdata = userdata;
-        /* Reset buffer */
-        listener->buffer_size = 0;
-        g_mutex_unlock(&listener->message_lock);
+        dvb_reader_listener_set_options(listener, options);
+        /* The worker thread also clears the write error and eos state and picks up the new chunk size when
+         * dropping the data. */
+        dvb_reader_listener_drop_data(listener);
+        g_atomic_int_set(&listener->running, 0);
     }
     else {
+        if (reader->listener_slots_used == (guint32)((1ull << DVB_READER_MAX_LISTENERS) - 1)) {
+            LOG(reader->logger, "Too many listeners, cannot add %d (%p)\n", fd, callback);
+            g_mutex_unlock(&reader->listener_mutex);
+            return;
+        }
+
+        /* The workers never block on the fd. */
+        if (fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+            LOG(reader->logger, "Could not make fd %d non-blocking: %s\n", fd, strerror(errno));
+
         listener = g_malloc0(sizeof(struct DVBReaderListener));
 
+        listener->slot = __builtin_ctz(~reader->listener_slots_used);
+        reader->listener_slots_used |= 1u << listener->slot;
+
+        listener->refcount = 1;
         listener->fd = fd;
         listener->callback = callback;
         listener->userdata = userdata;
         listener->filter = filter;
         listener->reader = reader;
-        g_queue_init(&listener->message_queue);
+        dvb_reader_listener_set_options(listener, options);
+        g_queue_init(&listener->overflow);
         g_mutex_init(&listener->message_lock);
-        g_cond_init(&listener->message_cond);
+        if ((listener->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+            LOG(reader->logger, "Error creating eventfd: %s\n", strerror(errno));
+        dvb_reader_listener_setup_coalescing(listener);
+        if (options && options->output_mode == DVB_READER_OUTPUT_VMSPLICE) {
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+                listener->splice = 1;
+            else
+                LOG(reader->logger, "fd %d is no pipe, not using vmsplice\n", fd);
+        }
 
         reader->listeners = g_list_prepend(reader->listeners, listener);
 
-        listener->worker_thread = g_thread_new("Listener", (GThreadFunc)dvb_reader_listener_thread_proc, listener);
+        /* Callbacks may block, by default they get a thread of their own. */
+        DVBReaderDispatch dispatch = options ? options->dispatch : DVB_READER_DISPATCH_DEFAULT;
+        if (dispatch == DVB_READER_DISPATCH_DEDICATED || (dispatch == DVB_READER_DISPATCH_DEFAULT && callback))
+            dvb_reader_worker_attach(dvb_reader_worker_new(reader, TRUE), listener);
+        else
+            dvb_reader_worker_attach(dvb_reader_get_pool_worker(reader), listener);
     }
 
-    dvb_reader_listener_send_pat(reader, listener);
-    dvb_reader_listener_send_pmt(reader, listener);
+    old_snapshot = dvb_reader_publish_listener_snapshot(reader);
+
+    /* The buffer and the tables sent belong to the data thread, let it reset them with the next batch. If the
+     * stream is not running, the tables are sent once they are read. */
+    g_atomic_int_or(&reader->listener_reset, 1u << listener->slot);
 
     g_mutex_unlock(&reader->listener_mutex);
+
+    dvb_reader_listener_snapshot_unref(old_snapshot);
 }
 
-void dvb_reader_listener_set_running(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gboolean do_run)
+void dvb_reader_listener_set_running(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gpointer userdata,
+                                     gboolean do_run)
 {
     g_return_if_fail(reader != NULL);
 
-    GList *element = NULL;
-    if (fd >= 0)
-        element = g_list_find_custom(reader->listeners, GINT_TO_POINTER(fd), (GCompareFunc)dvb_reader_compare_listener_fd);
-    else
-        element = g_list_find_custom(reader->listeners, callback, (GCompareFunc)dvb_reader_compare_listener_cb);
+    g_mutex_lock(&reader->listener_mutex);
 
-    if (!element)
-        return;
+    GList *element = dvb_reader_find_listener(reader, fd, callback, userdata);
 
-    if (do_run)
-        dvb_reader_listener_send_message((struct DVBReaderListener *)element->data, DVB_READER_LISTENER_MESSAGE_CONTINUE,
-                                         NULL, 0, TRUE);
-    else {
-        g_mutex_lock(&((struct DVBReaderListener *)element->data)->message_lock);
-        ((struct DVBReaderListener *)element->data)->running = 0;
-        g_mutex_unlock(&((struct DVBReaderListener *)element->data)->message_lock);
+    if (element) {
+        struct DVBReaderListener *listener = (struct DVBReaderListener *)element->data;
+        if (do_run && listener->start_at_rap) {
+            /* Skip what was queued while paused, the data thread resends the tables and waits for a random
+             * access point. */
+            dvb_reader_listener_drop_data(listener);
+            g_atomic_int_or(&reader->listener_reset, 1u << listener->slot);
+        }
+        if (do_run)
+            dvb_reader_listener_send_control(listener, DVB_READER_LISTENER_MESSAGE_CONTINUE);
+        else
+            g_atomic_int_set(&((struct DVBReaderListener *)element->data)->running, 0);
     }
+
+    g_mutex_unlock(&reader->listener_mutex);
 }
 
+/* Free all queued messages. Only call if the listener is not attached to a worker. */
 void dvb_reader_listener_clear_queue(struct DVBReaderListener *listener)
 {
     if (!listener)
         return;
-    g_mutex_lock(&listener->message_lock);
-    g_queue_foreach(&listener->message_queue, (GFunc)g_free, NULL);
-    g_queue_clear(&listener->message_queue);
-    g_mutex_unlock(&listener->message_lock);
+    dvb_reader_listener_drop_data_messages(listener, TRUE);
+}
+
+struct DVBReaderListener *dvb_reader_listener_ref(struct DVBReaderListener *listener)
+{
+    if (listener)
+        g_atomic_int_inc(&listener->refcount);
+    return listener;
+}
+
+/* Take a reference unless the listener is already being freed. */
+static gboolean dvb_reader_listener_try_ref(struct DVBReaderListener *listener)
+{
+    gint refcount;
+
+    do {
+        if ((refcount = g_atomic_int_get(&listener->refcount)) == 0)
+            return FALSE;
+    } while (!g_atomic_int_compare_and_exchange(&listener->refcount, refcount, refcount + 1));
+
+    return TRUE;
+}
+
+/* The reader's list and every snapshot containing the listener hold a reference. */
+void dvb_reader_listener_unref(struct DVBReaderListener *listener)
+{
+    if (listener && g_atomic_int_dec_and_test(&listener->refcount))
+        dvb_reader_listener_free(listener);
+}
+
+/* Stop the listener's worker from serving it and wait until it is detached, so no callback runs after this
+ * returns. On the worker thread itself the running callback is the caller; data still queued is not passed to
+ * the callback any more. */
+static void dvb_reader_listener_quit(struct DVBReaderListener *listener)
+{
+    struct DVBReaderWorker *worker = listener->worker;
+
+    if (!worker)
+        return;
+    if (g_thread_self() == worker->thread) {
+        listener->callback = NULL;
+        return;
+    }
+
+    dvb_reader_listener_send_control(listener, DVB_READER_LISTENER_MESSAGE_QUIT);
+    g_mutex_lock(&worker->lock);
+    while (!listener->detached)
+        g_cond_wait(&worker->detach_cond, &worker->lock);
+    g_mutex_unlock(&worker->lock);
 }
 
 void dvb_reader_listener_free(struct DVBReaderListener *listener)
@@ -507,16 +1240,36 @@ void dvb_reader_listener_free(struct DVBReaderListener *listener)
     FLOG(" listener: %p\n", listener);
     if (!listener)
         return;
-    if (listener->worker_thread && !listener->terminate) {
-        dvb_reader_listener_send_message(listener, DVB_READER_LISTENER_MESSAGE_QUIT, NULL, 0, TRUE);
-        g_thread_join(listener->worker_thread);
-        listener->worker_thread = NULL;
+    struct DVBReaderWorker *worker = listener->worker;
+    if (worker && g_thread_self() == worker->thread) {
+        /* Last reference dropped by a callback or event handler running on the worker. */
+        dvb_reader_worker_detach(worker, listener);
+        if (worker->dedicated) {
+            g_atomic_int_set(&worker->orphaned, 1);
+            g_atomic_int_set(&worker->quit, 1);
+        }
+    }
+    else if (worker) {
+        dvb_reader_listener_quit(listener);
+        if (worker->dedicated)
+            dvb_reader_worker_free(worker);
     }
+    for (; listener->out_index < listener->out_count; ++listener->out_index)
+        if (listener->out_msgs[listener->out_index])
+            dvb_reader_listener_message_free(listener->out_msgs[listener->out_index], listener->reader);
+    for (; listener->spliced_tail != listener->spliced_head; ++listener->spliced_tail)
+        dvb_reader_listener_message_free(
+                listener->spliced[listener->spliced_tail % DVB_LISTENER_SPLICE_HELD].msg, listener->reader);
     dvb_reader_listener_clear_queue(listener);
+    g_free(listener->coalesce_buffer);
+    g_free(listener->coalesce_raps);
+    if (listener->wakeup_fd >= 0)
+        close(listener->wakeup_fd);
+    g_mutex_clear(&listener->message_lock);
     g_free(listener);
 }
 
-void dvb_reader_remove_listener(DVBReader *reader, int fd, DVBReaderListenerCallback callback)
+void dvb_reader_remove_listener(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gpointer userdata)
 {
     FLOG("\n");
     g_return_if_fail(reader != NULL);
@@ -525,31 +1278,25 @@ void dvb_reader_remove_listener(DVBReader *reader, int fd, DVBReaderListenerCall
 
     g_mutex_lock(&reader->listener_mutex);
 
-    GList *element = NULL;
-    if (fd < 0)
-        element = g_list_find_custom(reader->listeners, callback, (GCompareFunc)dvb_reader_compare_listener_cb);
-    else
-        element = g_list_find_custom(reader->listeners, GINT_TO_POINTER(fd), (GCompareFunc)dvb_reader_compare_listener_fd);
+    GList *element = dvb_reader_find_listener(reader, fd, callback, userdata);
 
     LOG(reader->logger, "found reader: %p\n", element ? element->data : NULL);
 
+    struct DVBReaderListenerSnapshot *old_snapshot = NULL;
+
     if (element) {
         reader->listeners = g_list_remove_link(reader->listeners, element);
-        g_mutex_unlock(&reader->listener_mutex);
-    }
-    else {
-        g_mutex_unlock(&reader->listener_mutex);
+        reader->listener_slots_used &= ~(1u << ((struct DVBReaderListener *)element->data)->slot);
+        old_snapshot = dvb_reader_publish_listener_snapshot(reader);
     }
 
+    g_mutex_unlock(&reader->listener_mutex);
+
     if (element) {
-        struct DVBReaderListener *listener = (struct DVBReaderListener *)element->data;
-/*        if (listener->worker_thread) {
-            dvb_reader_listener_send_message(listener, DVB_READER_LISTENER_MESSAGE_QUIT, NULL, 0, TRUE);
-            fprintf(stderr, "join worker thread for %d %p\n", listener->fd, listener->callback);
-            g_thread_join(listener->worker_thread);
-            fprintf(stderr, "joined worker thread for %d %p\n", listener->fd, listener->callback);
-        }*/
-        dvb_reader_listener_free(listener);
+        dvb_reader_listener_snapshot_unref(old_snapshot);
+        /* the caller may free what the callback uses once this returns */
+        dvb_reader_listener_quit((struct DVBReaderListener *)element->data);
+        dvb_reader_listener_unref((struct DVBReaderListener *)element->data);
 
         g_list_free_1(element);
     }
@@ -783,25 +1530,25 @@ gpointer dvb_reader_data_thread_proc(DVBReader *reader)
     FLOG("\n");
     LOG(reader->logger, "dvb_reader_data_thread_proc\n");
     static TsReaderClass tscls = {
-        .handle_packet = dvb_reader_handle_packet,
+        .handle_packets = dvb_reader_handle_packets,
     };
     TsReader *ts_reader = ts_reader_new(&tscls, reader);
 
     reader->dvbpsi_handles[TS_TABLE_PAT] = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
     dvbpsi_pat_attach(reader->dvbpsi_handles[TS_TABLE_PAT], (dvbpsi_pat_callback)dvb_reader_dvbpsi_pat_cb, reader);
-    dvb_reader_add_active_pid(reader, 0, DVB_FILTER_PAT);
+    dvb_reader_add_active_pid(reader, 0, DVB_FILTER_PAT, DVB_READER_ALL_SERVICES);
 
     reader->dvbpsi_handles[TS_TABLE_EIT] = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
     dvbpsi_AttachDemux(reader->dvbpsi_handles[TS_TABLE_EIT], dvb_reader_dvbpsi_demux_new_subtable, reader);
-    dvb_reader_add_active_pid(reader, 18, DVB_FILTER_EIT);
+    dvb_reader_add_active_pid(reader, 18, DVB_FILTER_EIT, DVB_READER_ALL_SERVICES);
 
     reader->dvbpsi_handles[TS_TABLE_SDT] = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
     dvbpsi_AttachDemux(reader->dvbpsi_handles[TS_TABLE_SDT], dvb_reader_dvbpsi_demux_new_subtable, reader);
-    dvb_reader_add_active_pid(reader, 17, DVB_FILTER_SDT);
+    dvb_reader_add_active_pid(reader, 17, DVB_FILTER_SDT, DVB_READER_ALL_SERVICES);
 
     reader->dvbpsi_handles[TS_TABLE_RST] = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
     dvbpsi_rst_attach(reader->dvbpsi_handles[TS_TABLE_RST], (dvbpsi_rst_callback)dvb_reader_dvbpsi_rst_cb, reader);
-    dvb_reader_add_active_pid(reader, 19, DVB_FILTER_RST);
+    dvb_reader_add_active_pid(reader, 19, DVB_FILTER_RST, DVB_READER_ALL_SERVICES);
 
     DVBStreamStatus exit_status = DVB_STREAM_STATUS_UNKNOWN;
 
@@ -840,7 +1587,7 @@ gpointer dvb_reader_data_thread_proc(DVBReader *reader)
                     exit_status = DVB_STREAM_STATUS_EOS;
                     break;
                 }
-                ts_reader_push_buffer(ts_reader, buffer, bytes_read);
+                dvb_reader_process_buffer(reader, ts_reader, buffer, bytes_read);
             }
             if (pfd[0].revents & POLLIN || pfd[0].revents & POLLNVAL) {
                 LOG(reader->logger, "Received data on control pipe. Stop thread.\n");
@@ -864,7 +1611,7 @@ done:
     reader->data_thread = NULL;
 
     LOG(reader->logger, "Stream stopped\n");
-    dvb_reader_listener_broadcast_message(reader, DVB_READER_LISTENER_MESSAGE_EOS, NULL, 0, FALSE);
+    dvb_reader_listener_broadcast_control(reader, DVB_READER_LISTENER_MESSAGE_EOS);
 
     dvb_recorder_event_send(DVB_RECORDER_EVENT_STREAM_STATUS_CHANGED,
             reader->event_cb, reader->event_data,
@@ -981,6 +1728,16 @@ void dvb_reader_dvbpsi_pat_cb(DVBReader *reader, dvbpsi_pat_t *pat)
     LOG(reader->logger, "pat_cb: current_next=%u, ts_id=%u, version=%u\n", pat->b_current_next, pat->i_ts_id, pat->i_version);
 
     dvbpsi_pat_program_t *prog;
+    struct DVBReaderProgram program;
+
+    /* remembered for the additional services */
+    reader->ts_id = pat->i_ts_id;
+    g_array_set_size(reader->pat_programs, 0);
+    for (prog = pat->p_first_program; prog; prog = prog->p_next) {
+        program.number = prog->i_number;
+        program.pmt_pid = prog->i_pid;
+        g_array_append_val(reader->pat_programs, program);
+    }
 
     for (prog = pat->p_first_program; prog; prog = prog->p_next) {
         LOG(reader->logger, "pat_cb: pat prog number=%u, pid=%u, want prog %u\n",
@@ -989,8 +1746,8 @@ void dvb_reader_dvbpsi_pat_cb(DVBReader *reader, dvbpsi_pat_t *pat)
             reader->dvbpsi_handles[TS_TABLE_PMT] = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
             dvbpsi_pmt_attach(reader->dvbpsi_handles[TS_TABLE_PMT], reader->program_number,
                     (dvbpsi_pmt_callback)dvb_reader_dvbpsi_pmt_cb, reader);
-            reader->dvbpsi_table_pids[TS_TABLE_PMT] = prog->i_pid;
-            dvb_reader_add_active_pid(reader, prog->i_pid, DVB_FILTER_PMT);
+            dvb_reader_set_table_pid(reader, TS_TABLE_PMT, prog->i_pid);
+            dvb_reader_add_active_pid(reader, prog->i_pid, DVB_FILTER_PMT, DVB_READER_MAIN_SERVICE);
 
             dvb_reader_rewrite_pat(reader, pat->i_ts_id, prog->i_number, prog->i_pid);
 
@@ -1000,67 +1757,233 @@ void dvb_reader_dvbpsi_pat_cb(DVBReader *reader, dvbpsi_pat_t *pat)
 
     dvbpsi_pat_delete(pat);
 
+    g_atomic_int_or(&reader->service_changes, (1u << DVB_READER_MAX_SERVICES) - 2);
+    dvb_reader_update_services(reader);
+
     LOG(reader->logger, "pat_cb: pat packet count: %u\n", reader->pat_packet_count);
     if (reader->pat_packet_count) {
         reader->dvbpsi_have_pat = 1;
 
-        GList *tmp;
-        g_mutex_lock(&reader->listener_mutex);
-        for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
-            dvb_reader_listener_send_pat(reader, (struct DVBReaderListener *)tmp->data);
+        guint32 used;
+        for (used = reader->active_snapshot->slots_used; used; used &= used - 1)
+            dvb_reader_listener_send_pat(reader, reader->active_snapshot->slots[__builtin_ctz(used)]);
+    }
+}
+
+/* Kind of an elementary stream by its stream type, iso13818 table 2-29. codec may be NULL. */
+static DVBFilterType dvb_reader_es_type(uint8_t stream_type, guint8 *codec)
+{
+    guint8 es_codec = DVB_READER_CODEC_NONE;
+    DVBFilterType type;
+
+    switch (stream_type) {
+        case 0x01:
+        case 0x02:
+            type = DVB_FILTER_VIDEO;
+            es_codec = DVB_READER_CODEC_MPEG2;
+            break;
+        case 0x1b:
+            type = DVB_FILTER_VIDEO;
+            es_codec = DVB_READER_CODEC_H264;
+            break;
+        case 0x24:
+            type = DVB_FILTER_VIDEO;
+            es_codec = DVB_READER_CODEC_HEVC;
+            break;
+        case 0x03:
+        case 0x04:
+            type = DVB_FILTER_AUDIO;
+            break;
+        case 0x06:
+            type = DVB_FILTER_TELETEXT;
+            break;
+        default:
+            type = DVB_FILTER_OTHER;
+            break;
+    }
+
+    if (codec)
+        *codec = es_codec;
+    return type;
+}
+
+/* Activate a pid listed in a PMT. A pid the previous version of the PMT left without a service keeps its filter,
+ * but gets the type of this version instead of adding to the old one. */
+static void dvb_reader_add_pmt_pid(DVBReader *reader, uint16_t pid, DVBFilterType type, guint8 services)
+{
+    struct DVBPidEntry *entry;
+
+    if (pid < DVB_READER_PID_COUNT) {
+        entry = &reader->pid_table[pid];
+        if (entry->type && !entry->services && !entry->service_pmt && entry->psi_table == N_TS_TABLE_TYPES) {
+            entry->type = type;
+            entry->services = services;
+            return;
         }
-        g_mutex_unlock(&reader->listener_mutex);
     }
+
+    dvb_reader_add_active_pid(reader, pid, type, services);
+}
+
+/* Activate the elementary streams and the PCR pid of a PMT for services. Returns whether it lists video. */
+static gboolean dvb_reader_add_pmt_pids(DVBReader *reader, dvbpsi_pmt_t *pmt, guint8 services)
+{
+    dvbpsi_pmt_es_t *stream;
+    DVBFilterType type;
+    guint8 codec;
+    gboolean have_video = FALSE;
+
+    for (stream = pmt->p_first_es; stream; stream = stream->p_next) {
+        type = dvb_reader_es_type(stream->i_type, &codec);
+        dvb_reader_add_pmt_pid(reader, stream->i_pid, type, services);
+        if (codec != DVB_READER_CODEC_NONE && stream->i_pid < DVB_READER_PID_COUNT) {
+            reader->pid_table[stream->i_pid].codec = codec;
+            have_video = TRUE;
+        }
+    }
+
+    if (pmt->i_pcr_pid != 0x1fff)
+        dvb_reader_add_pmt_pid(reader, pmt->i_pcr_pid, DVB_FILTER_PCR, services);
+
+    return have_video;
+}
+
+static gboolean dvb_reader_pmt_lists_pid(dvbpsi_pmt_t *pmt, uint16_t pid)
+{
+    dvbpsi_pmt_es_t *stream;
+
+    for (stream = pmt->p_first_es; stream; stream = stream->p_next) {
+        if (stream->i_pid == pid)
+            return TRUE;
+    }
+
+    return pmt->i_pcr_pid == pid;
+}
+
+static void dvb_reader_remove_pmt_pid(DVBReader *reader, dvbpsi_pmt_t *pmt, uint16_t pid, guint8 services)
+{
+    struct DVBPidEntry *entry;
+
+    if (pid >= DVB_READER_PID_COUNT)
+        return;
+
+    entry = &reader->pid_table[pid];
+    if (!(entry->services & services) || entry->psi_table != N_TS_TABLE_TYPES)
+        return;
+
+    entry->services &= ~services;
+    if (entry->services || entry->service_pmt)
+        return;
+
+    /* still listed: keep the filter, dvb_reader_add_pmt_pid() sets the type of the new version */
+    entry->codec = DVB_READER_CODEC_NONE;
+    if (dvb_reader_pmt_lists_pid(pmt, pid))
+        return;
+
+    entry->type = 0;
+    g_mutex_lock(&reader->tuner_mutex);
+    dvb_tuner_remove_pid(reader->tuner, pid);
+    g_mutex_unlock(&reader->tuner_mutex);
+}
+
+/* Undo dvb_reader_add_pmt_pids for the old version of a PMT before pmt replaces it: drop services from the
+ * pids and stop the pids nobody uses any more. */
+static void dvb_reader_remove_pmt_pids(DVBReader *reader, dvbpsi_pmt_t *old, dvbpsi_pmt_t *pmt, guint8 services)
+{
+    dvbpsi_pmt_es_t *stream;
+
+    for (stream = old->p_first_es; stream; stream = stream->p_next)
+        dvb_reader_remove_pmt_pid(reader, pmt, stream->i_pid, services);
+
+    if (old->i_pcr_pid != 0x1fff)
+        dvb_reader_remove_pmt_pid(reader, pmt, old->i_pcr_pid, services);
+
+    reader->video_services &= ~services;
 }
 
 void dvb_reader_dvbpsi_pmt_cb(DVBReader *reader, dvbpsi_pmt_t *pmt)
 {
-    LOG(reader->logger, "pmt_cb: have_pmt: %d\n", reader->dvbpsi_have_pmt);
-    if (reader->dvbpsi_have_pmt) {
+    struct DVBReaderListener *listener;
+    guint32 used;
+
+    LOG(reader->logger, "pmt_cb: have_pmt: %d, version: %u\n", reader->dvbpsi_have_pmt, pmt->i_version);
+    if (reader->dvbpsi_have_pmt && reader->pmt_cache.pmt->i_version == pmt->i_version) {
         dvbpsi_pmt_delete(pmt);
         return;
     }
 
     dvb_reader_rewrite_pmt(reader, pmt);
 
-    dvbpsi_pmt_es_t *stream;
-    DVBFilterType type;
-    for (stream = pmt->p_first_es; stream; stream = stream->p_next) {
-        /* iso13818 table 2-29 */
-        switch (stream->i_type) {
-            case 0x01:
-            case 0x02:
-            case 0x1b:
-                type = DVB_FILTER_VIDEO;
-                break;
-            case 0x03:
-            case 0x04:
-                type = DVB_FILTER_AUDIO;
-                break;
-            case 0x06:
-                type = DVB_FILTER_TELETEXT;
-                break;
-            default:
-                type = DVB_FILTER_OTHER;
-                break;
-        }
+    if (reader->dvbpsi_have_pmt) {
+        dvb_reader_remove_pmt_pids(reader, reader->pmt_cache.pmt, pmt, DVB_READER_MAIN_SERVICE);
+        reader->have_video = 0;
+    }
 
-        dvb_reader_add_active_pid(reader, stream->i_pid, type);
+    if (dvb_reader_add_pmt_pids(reader, pmt, DVB_READER_MAIN_SERVICE)) {
+        reader->have_video = 1;
+        reader->video_services |= DVB_READER_MAIN_SERVICE;
     }
 
-    if (pmt->i_pcr_pid != 0x1ff)
-        dvb_reader_add_active_pid(reader, pmt->i_pcr_pid, DVB_FILTER_PCR);
+    /* Nothing to wait for without video. */
+    if (!reader->have_video)
+        reader->rap_waiting &= ~reader->active_snapshot->service_listeners[DVB_READER_MAIN_SERVICE];
 
-    dvbpsi_pmt_delete(pmt);
+    dvb_reader_pmt_cache_set(reader, &reader->pmt_cache, pmt);
 
     reader->dvbpsi_have_pmt = 1;
 
-    GList *tmp;
-    g_mutex_lock(&reader->listener_mutex);
-    for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
-        dvb_reader_listener_send_pmt(reader, (struct DVBReaderListener *)tmp->data);
+    /* a new version replaces the PMT the listeners of the service have */
+    for (used = reader->active_snapshot->slots_used; used; used &= used - 1) {
+        listener = reader->active_snapshot->slots[__builtin_ctz(used)];
+        if (reader->active_snapshot->slot_service[listener->slot] == 0)
+            listener->have_pmt = 0;
+        dvb_reader_listener_send_pmt(reader, listener);
+    }
+}
+
+void dvb_reader_dvbpsi_service_pmt_cb(struct DVBReaderService *service, dvbpsi_pmt_t *pmt)
+{
+    DVBReader *reader = service->reader;
+    struct DVBReaderListener *listener;
+    guint8 bit = 1u << service->index;
+    uint8_t *data;
+    uint8_t count;
+    guint32 used;
+
+    LOG(reader->logger, "service_pmt_cb: program %u, have_pmt: %d, version: %u\n", service->program_number,
+        service->have_pmt, pmt->i_version);
+    if (service->have_pmt && service->pmt_cache.pmt->i_version == pmt->i_version) {
+        dvbpsi_pmt_delete(pmt);
+        return;
+    }
+
+    dvb_reader_generate_pmt(reader, pmt, service->pmt_pid, &data, &count);
+    g_mutex_lock(&reader->table_mutex);
+    g_free(service->pmt_data);
+    service->pmt_data = data;
+    service->pmt_packet_count = count;
+    g_mutex_unlock(&reader->table_mutex);
+
+    if (service->have_pmt)
+        dvb_reader_remove_pmt_pids(reader, service->pmt_cache.pmt, pmt, bit);
+
+    if (dvb_reader_add_pmt_pids(reader, pmt, bit))
+        reader->video_services |= bit;
+
+    dvb_reader_pmt_cache_set(reader, &service->pmt_cache, pmt);
+
+    service->have_pmt = 1;
+
+    for (used = reader->active_snapshot->slots_used; used; used &= used - 1) {
+        listener = reader->active_snapshot->slots[__builtin_ctz(used)];
+        if (reader->active_snapshot->slot_service[listener->slot] != service->index)
+            continue;
+        if (!(reader->video_services & bit))
+            reader->rap_waiting &= ~(1u << listener->slot);
+        listener->have_pmt = 0;
+        dvb_reader_listener_send_pat(reader, listener);
+        dvb_reader_listener_send_pmt(reader, listener);
     }
-    g_mutex_unlock(&reader->listener_mutex);
 }
 
 void dvb_reader_dvbpsi_eit_cb(DVBReader *reader, dvbpsi_eit_t *eit)
@@ -1250,401 +2173,1798 @@ void dvb_reader_dvbpsi_section_to_ts_packets(uint16_t pid, dvbpsi_psi_section_t
         *packet_count = count;
 }
 
-void dvb_reader_rewrite_pat(DVBReader *reader, uint16_t ts_id, uint16_t program_number, uint16_t program_map_pid)
+/* Encode a PAT listing a single program. */
+static void dvb_reader_generate_pat(DVBReader *reader, uint16_t ts_id, uint16_t program_number,
+                                    uint16_t program_map_pid, uint8_t **data, uint8_t *count)
 {
-    /* have only one pat packet */
-    g_free(reader->pat_data);
-
     dvbpsi_t *encoder_handle = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
     dvbpsi_pat_t *pat = dvbpsi_pat_new(ts_id, 0, true);
     dvbpsi_pat_program_add(pat, program_number, program_map_pid);
 
     dvbpsi_psi_section_t *section = dvbpsi_pat_sections_generate(encoder_handle, pat, 0);
-    dvb_reader_dvbpsi_section_to_ts_packets(0, section, &reader->pat_data, &reader->pat_packet_count);
-    LOG(reader->logger, "rewrite pat to %u packets\n", reader->pat_packet_count);
+    dvb_reader_dvbpsi_section_to_ts_packets(0, section, data, count);
+    LOG(reader->logger, "rewrite pat of program %u to %u packets\n", program_number, *count);
 
     dvbpsi_DeletePSISections(section);
     dvbpsi_pat_delete(pat);
     dvbpsi_delete(encoder_handle);
 }
 
-void dvb_reader_rewrite_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt)
+static void dvb_reader_generate_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt, uint16_t pid,
+                                    uint8_t **data, uint8_t *count)
 {
-    g_free(reader->pmt_data);
-
     dvbpsi_t *encoder_handle = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
 
     /* FIXME: handle multiple sections? */
     dvbpsi_psi_section_t *section = dvbpsi_pmt_sections_generate(encoder_handle, pmt);
-    dvb_reader_dvbpsi_section_to_ts_packets(reader->dvbpsi_table_pids[TS_TABLE_PMT],
-                                            section, &reader->pmt_data, &reader->pmt_packet_count);
+    dvb_reader_dvbpsi_section_to_ts_packets(pid, section, data, count);
 
     dvbpsi_DeletePSISections(section);
     dvbpsi_delete(encoder_handle);
 }
 
-void dvb_reader_listener_send_message(struct DVBReaderListener *listener, enum DVBReaderListenerMessageType type,
-                                      uint8_t *data, gsize size, gboolean immediately)
+/* Take pmt as the current PMT of a service, dropping the PMTs filtered from the previous one. NULL clears the
+ * cache. Data thread only, or with the data thread stopped. */
+static void dvb_reader_pmt_cache_set(DVBReader *reader, struct DVBReaderPmtCache *cache, dvbpsi_pmt_t *pmt)
 {
-    struct DVBReaderListenerMessage *msg = g_malloc(sizeof(struct DVBReaderListenerMessage));
+    guint i;
+
+    g_mutex_lock(&reader->table_mutex);
+    if (cache->pmt)
+        dvbpsi_pmt_delete(cache->pmt);
+    cache->pmt = pmt;
+    for (i = 0; i < DVB_READER_PMT_CACHE_SIZE; ++i) {
+        g_free(cache->entries[i].data);
+        cache->entries[i].data = NULL;
+        cache->entries[i].packet_count = 0;
+        cache->entries[i].filter = 0;
+    }
+    cache->next = 0;
+    g_mutex_unlock(&reader->table_mutex);
+}
 
-    msg->type = type;
-    msg->data_size = size;
-    if (size > 0)
-        memcpy(msg->data, data, size);
+/* Encode pmt listing only the elementary streams of the types in filter. The PCR pid stays if its packets are
+ * passed on, with a stream kept or for DVB_FILTER_PCR; otherwise the PMT says there is no PCR. */
+static void dvb_reader_generate_filtered_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt, uint16_t pid, guint16 filter,
+                                             uint8_t **data, uint8_t *count)
+{
+    dvbpsi_pmt_t *filtered;
+    dvbpsi_pmt_es_t *stream, *es;
+    dvbpsi_descriptor_t *descriptor;
+    gboolean have_pcr = (filter & DVB_FILTER_PCR) != 0;
 
-    g_mutex_lock(&listener->message_lock);
+    filtered = dvbpsi_pmt_new(pmt->i_program_number, pmt->i_version, pmt->b_current_next, 0x1fff);
+    for (descriptor = pmt->p_first_descriptor; descriptor; descriptor = descriptor->p_next)
+        dvbpsi_pmt_descriptor_add(filtered, descriptor->i_tag, descriptor->i_length, descriptor->p_data);
 
-    if (immediately)
-        g_queue_push_head(&listener->message_queue, msg);
-    else
-        g_queue_push_tail(&listener->message_queue, msg);
+    for (stream = pmt->p_first_es; stream; stream = stream->p_next) {
+        if (!(dvb_reader_es_type(stream->i_type, NULL) & filter))
+            continue;
+        es = dvbpsi_pmt_es_add(filtered, stream->i_type, stream->i_pid);
+        for (descriptor = stream->p_first_descriptor; es && descriptor; descriptor = descriptor->p_next)
+            dvbpsi_pmt_es_descriptor_add(es, descriptor->i_tag, descriptor->i_length, descriptor->p_data);
+        if (stream->i_pid == pmt->i_pcr_pid)
+            have_pcr = TRUE;
+    }
+    if (have_pcr)
+        filtered->i_pcr_pid = pmt->i_pcr_pid;
 
-    g_cond_signal(&listener->message_cond);
+    dvb_reader_generate_pmt(reader, filtered, pid, data, count);
+    LOG(reader->logger, "filtered pmt of program %u for 0x%04x: %u packets\n", pmt->i_program_number, filter, *count);
 
-    g_mutex_unlock(&listener->message_lock);
+    dvbpsi_pmt_delete(filtered);
 }
 
-void dvb_reader_listener_broadcast_message(DVBReader *reader, enum DVBReaderListenerMessageType type,
-                                           uint8_t *data, gsize size, gboolean immediately)
+void dvb_reader_rewrite_pat(DVBReader *reader, uint16_t ts_id, uint16_t program_number, uint16_t program_map_pid)
 {
-    FLOG("\n");
-    GList *tmp;
+    uint8_t *data;
+    uint8_t count;
 
-    g_mutex_lock(&reader->listener_mutex);
-    for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
-        dvb_reader_listener_send_message((struct DVBReaderListener *)tmp->data, type, data, size, immediately);
-    }
-    g_mutex_unlock(&reader->listener_mutex);
+    dvb_reader_generate_pat(reader, ts_id, program_number, program_map_pid, &data, &count);
+
+    g_mutex_lock(&reader->table_mutex);
+    g_free(reader->pat_data);
+    reader->pat_data = data;
+    reader->pat_packet_count = count;
+    g_mutex_unlock(&reader->table_mutex);
 }
 
-struct DVBReaderListenerMessage *dvb_reader_listener_pop_message(struct DVBReaderListener *listener)
+void dvb_reader_rewrite_pmt(DVBReader *reader, dvbpsi_pmt_t *pmt)
 {
-    FLOG("\n");
-    struct DVBReaderListenerMessage *msg;
+    uint8_t *data;
+    uint8_t count;
 
-    g_mutex_lock(&listener->message_lock);
+    dvb_reader_generate_pmt(reader, pmt, reader->dvbpsi_table_pids[TS_TABLE_PMT], &data, &count);
 
-    while ((msg = (struct DVBReaderListenerMessage *)g_queue_peek_head(&listener->message_queue)) == NULL ||
-            (listener->running == 0 && msg->type != DVB_READER_LISTENER_MESSAGE_CONTINUE &&
-                                       msg->type != DVB_READER_LISTENER_MESSAGE_QUIT))
-        g_cond_wait(&listener->message_cond, &listener->message_lock);
-
-    msg = g_queue_pop_head(&listener->message_queue);
-
-    g_mutex_unlock(&listener->message_lock);
-
-    return msg;
+    g_mutex_lock(&reader->table_mutex);
+    g_free(reader->pmt_data);
+    reader->pmt_data = data;
+    reader->pmt_packet_count = count;
+    g_mutex_unlock(&reader->table_mutex);
 }
 
-void dvb_reader_listener_drop_data_messages(struct DVBReaderListener *listener)
+/* Start decoding the PMT of a service once its program is known from the PAT. Data thread only. */
+static void dvb_reader_service_attach(DVBReader *reader, struct DVBReaderService *service)
 {
-    FLOG("\n");
-    GList *tmp, *next;
-
-    g_mutex_lock(&listener->message_lock);
-
-    tmp = listener->message_queue.head;
-    while (tmp) {
-        next = tmp->next;
-        if (((struct DVBReaderListenerMessage *)tmp->data)->type == DVB_READER_LISTENER_MESSAGE_DATA) {
-            g_free(tmp->data);
-            g_queue_delete_link(&listener->message_queue, tmp);
-        }
-        tmp = next;
+    struct DVBReaderProgram *program = NULL;
+    uint8_t *data;
+    uint8_t count;
+    guint i;
+
+    for (i = 0; i < reader->pat_programs->len; ++i) {
+        program = &g_array_index(reader->pat_programs, struct DVBReaderProgram, i);
+        if (program->number == service->program_number)
+            break;
+    }
+    if (i == reader->pat_programs->len) {
+        if (reader->pat_programs->len)
+            LOG(reader->logger, "Program %u is not on this transponder\n", service->program_number);
+        return;
     }
 
-    g_mutex_unlock(&listener->message_lock);
+    LOG(reader->logger, "Add service %u, pmt pid %u\n", service->program_number, program->pmt_pid);
+    service->pmt_handle = dvbpsi_new(dvb_reader_dvbpsi_message, DVBPSI_MSG_WARN);
+    dvbpsi_pmt_attach(service->pmt_handle, service->program_number,
+            (dvbpsi_pmt_callback)dvb_reader_dvbpsi_service_pmt_cb, service);
+    service->pmt_pid = program->pmt_pid;
+    dvb_reader_add_active_pid(reader, program->pmt_pid, DVB_FILTER_PMT, 0);
+    if (program->pmt_pid < DVB_READER_PID_COUNT)
+        reader->pid_table[program->pmt_pid].service_pmt |= 1u << service->index;
+
+    dvb_reader_generate_pat(reader, reader->ts_id, program->number, program->pmt_pid, &data, &count);
+    g_mutex_lock(&reader->table_mutex);
+    g_free(service->pat_data);
+    service->pat_data = data;
+    service->pat_packet_count = count;
+    g_mutex_unlock(&reader->table_mutex);
 }
 
-/* Write packet to internal listener buffer if filter matches. When the buffer is full create a new DATA message,
- * send it, and clear the buffer. */
-void dvb_reader_listener_push_packet(struct DVBReaderListener *listener, DVBFilterType type, const uint8_t *packet)
+/* Stop decoding a service and drop the pids no other one uses. Call from the data thread, or while it is not
+ * running. */
+static void dvb_reader_service_detach(DVBReader *reader, struct DVBReaderService *service)
 {
-    if ((listener->filter & (DVB_FILTER_ALL & ~(DVB_FILTER_PAT | DVB_FILTER_PMT))) & type) {
-        memcpy(&listener->buffer[listener->buffer_size], packet, TS_SIZE);
-        listener->buffer_size += TS_SIZE;
+    struct DVBPidEntry *entry;
+    guint8 bit = 1u << service->index;
+    guint pid;
+
+    if (service->pmt_handle) {
+        if (service->pmt_handle->p_decoder)
+            dvbpsi_pmt_detach(service->pmt_handle);
+        dvbpsi_delete(service->pmt_handle);
+        service->pmt_handle = NULL;
     }
 
-    if (listener->buffer_size >= (DVB_LISTENER_BUFFER_SIZE / TS_SIZE) * TS_SIZE) {
-        dvb_reader_listener_send_message(listener, DVB_READER_LISTENER_MESSAGE_DATA,
-                                         listener->buffer, listener->buffer_size, FALSE);
-        listener->buffer_size = 0;
+    for (pid = 0; pid < DVB_READER_PID_COUNT; ++pid) {
+        entry = &reader->pid_table[pid];
+        if (!((entry->services | entry->service_pmt) & bit))
+            continue;
+        entry->services &= ~bit;
+        entry->service_pmt &= ~bit;
+        if (entry->services || entry->service_pmt || entry->psi_table != N_TS_TABLE_TYPES)
+            continue;
+        entry->type = 0;
+        entry->codec = DVB_READER_CODEC_NONE;
+        g_mutex_lock(&reader->tuner_mutex);
+        dvb_tuner_remove_pid(reader->tuner, pid);
+        g_mutex_unlock(&reader->tuner_mutex);
     }
+
+    reader->video_services &= ~bit;
+    service->have_pmt = 0;
+
+    g_mutex_lock(&reader->table_mutex);
+    g_free(service->pat_data);
+    g_free(service->pmt_data);
+    service->pat_data = NULL;
+    service->pmt_data = NULL;
+    service->pat_packet_count = 0;
+    service->pmt_packet_count = 0;
+    g_mutex_unlock(&reader->table_mutex);
+    dvb_reader_pmt_cache_set(reader, &service->pmt_cache, NULL);
 }
 
-gint dvb_reader_listener_write_data_full(struct DVBReaderListener *listener, const uint8_t *data, gsize size)
+/* Apply the services added and removed since the last call. Data thread only. */
+static void dvb_reader_update_services(DVBReader *reader)
 {
-    FLOG("\n");
-    ssize_t nw, offset;
-    unsigned long int error_enc = 0;
-    struct pollfd pfd[1];
-    int rc;
-    pfd[0].fd = listener->fd;
-    pfd[0].events = POLLOUT;
-    for (offset = 0; offset < size; offset += nw) {
-        nw = 0;
-        if ((rc = poll(pfd, 1, 1000)) <= 0) {
-            if (rc == 0) {
-                LOG(listener->reader->logger, "Writing to %d timed out, count %lu.\n", listener->fd, error_enc);
-                if (++error_enc > 10 || listener->terminate) {
-                    return -1;
-                }
-
-                continue;
-            }
-            if (rc == -1) {
-                LOG(listener->reader->logger, "Poll returned an error: %d %s\n", errno, strerror(errno));
-                return -1;
-            }
+    struct DVBReaderService *service;
+    guint changes;
+    guint8 index;
+
+    g_mutex_lock(&reader->service_mutex);
+    for (changes = (guint)g_atomic_int_and(&reader->service_changes, 0); changes; changes &= changes - 1) {
+        index = __builtin_ctz(changes);
+        if (!(service = reader->services[index]))
+            continue;
+        if (service->removed) {
+            dvb_reader_service_detach(reader, service);
+            g_atomic_pointer_set(&reader->services[index], NULL);
+            g_free(service);
         }
-        if ((nw = write(listener->fd, data + offset, (size_t)(size - offset))) <= 0) {
-            if (nw < 0) {
-                if (errno == EAGAIN) {
-                    LOG(listener->reader->logger,
-                        "EAGAIN on fd %d while trying to write %zd bytes.\n",
-                        listener->fd,
-                        (size_t)(size - offset));
-                    nw = 0;
-                    ++error_enc;
-                    continue;
-                }
-                LOG(listener->reader->logger, "Could not write to %d.\n", listener->fd);
-                return -1;
-            }
-            else if (nw == 0) {
-                LOG(listener->reader->logger, "Written zero bytes to %d.\n", listener->fd);
-            }
-            break;
+        else if (!service->pmt_handle) {
+            dvb_reader_service_attach(reader, service);
         }
     }
-
-    if (error_enc)
-        LOG(listener->reader->logger, "written successfully after encountering %lu errors.\n", error_enc);
-
-    return 1;
+    g_mutex_unlock(&reader->service_mutex);
 }
 
-gpointer dvb_reader_listener_thread_proc(struct DVBReaderListener *listener)
+/* The stream stopped: drop removed services and start over with the others after the next PAT. */
+static void dvb_reader_reset_services(DVBReader *reader)
 {
-    FLOG("\n");
-    struct DVBReaderListenerMessage *msg;
-    gint rc;
-
-    LOG(listener->reader->logger, "dvb_reader_listener_thread_proc for %d, %p\n", listener->fd, listener->callback);
-
-    while (1) {
-        msg = dvb_reader_listener_pop_message(listener);
-
-        switch (msg->type) {
-            case DVB_READER_LISTENER_MESSAGE_DATA:
-                if (listener->fd >= 0 && !listener->write_error) {
-                    if ((rc = dvb_reader_listener_write_data_full(listener, msg->data, msg->data_size)) <= 0) {
-                        if (rc < 0) {
-                            listener->write_error = 1;
-                            LOG(listener->reader->logger, "signal write error\n");
-                            dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
-                                    listener->reader->event_cb, listener->reader->event_data,
-                                    "status", DVB_LISTENER_STATUS_WRITE_ERROR,
-                                    "fd", listener->fd,
-                                    "cb", listener->callback,
-                                    NULL, NULL);
-                        }
-                    }
-                }
-                if (listener->callback) {
-                    listener->callback(msg->data, msg->data_size, listener->userdata);
-                }
-                break;
-            case DVB_READER_LISTENER_MESSAGE_DROP:
-                LOG(listener->reader->logger, "listener got DROP message\n");
-                dvb_reader_listener_drop_data_messages(listener);
-                break;
-            case DVB_READER_LISTENER_MESSAGE_CONTINUE:
-                LOG(listener->reader->logger, "listener got CONTINUE message\n");
-                g_mutex_lock(&listener->message_lock);
-                listener->running = 1;
-                g_mutex_unlock(&listener->message_lock);
-                break;
-            case DVB_READER_LISTENER_MESSAGE_QUIT:
-                LOG(listener->reader->logger, "listener got QUIT message\n");
-                g_free(msg);
-                listener->terminate = 1;
-                if (listener->reader)
-                    dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
-                            listener->reader->event_cb, listener->reader->event_data,
-                            "status", DVB_LISTENER_STATUS_TERMINATED,
-                            "fd", listener->fd,
-                            "cb", listener->callback,
-                            NULL, NULL);
-                return NULL;
-            case DVB_READER_LISTENER_MESSAGE_EOS:
-                LOG(listener->reader->logger, "listener got EOS message\n");
-                listener->eos = 1;
-                if (listener->reader)
-                    dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
-                            listener->reader->event_cb, listener->reader->event_data,
-                            "status", DVB_LISTENER_STATUS_EOS,
-                            "fd", listener->fd,
-                            "cb", listener->callback,
-                            NULL, NULL);
-                break;
+    struct DVBReaderService *service;
+    guint8 i;
+
+    g_mutex_lock(&reader->service_mutex);
+    for (i = 1; i < DVB_READER_MAX_SERVICES; ++i) {
+        if (!(service = reader->services[i]))
+            continue;
+        dvb_reader_service_detach(reader, service);
+        if (service->removed) {
+            g_atomic_pointer_set(&reader->services[i], NULL);
+            g_free(service);
+        }
+        else {
+            g_atomic_int_or(&reader->service_changes, 1u << i);
         }
-
-        g_free(msg);
     }
-
-    LOG(listener->reader->logger, "listener: %d %p reached the unreachable\n", listener->fd, listener->callback);
-    return NULL;
+    g_array_set_size(reader->pat_programs, 0);
+    g_mutex_unlock(&reader->service_mutex);
 }
 
-void _dump_packet(DVBRecorderLogger *logger, const uint8_t *packet)
+static void dvb_reader_push_service_pmt(DVBReader *reader, guint8 services, const uint8_t *packet)
 {
-    uint16_t i;
-    gchar buf[64];
-    for (i = 0; i < TS_SIZE; ++i) {
-        sprintf(&buf[(i % 16) * 3], "%02x ", packet[i]);
-        if (i % 16 == 15 || i+1 == TS_SIZE)
-            LOG(logger, "%s\n", buf);
+    struct DVBReaderService *service;
+
+    for (; services; services &= services - 1) {
+        service = reader->services[__builtin_ctz(services)];
+        if (service && service->pmt_handle)
+            dvbpsi_packet_push(service->pmt_handle, (uint8_t *)packet);
     }
 }
 
-void dvb_reader_listener_send_pat(DVBReader *reader, struct DVBReaderListener *listener)
+/* Messages are taken by the data thread only. Returned messages are collected in message_free; the data thread
+ * takes the whole list at once when its cache is empty, so there is no ABA problem. If the pool is exhausted,
+ * the message is allocated. */
+struct DVBReaderListenerMessage *dvb_reader_listener_message_new(DVBReader *reader)
 {
-    FLOG("\n");
-    LOG(reader->logger, "Send PAT to listener (%u)\n", reader->pat_packet_count);
-    if (reader->pat_packet_count == 0)
-        return;
-    if (listener->have_pat)
-        return;
+    struct DVBReaderListenerMessage *msg;
 
-    uint8_t i;
-    gsize remaining = reader->pat_packet_count * TS_SIZE;
-    gsize buf_size;
-    gsize offset = 0;
-    while (remaining) {
-        if (remaining < DVB_LISTENER_BUFFER_SIZE)
-            buf_size = remaining;
-        else
-            buf_size = DVB_LISTENER_BUFFER_SIZE;
-        dvb_reader_listener_send_message(listener, DVB_READER_LISTENER_MESSAGE_DATA, &reader->pat_data[offset], buf_size, FALSE);
-        remaining -= buf_size;
-        offset += buf_size;
+    if (!reader->message_cache) {
+        do {
+            reader->message_cache = g_atomic_pointer_get(&reader->message_free);
+        } while (!g_atomic_pointer_compare_and_exchange(&reader->message_free, reader->message_cache, NULL));
+    }
+    if ((msg = reader->message_cache) != NULL)
+        reader->message_cache = msg->next;
+    else {
+        g_atomic_int_inc(&reader->message_pool_exhausted);
+        if (posix_memalign((void **)&msg, DVB_READER_PAGE_SIZE, sizeof(struct DVBReaderListenerMessage)) != 0)
+            g_error("Could not allocate a listener message\n");
     }
 
-    for (i = 0; i < reader->pat_packet_count; ++i) {
-        LOG(reader->logger, "PAT[%d]:\n", i);
-        _dump_packet(reader->logger, &reader->pat_data[i * TS_SIZE]);
-/*        dvb_reader_listener_push_packet(listener, DVB_FILTER_PAT, &reader->pat_data[i * TS_SIZE]);*/
+    msg->refcount = 1;
+    msg->timestamp = reader->read_time;
+    msg->data_size = 0;
+    msg->raps = 0;
 
-    }
-    listener->have_pat = 1;
+    return msg;
 }
 
-void dvb_reader_listener_send_pmt(DVBReader *reader, struct DVBReaderListener *listener)
+/* Drop a reference to a message from any thread. Signature matches GFunc. */
+void dvb_reader_listener_message_free(struct DVBReaderListenerMessage *msg, DVBReader *reader)
 {
-    FLOG("\n");
-    LOG(reader->logger, "Send PMT to listener\n");
-    if (reader->pmt_packet_count == 0)
-        return;
+    struct DVBReaderListenerMessage *head;
 
-    if (!listener->have_pat || listener->have_pmt)
+    if (!g_atomic_int_dec_and_test(&msg->refcount))
         return;
 
-    uint8_t i;
-    gsize remaining = reader->pmt_packet_count * TS_SIZE;
-    gsize buf_size;
-    gsize offset = 0;
-    while (remaining) {
-        if (remaining < DVB_LISTENER_BUFFER_SIZE)
-            buf_size = remaining;
-        else
-            buf_size = DVB_LISTENER_BUFFER_SIZE;
-        dvb_reader_listener_send_message(listener, DVB_READER_LISTENER_MESSAGE_DATA, &reader->pmt_data[offset], buf_size, FALSE);
-        remaining -= buf_size;
-        offset += buf_size;
+    if (msg < reader->message_slab || msg >= reader->message_slab + DVB_READER_MESSAGE_POOL_SIZE) {
+        free(msg);
+        return;
     }
 
-    for (i = 0; i < reader->pmt_packet_count; ++i) {
-        LOG(reader->logger, "PMT[%d]:\n", i);
-        _dump_packet(reader->logger, &reader->pmt_data[i * TS_SIZE]);
-   /*     dvb_reader_listener_push_packet(listener, DVB_FILTER_PMT, &reader->pmt_data[i * TS_SIZE]); */
-    }
-    listener->have_pmt = 1;
+    do {
+        head = g_atomic_pointer_get(&reader->message_free);
+        msg->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&reader->message_free, head, msg));
 }
 
-gboolean dvb_reader_get_current_pat_packets(DVBReader *reader, guint8 **buffer, gsize *length)
+static inline void dvb_reader_listener_wakeup(struct DVBReaderListener *listener)
 {
-    FLOG("\n");
-    g_return_val_if_fail(reader != NULL, FALSE);
+    guint64 value = 1;
 
-    if (reader->pat_packet_count == 0)
-        return FALSE;
+    if (g_atomic_int_get(&listener->waiting) && write(listener->wakeup_fd, &value, sizeof(value)) < 0)
+        LOG(listener->reader->logger, "Could not wake up listener %d (%p)\n", listener->fd, listener->callback);
+}
 
-    if (buffer) {
-        *buffer = g_malloc(reader->pat_packet_count * TS_SIZE);
-        memcpy(*buffer, reader->pat_data, reader->pat_packet_count * TS_SIZE);
-    }
-    if (length)
-        *length = (gsize)(reader->pat_packet_count * TS_SIZE);
+/* Raise the sequence number before which the worker thread drops messages. */
+static void dvb_reader_listener_set_drop_before(struct DVBReaderListener *listener, guint seq)
+{
+    guint old;
 
-    return TRUE;
+    do {
+        old = g_atomic_int_get(&listener->drop_before);
+        if ((gint)(seq - old) <= 0)
+            return;
+    } while (!g_atomic_int_compare_and_exchange(&listener->drop_before, old, seq));
 }
 
-gboolean dvb_reader_get_current_pmt_packets(DVBReader *reader, guint8 **buffer, gsize *length)
+/* Apply the overflow policy. Called with queued messages at or above high_water, or while dropping. Returns
+ * whether msg should be queued. Never waits: the data thread must keep up with the tuner. */
+static gboolean dvb_reader_listener_handle_overflow(struct DVBReaderListener *listener,
+                                                    struct DVBReaderListenerMessage *msg, guint queued)
 {
-    FLOG("\n");
-    g_return_val_if_fail(reader != NULL, FALSE);
+    switch (listener->overflow_policy) {
+        case DVB_READER_OVERFLOW_DROP_OLDEST:
+            if (queued >= listener->high_water) {
+                dvb_reader_listener_set_drop_before(listener, listener->pushed + 1 - listener->low_water);
+                dvb_reader_listener_send_control(listener, DVB_READER_LISTENER_MESSAGE_SKIP);
+            }
+            return TRUE;
+        case DVB_READER_OVERFLOW_DROP_UNTIL_RAP:
+        case DVB_READER_OVERFLOW_DROP_NEWEST:
+        default:
+            if (queued >= listener->high_water)
+                listener->dropping = 1;
+            else if (queued <= listener->low_water &&
+                    (listener->overflow_policy != DVB_READER_OVERFLOW_DROP_UNTIL_RAP || msg->raps))
+                listener->dropping = 0;
+            return !listener->dropping;
+    }
+}
 
-    if (reader->pmt_packet_count == 0)
-        return FALSE;
+/* Queue a DATA message, passing the reference to the listener. Call from the data thread only. */
+void dvb_reader_listener_queue_message(struct DVBReaderListener *listener, struct DVBReaderListenerMessage *msg)
+{
+    guint head = listener->ring_head;
+    guint queued = listener->pushed - g_atomic_int_get(&listener->popped);
+
+    if (G_UNLIKELY(listener->dropping || queued >= listener->high_water) &&
+            !dvb_reader_listener_handle_overflow(listener, msg, queued)) {
+        dvb_reader_listener_message_free(msg, listener->reader);
+        g_atomic_int_inc(&listener->dropped);
+        dvb_reader_listener_wakeup(listener);
+        return;
+    }
 
-    if (buffer) {
-        *buffer = g_malloc(reader->pmt_packet_count * TS_SIZE);
-        memcpy(*buffer, reader->pmt_data, reader->pmt_packet_count * TS_SIZE);
+    if (G_LIKELY(g_atomic_int_get(&listener->overflow_length) == 0) &&
+            head - g_atomic_int_get(&listener->ring_tail) < DVB_LISTENER_RING_SIZE) {
+        listener->ring[head & (DVB_LISTENER_RING_SIZE - 1)] = msg;
+        g_atomic_int_set(&listener->ring_head, head + 1);
+    }
+    else {
+        g_mutex_lock(&listener->message_lock);
+        g_queue_push_tail(&listener->overflow, msg);
+        g_atomic_int_inc(&listener->overflow_length);
+        g_mutex_unlock(&listener->message_lock);
     }
-    if (length)
-        *length = (gsize)(reader->pmt_packet_count * TS_SIZE);
+    g_atomic_int_set(&listener->pushed, listener->pushed + 1);
 
-    return TRUE;
+    dvb_reader_listener_wakeup(listener);
 }
 
-gboolean dvb_reader_write_packet(DVBReader *reader, const uint8_t *packet)
+void dvb_reader_listener_send_data(struct DVBReaderListener *listener, const uint8_t *data, gsize size)
 {
-    GList *tmp;
-    struct DVBReaderListener *listener;
-    DVBFilterType type = dvb_reader_get_active_pid_type(reader, ts_get_pid(packet));
+    struct DVBReaderListenerMessage *msg = dvb_reader_listener_message_new(listener->reader);
 
-    g_mutex_lock(&reader->listener_mutex);
-    for (tmp = reader->listeners; tmp; tmp = g_list_next(tmp)) {
-        listener = (struct DVBReaderListener *)tmp->data;
-        dvb_reader_listener_push_packet(listener, type, packet);
+    if (data == listener->buffer) {
+        msg->timestamp = listener->buffer_time;
+        msg->raps = listener->buffer_raps;
     }
-    g_mutex_unlock(&reader->listener_mutex);
-    return TRUE;
+    msg->data_size = size;
+    memcpy(msg->data, data, size);
+
+    dvb_reader_listener_queue_message(listener, msg);
 }
 
-gboolean dvb_reader_handle_packet(const uint8_t *packet, void *userdata)
+/* Post a control message. May be called from any thread. */
+void dvb_reader_listener_send_control(struct DVBReaderListener *listener, enum DVBReaderListenerMessageType type)
 {
-    DVBReader *reader = (DVBReader *)userdata;
-    uint16_t pid = ts_get_pid(packet);
+    guint64 value = 1;
 
-    /* special tables are on pids 0x0000 to 0x001f, we only handle pat (0x00), eit (0x12), sdt (0x11), rst (0x13),
-     * and pmt (via pat), write all others directly and skip check */
-    if (pid > 0x001f && pid != reader->dvbpsi_table_pids[TS_TABLE_PMT])
-        goto done;
+    g_atomic_int_or(&listener->control, 1u << type);
+    if (write(listener->wakeup_fd, &value, sizeof(value)) < 0)
+        LOG(listener->reader->logger, "Could not wake up listener %d (%p)\n", listener->fd, listener->callback);
+}
 
-    uint8_t i;
-    for (i = 0; i < N_TS_TABLE_TYPES; ++i) {
-        if (reader->dvbpsi_table_pids[i] == pid) {
-            if (reader->dvbpsi_handles[i])
-                dvbpsi_packet_push(reader->dvbpsi_handles[i], (uint8_t *)packet);
+/* Let the worker thread drop all DATA messages queued so far. Messages pushed afterwards are kept. */
+void dvb_reader_listener_drop_data(struct DVBReaderListener *listener)
+{
+    dvb_reader_listener_set_drop_before(listener, g_atomic_int_get(&listener->pushed));
+    dvb_reader_listener_send_control(listener, DVB_READER_LISTENER_MESSAGE_DROP);
+}
+
+void dvb_reader_listener_broadcast_control(DVBReader *reader, enum DVBReaderListenerMessageType type)
+{
+    FLOG("\n");
+    struct DVBReaderListenerSnapshot *snapshot;
+    guint32 used;
+
+    g_mutex_lock(&reader->listener_mutex);
+    snapshot = dvb_reader_listener_snapshot_ref(reader->listener_snapshot);
+    g_mutex_unlock(&reader->listener_mutex);
+
+    for (used = snapshot->slots_used; used; used &= used - 1)
+        dvb_reader_listener_send_control(snapshot->slots[__builtin_ctz(used)], type);
+
+    dvb_reader_listener_snapshot_unref(snapshot);
+}
+
+static inline gboolean dvb_reader_listener_has_data(struct DVBReaderListener *listener)
+{
+    return listener->ring_tail != g_atomic_int_get(&listener->ring_head) ||
+           g_atomic_int_get(&listener->overflow_length) != 0;
+}
+
+/* Take the next DATA message, or NULL if there is none. Call from the worker thread only. */
+struct DVBReaderListenerMessage *dvb_reader_listener_pop_message(struct DVBReaderListener *listener)
+{
+    struct DVBReaderListenerMessage *msg = NULL;
+    guint tail = listener->ring_tail;
+
+    if (tail != g_atomic_int_get(&listener->ring_head)) {
+        msg = listener->ring[tail & (DVB_LISTENER_RING_SIZE - 1)];
+        g_atomic_int_set(&listener->ring_tail, tail + 1);
+    }
+    else if (g_atomic_int_get(&listener->overflow_length)) {
+        g_mutex_lock(&listener->message_lock);
+        msg = g_queue_pop_head(&listener->overflow);
+        g_atomic_int_add(&listener->overflow_length, -1);
+        g_mutex_unlock(&listener->message_lock);
+    }
+
+    if (msg)
+        g_atomic_int_set(&listener->popped, listener->popped + 1);
+
+    return msg;
+}
+
+/* Drop the messages pushed before the last DROP or SKIP request, or all messages. Returns the number of messages
+ * dropped. */
+guint dvb_reader_listener_drop_data_messages(struct DVBReaderListener *listener, gboolean all)
+{
+    FLOG("\n");
+    struct DVBReaderListenerMessage *msg;
+    guint drop_before = g_atomic_int_get(&listener->drop_before);
+    guint count = 0;
+
+    while ((all || (gint)(drop_before - listener->popped) > 0) &&
+            (msg = dvb_reader_listener_pop_message(listener)) != NULL) {
+        dvb_reader_listener_message_free(msg, listener->reader);
+        ++count;
+    }
+
+    return count;
+}
+
+static inline gboolean dvb_reader_listener_report_due(struct DVBReaderListener *listener)
+{
+    return g_atomic_int_get(&listener->dropped) != listener->dropped_reported &&
+           g_get_monotonic_time() >= listener->dropped_report_time + DVB_LISTENER_REPORT_INTERVAL;
+}
+
+static inline gboolean dvb_reader_listener_has_work(struct DVBReaderListener *listener)
+{
+    guint control = g_atomic_int_get(&listener->control);
+
+    if (control & ~(1u << DVB_READER_LISTENER_MESSAGE_EOS))
+        return TRUE;
+    if (dvb_reader_listener_report_due(listener))
+        return TRUE;
+    if (dvb_reader_listener_has_data(listener))
+        return g_atomic_int_get(&listener->running) != 0;
+    if (listener->coalesce_size && g_atomic_int_get(&listener->running) &&
+            g_get_monotonic_time() >= listener->coalesce_deadline)
+        return TRUE;
+    return (control & (1u << DVB_READER_LISTENER_MESSAGE_EOS)) != 0;
+}
+
+/* Write packet to internal listener buffer. The caller checked that the listener wants the packet. When the buffer
+ * is full create a new DATA message, send it, and clear the buffer. */
+void dvb_reader_listener_push_packet(struct DVBReaderListener *listener, const uint8_t *packet, gboolean rap)
+{
+    if (listener->buffer_size == 0) {
+        listener->buffer_time = listener->reader->read_time;
+        listener->buffer_raps = 0;
+    }
+    if (rap)
+        listener->buffer_raps |= 1u << (listener->buffer_size / TS_SIZE);
+    memcpy(&listener->buffer[listener->buffer_size], packet, TS_SIZE);
+    listener->buffer_size += TS_SIZE;
+
+    if (listener->buffer_size >= DVB_READER_CHUNK_SIZE) {
+        dvb_reader_listener_send_data(listener, listener->buffer, listener->buffer_size);
+        listener->buffer_size = 0;
+    }
+}
+
+/* Pass on partially filled listener buffers older than the listener's max_latency. */
+static void dvb_reader_flush_listener_buffers(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot)
+{
+    struct DVBReaderListener *listener;
+    guint32 used;
+
+    for (used = snapshot->slots_used; used; used &= used - 1) {
+        listener = snapshot->slots[__builtin_ctz(used)];
+        if (listener->buffer_size && reader->read_time - listener->buffer_time >= listener->max_latency) {
+            dvb_reader_listener_send_data(listener, listener->buffer, listener->buffer_size);
+            listener->buffer_size = 0;
+        }
+    }
+}
+
+/* Done with a pending chunk: keep it while the pipe references it, give it back otherwise. */
+static void dvb_reader_listener_release_output(struct DVBReaderListener *listener, guint index)
+{
+    struct DVBReaderListenerMessage *msg = listener->out_msgs[index];
+
+    if (!msg)
+        return;
+    listener->out_msgs[index] = NULL;
+
+    if (listener->out_spliced) {
+        listener->spliced[listener->spliced_head % DVB_LISTENER_SPLICE_HELD].msg = msg;
+        listener->spliced[listener->spliced_head % DVB_LISTENER_SPLICE_HELD].end = listener->out_total;
+        ++listener->spliced_head;
+        g_atomic_int_inc(&listener->reader->spliced_chunks);
+    }
+    else {
+        dvb_reader_listener_message_free(msg, listener->reader);
+    }
+}
+
+/* Account written bytes to the pending chunks, releasing the ones written completely. */
+static void dvb_reader_listener_advance_output(struct DVBReaderListener *listener, gsize written)
+{
+    struct iovec *iov;
+
+    while (written) {
+        iov = &listener->out_iov[listener->out_index];
+        if (written < iov->iov_len) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+            listener->out_total += written;
+            return;
+        }
+        written -= iov->iov_len;
+        listener->out_total += iov->iov_len;
+        dvb_reader_listener_release_output(listener, listener->out_index++);
+    }
+}
+
+/* Write as much of the pending output as the fd takes. Returns FALSE if the rest has to wait until the fd is
+ * writable. */
+static gboolean dvb_reader_listener_write_pending(struct DVBReaderListener *listener)
+{
+    struct iovec *iov;
+    ssize_t nw;
+    guint count;
+
+    while (listener->out_index < listener->out_count) {
+        iov = &listener->out_iov[listener->out_index];
+        count = listener->out_count - listener->out_index;
+        if (listener->out_splice) {
+            nw = vmsplice(listener->fd, iov, count, SPLICE_F_NONBLOCK);
+            if (nw < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                LOG(listener->reader->logger, "vmsplice to %d not supported, writing instead\n", listener->fd);
+                listener->splice = 0;
+                listener->out_splice = 0;
+                continue;
+            }
+            if (nw > 0)
+                listener->out_spliced = 1;
+        }
+        else {
+            nw = count == 1 ? write(listener->fd, iov->iov_base, iov->iov_len) : writev(listener->fd, iov, count);
+        }
+        if (nw > 0) {
+            g_atomic_pointer_add(&listener->write_bytes, nw);
+            g_atomic_pointer_add(&listener->write_calls, 1);
+            listener->out_since = g_get_monotonic_time();
+            dvb_reader_listener_advance_output(listener, nw);
+            continue;
+        }
+        if (nw < 0 && errno == EINTR)
+            continue;
+        if (nw == 0) {
+            LOG(listener->reader->logger, "Written zero bytes to %d.\n", listener->fd);
             break;
         }
+        if (errno == EAGAIN) {
+            if (g_get_monotonic_time() - listener->out_since < DVB_LISTENER_WRITE_TIMEOUT) {
+                dvb_reader_listener_poll_output(listener, TRUE);
+                return FALSE;
+            }
+            LOG(listener->reader->logger, "Writing to %d timed out.\n", listener->fd);
+        }
+        else {
+            LOG(listener->reader->logger, "Could not write to %d: %s\n", listener->fd, strerror(errno));
+        }
+        listener->write_error = 1;
+        LOG(listener->reader->logger, "signal write error\n");
+        dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
+                listener->reader->event_cb, listener->reader->event_data,
+                "status", DVB_LISTENER_STATUS_WRITE_ERROR,
+                "fd", listener->fd,
+                "cb", listener->callback,
+                "data", listener->userdata,
+                NULL, NULL);
+        break;
+    }
+
+    dvb_reader_listener_poll_output(listener, FALSE);
+    for (; listener->out_index < listener->out_count; ++listener->out_index)
+        dvb_reader_listener_release_output(listener, listener->out_index);
+    listener->out_count = 0;
+    listener->out_index = 0;
+    listener->out_splice = 0;
+    listener->out_spliced = 0;
+
+    return TRUE;
+}
+
+/* Release the spliced chunks the pipe reader has consumed. Returns the number of chunks that can still be
+ * held. */
+static guint dvb_reader_listener_reclaim_spliced(struct DVBReaderListener *listener)
+{
+    struct DVBReaderSplicedChunk *chunk;
+    guint64 consumed;
+    int queued;
+
+    if (listener->spliced_tail != listener->spliced_head && ioctl(listener->fd, FIONREAD, &queued) == 0) {
+        consumed = listener->out_total - (guint64)queued;
+        while (listener->spliced_tail != listener->spliced_head) {
+            chunk = &listener->spliced[listener->spliced_tail % DVB_LISTENER_SPLICE_HELD];
+            if (chunk->end > consumed)
+                break;
+            dvb_reader_listener_message_free(chunk->msg, listener->reader);
+            ++listener->spliced_tail;
+        }
+    }
+
+    return DVB_LISTENER_SPLICE_HELD - (listener->spliced_head - listener->spliced_tail);
+}
+
+/* Number of chunks that can still be added to the pending output. */
+static inline guint dvb_reader_listener_gather_room(struct DVBReaderListener *listener)
+{
+    guint room = DVB_LISTENER_GATHER_MAX - listener->out_count;
+
+    if (listener->out_count && !listener->out_msgs[0])
+        return 0;
+    if (listener->out_splice)
+        room = MIN(room, DVB_LISTENER_SPLICE_HELD - (listener->spliced_head - listener->spliced_tail) -
+                         listener->out_count);
+    return room;
+}
+
+/* Add the random access points of a message to those of the coalesce buffer, before its data is appended. */
+static inline void dvb_reader_listener_coalesce_raps(struct DVBReaderListener *listener, guint32 raps)
+{
+    gsize first = listener->coalesce_size / TS_SIZE;
+
+    if (!raps)
+        return;
+    listener->coalesce_raps[first / 32] |= raps << (first % 32);
+    if (first % 32 && (raps >> (32 - first % 32)))
+        listener->coalesce_raps[first / 32 + 1] |= raps >> (32 - first % 32);
+}
+
+/* Pass data to the callback of the listener and add it to the output pending for the fd. msg is released once
+ * the data is written, it is NULL for the coalesce buffer. */
+static void dvb_reader_listener_deliver(struct DVBReaderListener *listener, const uint8_t *data, gsize size,
+                                        struct DVBReaderListenerMessage *msg)
+{
+    if (listener->callback) {
+        struct DVBReaderDelivery delivery = { data, size, msg ? &msg->raps : listener->coalesce_raps };
+        g_private_set(&dvb_reader_delivery, &delivery);
+        listener->callback(data, size, listener->userdata);
+        g_private_set(&dvb_reader_delivery, NULL);
+    }
+    if (listener->fd < 0 || listener->write_error) {
+        if (msg)
+            dvb_reader_listener_message_free(msg, listener->reader);
+        return;
+    }
+
+    if (listener->out_count == 0) {
+        listener->out_since = g_get_monotonic_time();
+        /* Messages stay untouched until freed, unlike the coalesce buffer. */
+        listener->out_splice = listener->splice && msg && dvb_reader_listener_reclaim_spliced(listener) > 0;
+    }
+    listener->out_iov[listener->out_count].iov_base = (void *)data;
+    listener->out_iov[listener->out_count].iov_len = size;
+    listener->out_msgs[listener->out_count] = msg;
+    ++listener->out_count;
+}
+
+static void dvb_reader_listener_flush_coalesced(struct DVBReaderListener *listener)
+{
+    if (listener->coalesce_size) {
+        dvb_reader_listener_deliver(listener, listener->coalesce_buffer, listener->coalesce_size, NULL);
+        listener->coalesce_size = 0;
+    }
+}
+/* (Re)allocate the buffer collecting messages if the chunk size exceeds a message. Pending data is dropped. */
+void dvb_reader_listener_setup_coalescing(struct DVBReaderListener *listener)
+{
+    gsize chunk_size = (gsize)g_atomic_pointer_get(&listener->chunk_size);
+
+    listener->coalesce_size = 0;
+    if (chunk_size == listener->coalesce_capacity)
+        return;
+
+    g_free(listener->coalesce_buffer);
+    g_free(listener->coalesce_raps);
+    listener->coalesce_buffer = NULL;
+    listener->coalesce_raps = NULL;
+    listener->coalesce_capacity = 0;
+    if (chunk_size > DVB_LISTENER_BUFFER_SIZE) {
+        listener->coalesce_buffer = g_malloc(chunk_size);
+        listener->coalesce_raps = g_new(guint32, DVB_LISTENER_RAP_WORDS(chunk_size));
+        listener->coalesce_capacity = chunk_size;
+    }
+}
+
+/* Have the worker woken up once the fd is writable. Regular files cannot be polled, but never block either. */
+void dvb_reader_listener_poll_output(struct DVBReaderListener *listener, gboolean enable)
+{
+    struct epoll_event ev;
+
+    if (listener->out_polling == (enable ? 1 : 0))
+        return;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(listener->worker->epoll_fd, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listener->fd, &ev) < 0) {
+        if (errno != EPERM)
+            LOG(listener->reader->logger, "Could not poll %d: %s\n", listener->fd, strerror(errno));
+        return;
+    }
+    listener->out_polling = enable ? 1 : 0;
+}
+
+/* Do what the listener has to do without blocking. Returns FALSE if the listener quit and was detached from its
+ * worker; it may be freed by then. */
+static gboolean dvb_reader_listener_service(struct DVBReaderListener *listener)
+{
+    struct DVBReaderListenerMessage *msg;
+    guint control;
+    guint budget = DVB_LISTENER_SERVICE_BUDGET;
+
+    g_atomic_int_set(&listener->waiting, 0);
+
+    while (1) {
+        control = g_atomic_int_get(&listener->control);
+
+        if (control & (1u << DVB_READER_LISTENER_MESSAGE_QUIT)) {
+            LOG(listener->reader->logger, "listener got QUIT message\n");
+            dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
+                    listener->reader->event_cb, listener->reader->event_data,
+                    "status", DVB_LISTENER_STATUS_TERMINATED,
+                    "fd", listener->fd,
+                    "cb", listener->callback,
+                    "data", listener->userdata,
+                    NULL, NULL);
+            dvb_reader_worker_detach(listener->worker, listener);
+            return FALSE;
+        }
+        /* A partially written chunk is finished first to keep the output packet aligned. */
+        if ((control & (1u << DVB_READER_LISTENER_MESSAGE_DROP)) && !listener->out_count) {
+            LOG(listener->reader->logger, "listener got DROP message\n");
+            g_atomic_int_and(&listener->control, ~(1u << DVB_READER_LISTENER_MESSAGE_DROP));
+            dvb_reader_listener_drop_data_messages(listener, FALSE);
+            listener->write_error = 0;
+            listener->eos = 0;
+            dvb_reader_listener_setup_coalescing(listener);
+        }
+        if (control & (1u << DVB_READER_LISTENER_MESSAGE_CONTINUE)) {
+            LOG(listener->reader->logger, "listener got CONTINUE message\n");
+            g_atomic_int_and(&listener->control, ~(1u << DVB_READER_LISTENER_MESSAGE_CONTINUE));
+            g_atomic_int_set(&listener->running, 1);
+        }
+        if (control & (1u << DVB_READER_LISTENER_MESSAGE_SKIP)) {
+            g_atomic_int_and(&listener->control, ~(1u << DVB_READER_LISTENER_MESSAGE_SKIP));
+            g_atomic_int_add(&listener->dropped, dvb_reader_listener_drop_data_messages(listener, FALSE));
+        }
+        if (dvb_reader_listener_report_due(listener)) {
+            listener->dropped_reported = g_atomic_int_get(&listener->dropped);
+            listener->dropped_report_time = g_get_monotonic_time();
+            LOG(listener->reader->logger, "listener %d (%p) dropped %u chunks\n",
+                listener->fd, listener->callback, listener->dropped_reported);
+            dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
+                    listener->reader->event_cb, listener->reader->event_data,
+                    "status", DVB_LISTENER_STATUS_OVERFLOW,
+                    "fd", listener->fd,
+                    "cb", listener->callback,
+                    "data", listener->userdata,
+                    "dropped", GUINT_TO_POINTER(listener->dropped_reported),
+                    NULL, NULL);
+        }
+
+        if (listener->out_count) {
+            if (!dvb_reader_listener_write_pending(listener))
+                return TRUE;
+            continue;
+        }
+
+        if (budget == 0)
+            return TRUE;
+
+        if (g_atomic_int_get(&listener->running) && (msg = dvb_reader_listener_pop_message(listener)) != NULL) {
+            --budget;
+            if (!listener->coalesce_buffer) {
+                /* Gather what else is queued into the same write. */
+                dvb_reader_listener_deliver(listener, msg->data, msg->data_size, msg);
+                while (listener->out_count && budget && dvb_reader_listener_gather_room(listener) &&
+                        (msg = dvb_reader_listener_pop_message(listener)) != NULL) {
+                    --budget;
+                    dvb_reader_listener_deliver(listener, msg->data, msg->data_size, msg);
+                }
+                continue;
+            }
+            if (listener->coalesce_size == 0) {
+                listener->coalesce_deadline = msg->timestamp + listener->max_latency;
+                memset(listener->coalesce_raps, 0,
+                       DVB_LISTENER_RAP_WORDS(listener->coalesce_capacity) * sizeof(guint32));
+            }
+            /* The buffer is passed on while it has room for another message, so the message always fits. */
+            dvb_reader_listener_coalesce_raps(listener, msg->raps);
+            memcpy(&listener->coalesce_buffer[listener->coalesce_size], msg->data, msg->data_size);
+            listener->coalesce_size += msg->data_size;
+            dvb_reader_listener_message_free(msg, listener->reader);
+            if (listener->coalesce_size + DVB_LISTENER_BUFFER_SIZE > listener->coalesce_capacity)
+                dvb_reader_listener_flush_coalesced(listener);
+            continue;
+        }
+
+        if (listener->coalesce_size && g_atomic_int_get(&listener->running) &&
+                g_get_monotonic_time() >= listener->coalesce_deadline) {
+            dvb_reader_listener_flush_coalesced(listener);
+            continue;
+        }
+
+        /* EOS is sent after the last data, handle it once all data is written. */
+        if ((control & (1u << DVB_READER_LISTENER_MESSAGE_EOS)) && !dvb_reader_listener_has_data(listener)) {
+            if (listener->coalesce_size) {
+                dvb_reader_listener_flush_coalesced(listener);
+                continue;
+            }
+            LOG(listener->reader->logger, "listener got EOS message\n");
+            g_atomic_int_and(&listener->control, ~(1u << DVB_READER_LISTENER_MESSAGE_EOS));
+            listener->eos = 1;
+            dvb_recorder_event_send(DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
+                    listener->reader->event_cb, listener->reader->event_data,
+                    "status", DVB_LISTENER_STATUS_EOS,
+                    "fd", listener->fd,
+                    "cb", listener->callback,
+                    "data", listener->userdata,
+                    NULL, NULL);
+            continue;
+        }
+
+        g_atomic_int_set(&listener->waiting, 1);
+        if (!dvb_reader_listener_has_work(listener))
+            return TRUE;
+        g_atomic_int_set(&listener->waiting, 0);
+    }
+}
+
+/* When the worker has to look at the listener again if nothing wakes it up. */
+static gint64 dvb_reader_listener_next_deadline(struct DVBReaderListener *listener)
+{
+    gint64 deadline = G_MAXINT64;
+
+    if (listener->out_count)
+        deadline = listener->out_since + DVB_LISTENER_WRITE_TIMEOUT;
+    else if (g_atomic_int_get(&listener->running) && dvb_reader_listener_has_data(listener))
+        return 0;
+    else if (listener->coalesce_size && g_atomic_int_get(&listener->running))
+        deadline = listener->coalesce_deadline;
+
+    if (g_atomic_int_get(&listener->dropped) != listener->dropped_reported)
+        deadline = MIN(deadline, listener->dropped_report_time + DVB_LISTENER_REPORT_INTERVAL);
+    /* Spliced chunks are released as the pipe is read. */
+    dvb_reader_listener_reclaim_spliced(listener);
+    if (listener->spliced_tail != listener->spliced_head)
+        deadline = MIN(deadline, g_get_monotonic_time() + DVB_LISTENER_SPLICE_RECLAIM_INTERVAL);
+
+    return deadline;
+}
+
+static inline void dvb_reader_drain_eventfd(int fd)
+{
+    guint64 value;
+
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+static inline void dvb_reader_worker_wakeup(struct DVBReaderWorker *worker)
+{
+    guint64 value = 1;
+
+    if (write(worker->wakeup_fd, &value, sizeof(value)) < 0)
+        LOG(worker->reader->logger, "Could not wake up worker %p\n", worker);
+}
+
+struct DVBReaderWorker *dvb_reader_worker_new(DVBReader *reader, gboolean dedicated)
+{
+    FLOG("\n");
+    struct DVBReaderWorker *worker = g_malloc0(sizeof(struct DVBReaderWorker));
+    struct epoll_event ev;
+
+    worker->reader = reader;
+    worker->dedicated = dedicated ? 1 : 0;
+    worker->listeners = g_ptr_array_new();
+    g_mutex_init(&worker->lock);
+    g_cond_init(&worker->detach_cond);
+
+    if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        LOG(reader->logger, "Error creating epoll instance: %s\n", strerror(errno));
+    if ((worker->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+        LOG(reader->logger, "Error creating eventfd: %s\n", strerror(errno));
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = worker;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wakeup_fd, &ev) < 0)
+        LOG(reader->logger, "Could not poll worker eventfd: %s\n", strerror(errno));
+
+    worker->thread = g_thread_new(dedicated ? "ListenerDispatch" : "ListenerWriter",
+                                  (GThreadFunc)dvb_reader_worker_thread_proc, worker);
+
+    return worker;
+}
+
+static void dvb_reader_worker_clear(struct DVBReaderWorker *worker)
+{
+    if (worker->epoll_fd >= 0)
+        close(worker->epoll_fd);
+    if (worker->wakeup_fd >= 0)
+        close(worker->wakeup_fd);
+    g_ptr_array_free(worker->listeners, TRUE);
+    g_mutex_clear(&worker->lock);
+    g_cond_clear(&worker->detach_cond);
+    g_free(worker);
+}
+
+/* Stop the worker. Its listeners have to be detached. */
+void dvb_reader_worker_free(struct DVBReaderWorker *worker)
+{
+    FLOG("\n");
+    if (!worker)
+        return;
+
+    g_atomic_int_set(&worker->quit, 1);
+    dvb_reader_worker_wakeup(worker);
+    g_thread_join(worker->thread);
+
+    dvb_reader_worker_clear(worker);
+}
+
+void dvb_reader_worker_attach(struct DVBReaderWorker *worker, struct DVBReaderListener *listener)
+{
+    struct epoll_event ev;
+
+    listener->worker = worker;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = listener;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, listener->wakeup_fd, &ev) < 0)
+        LOG(worker->reader->logger, "Could not poll listener eventfd: %s\n", strerror(errno));
+
+    g_mutex_lock(&worker->lock);
+    g_ptr_array_add(worker->listeners, listener);
+    g_mutex_unlock(&worker->lock);
+
+    dvb_reader_worker_wakeup(worker);
+}
+
+/* Remove the listener from the worker. Call from the worker thread only. */
+void dvb_reader_worker_detach(struct DVBReaderWorker *worker, struct DVBReaderListener *listener)
+{
+    /* removed listeners are detached on QUIT, before the last reference is dropped */
+    if (listener->detached)
+        return;
+
+    dvb_reader_listener_poll_output(listener, FALSE);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, listener->wakeup_fd, NULL);
+
+    g_mutex_lock(&worker->lock);
+    g_ptr_array_remove(worker->listeners, listener);
+    listener->detached = 1;
+    g_cond_broadcast(&worker->detach_cond);
+    g_mutex_unlock(&worker->lock);
+}
+
+gpointer dvb_reader_worker_thread_proc(struct DVBReaderWorker *worker)
+{
+    FLOG("\n");
+    struct epoll_event events[16];
+    struct DVBReaderListener *listener;
+    gboolean referenced;
+    gint64 next, deadline;
+    guint i;
+    int count, timeout;
+
+    LOG(worker->reader->logger, "dvb_reader_worker_thread_proc %p (%s)\n",
+        worker, worker->dedicated ? "dedicated" : "shared");
+
+    while (!g_atomic_int_get(&worker->quit)) {
+        next = G_MAXINT64;
+
+        for (i = 0; ; ) {
+            g_mutex_lock(&worker->lock);
+            listener = i < worker->listeners->len ? g_ptr_array_index(worker->listeners, i) : NULL;
+            /* A listener being freed has no references left, but stays attached until it handled QUIT. */
+            referenced = listener && dvb_reader_listener_try_ref(listener);
+            g_mutex_unlock(&worker->lock);
+            if (!listener)
+                break;
+
+            if (dvb_reader_listener_service(listener)) {
+                deadline = dvb_reader_listener_next_deadline(listener);
+                next = MIN(next, deadline);
+            }
+            if (referenced)
+                dvb_reader_listener_unref(listener);
+
+            /* Detached listeners were removed from the array. */
+            g_mutex_lock(&worker->lock);
+            if (i < worker->listeners->len && g_ptr_array_index(worker->listeners, i) == listener)
+                ++i;
+            g_mutex_unlock(&worker->lock);
+        }
+
+        if (g_atomic_int_get(&worker->quit))
+            break;
+
+        if (next == G_MAXINT64)
+            timeout = 1000;
+        else
+            timeout = CLAMP((next - g_get_monotonic_time() + G_TIME_SPAN_MILLISECOND - 1) / G_TIME_SPAN_MILLISECOND,
+                            0, 1000);
+
+        if ((count = epoll_wait(worker->epoll_fd, events, G_N_ELEMENTS(events), timeout)) < 0) {
+            if (errno != EINTR) {
+                LOG(worker->reader->logger, "epoll_wait returned an error: %d %s\n", errno, strerror(errno));
+                g_usleep(timeout * G_TIME_SPAN_MILLISECOND);
+            }
+            continue;
+        }
+
+        /* Reset the eventfds; an fd becoming writable has no data attached. Listeners are only detached by this
+         * thread, so they are still valid. */
+        while (count-- > 0) {
+            if (events[count].data.ptr == worker)
+                dvb_reader_drain_eventfd(worker->wakeup_fd);
+            else if (events[count].data.ptr)
+                dvb_reader_drain_eventfd(((struct DVBReaderListener *)events[count].data.ptr)->wakeup_fd);
+        }
+    }
+
+    LOG(worker->reader->logger, "worker %p quit\n", worker);
+
+    if (g_atomic_int_get(&worker->orphaned)) {
+        g_thread_unref(worker->thread);
+        dvb_reader_worker_clear(worker);
+    }
+
+    return NULL;
+}
+void _dump_packet(DVBRecorderLogger *logger, const uint8_t *packet)
+{
+    uint16_t i;
+    gchar buf[64];
+    for (i = 0; i < TS_SIZE; ++i) {
+        sprintf(&buf[(i % 16) * 3], "%02x ", packet[i]);
+        if (i % 16 == 15 || i+1 == TS_SIZE)
+            LOG(logger, "%s\n", buf);
+    }
+}
+
+/* The rewritten PAT or PMT for a listener: that of the tuned service or of the one it selected. Call from the data
+ * thread, or with table_mutex held. */
+static void dvb_reader_listener_get_table(DVBReader *reader, guint8 index, gboolean pmt,
+                                          uint8_t **data, uint8_t *count)
+{
+    struct DVBReaderService *service;
+
+    if (index == 0) {
+        *data = pmt ? reader->pmt_data : reader->pat_data;
+        *count = pmt ? reader->pmt_packet_count : reader->pat_packet_count;
+        return;
+    }
+
+    service = index < DVB_READER_MAX_SERVICES ? reader->services[index] : NULL;
+    *data = service ? (pmt ? service->pmt_data : service->pat_data) : NULL;
+    *count = service ? (pmt ? service->pmt_packet_count : service->pat_packet_count) : 0;
+}
+
+/* The current PMT of the service at index and the pid it is sent on, NULL if there is no such service. Call from
+ * the data thread, or with table_mutex held. */
+static struct DVBReaderPmtCache *dvb_reader_service_pmt_cache(DVBReader *reader, guint8 index, uint16_t *pid)
+{
+    struct DVBReaderService *service;
+
+    if (index == 0) {
+        *pid = reader->dvbpsi_table_pids[TS_TABLE_PMT];
+        return &reader->pmt_cache;
+    }
+
+    service = index < DVB_READER_MAX_SERVICES ? reader->services[index] : NULL;
+    if (!service)
+        return NULL;
+    *pid = service->pmt_pid;
+    return &service->pmt_cache;
+}
+
+static gboolean dvb_reader_pmt_cache_lookup(struct DVBReaderPmtCache *cache, guint16 filter,
+                                            uint8_t **data, uint8_t *count)
+{
+    guint i;
+
+    for (i = 0; i < DVB_READER_PMT_CACHE_SIZE; ++i) {
+        if (cache->entries[i].packet_count && cache->entries[i].filter == filter) {
+            *data = cache->entries[i].data;
+            *count = cache->entries[i].packet_count;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* The PMT for a listener: that of its service, listing only the streams its filter keeps. Filtered PMTs are made
+ * once per filter and version. Data thread only. */
+static void dvb_reader_listener_get_pmt(DVBReader *reader, struct DVBReaderListener *listener,
+                                        uint8_t **data, uint8_t *count)
+{
+    struct DVBReaderPmtCache *cache;
+    guint16 filter = listener->filter & DVB_READER_PMT_TYPES;
+    uint16_t pid;
+    guint8 entry;
+
+    guint8 service = reader->active_snapshot->slot_service[listener->slot];
+
+    dvb_reader_listener_get_table(reader, service, TRUE, data, count);
+    if (*count == 0 || filter == DVB_READER_PMT_TYPES)
+        return;
+
+    cache = dvb_reader_service_pmt_cache(reader, service, &pid);
+    if (!cache || !cache->pmt || dvb_reader_pmt_cache_lookup(cache, filter, data, count))
+        return;
+
+    dvb_reader_generate_filtered_pmt(reader, cache->pmt, pid, filter, data, count);
+
+    g_mutex_lock(&reader->table_mutex);
+    entry = cache->next;
+    cache->next = (entry + 1) % DVB_READER_PMT_CACHE_SIZE;
+    g_free(cache->entries[entry].data);
+    cache->entries[entry].filter = filter;
+    cache->entries[entry].data = *data;
+    cache->entries[entry].packet_count = *count;
+    g_mutex_unlock(&reader->table_mutex);
+}
+
+static void dvb_reader_listener_send_table(DVBReader *reader, struct DVBReaderListener *listener,
+                                           const uint8_t *data, uint8_t count)
+{
+    gsize remaining = count * TS_SIZE;
+    gsize buf_size;
+    gsize offset = 0;
+
+    while (remaining) {
+        if (remaining < DVB_READER_CHUNK_SIZE)
+            buf_size = remaining;
+        else
+            buf_size = DVB_READER_CHUNK_SIZE;
+        dvb_reader_listener_send_data(listener, &data[offset], buf_size);
+        remaining -= buf_size;
+        offset += buf_size;
+    }
+}
+
+void dvb_reader_listener_send_pat(DVBReader *reader, struct DVBReaderListener *listener)
+{
+    FLOG("\n");
+    uint8_t *data;
+    uint8_t count;
+
+    dvb_reader_listener_get_table(reader, reader->active_snapshot->slot_service[listener->slot], FALSE, &data, &count);
+    LOG(reader->logger, "Send PAT to listener (%u)\n", count);
+    if (count == 0)
+        return;
+    if (listener->have_pat)
+        return;
+
+    dvb_reader_listener_send_table(reader, listener, data, count);
+
+    uint8_t i;
+    for (i = 0; i < count; ++i) {
+        LOG(reader->logger, "PAT[%d]:\n", i);
+        _dump_packet(reader->logger, &data[i * TS_SIZE]);
+    }
+    listener->have_pat = 1;
+}
+
+void dvb_reader_listener_send_pmt(DVBReader *reader, struct DVBReaderListener *listener)
+{
+    FLOG("\n");
+    uint8_t *data;
+    uint8_t count;
+
+    LOG(reader->logger, "Send PMT to listener\n");
+    dvb_reader_listener_get_pmt(reader, listener, &data, &count);
+    if (count == 0)
+        return;
+
+    if (!listener->have_pat || listener->have_pmt)
+        return;
+
+    dvb_reader_listener_send_table(reader, listener, data, count);
+
+    uint8_t i;
+    for (i = 0; i < count; ++i) {
+        LOG(reader->logger, "PMT[%d]:\n", i);
+        _dump_packet(reader->logger, &data[i * TS_SIZE]);
+    }
+    listener->have_pmt = 1;
+}
+
+static gboolean dvb_reader_copy_table(DVBReader *reader, guint16 program_number, gboolean pmt, DVBFilterType filter,
+                                      guint8 **buffer, gsize *length)
+{
+    struct DVBReaderPmtCache *cache;
+    uint8_t *data, *filtered = NULL;
+    uint8_t count = 0;
+    uint16_t pid;
+    guint8 index;
+
+    g_mutex_lock(&reader->service_mutex);
+    g_mutex_lock(&reader->table_mutex);
+
+    index = dvb_reader_find_service(reader, program_number);
+    if (index != DVB_READER_NO_SERVICE)
+        dvb_reader_listener_get_table(reader, index, pmt, &data, &count);
+
+    /* filtered PMTs not sent yet are made here but not cached, the cache belongs to the data thread */
+    filter &= DVB_READER_PMT_TYPES;
+    if (count && pmt && filter != DVB_READER_PMT_TYPES &&
+            (cache = dvb_reader_service_pmt_cache(reader, index, &pid)) != NULL && cache->pmt &&
+            !dvb_reader_pmt_cache_lookup(cache, filter, &data, &count)) {
+        dvb_reader_generate_filtered_pmt(reader, cache->pmt, pid, filter, &filtered, &count);
+        data = filtered;
+    }
+
+    if (count && buffer) {
+        *buffer = g_malloc(count * TS_SIZE);
+        memcpy(*buffer, data, count * TS_SIZE);
+    }
+    if (count && length)
+        *length = (gsize)(count * TS_SIZE);
+
+    g_mutex_unlock(&reader->table_mutex);
+    g_mutex_unlock(&reader->service_mutex);
+
+    g_free(filtered);
+
+    return count != 0;
+}
+
+gboolean dvb_reader_get_current_pat_packets(DVBReader *reader, guint8 **buffer, gsize *length)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    return dvb_reader_copy_table(reader, 0, FALSE, DVB_FILTER_ALL, buffer, length);
+}
+
+gboolean dvb_reader_get_current_pmt_packets(DVBReader *reader, guint8 **buffer, gsize *length)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    return dvb_reader_copy_table(reader, 0, TRUE, DVB_FILTER_ALL, buffer, length);
+}
+
+gboolean dvb_reader_get_service_pat_packets(DVBReader *reader, guint16 program_number, guint8 **buffer, gsize *length)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    return dvb_reader_copy_table(reader, program_number, FALSE, DVB_FILTER_ALL, buffer, length);
+}
+
+gboolean dvb_reader_get_service_pmt_packets(DVBReader *reader, guint16 program_number, DVBFilterType filter,
+                                            guint8 **buffer, gsize *length)
+{
+    FLOG("\n");
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    return dvb_reader_copy_table(reader, program_number, TRUE, filter, buffer, length);
+}
+
+/* Whether a packet of a video pid starts a random access point: its random_access_indicator is set, or the PES
+ * starting in it begins with a sequence or GOP header (MPEG-2), an IDR picture or SPS (H.264), or an IRAP picture
+ * or parameter set (HEVC). Broadcasters repeat the parameter sets with each keyframe only. */
+static gboolean dvb_reader_packet_is_rap(const uint8_t *packet, guint8 codec)
+{
+    const uint8_t *payload, *es;
+    const uint8_t *end = packet + TS_SIZE;
+    guint8 nal;
+
+    if (ts_has_adaptation(packet) && ts_get_adaptation(packet) && tsaf_has_randomaccess(packet))
+        return TRUE;
+    if (!ts_get_unitstart(packet) || !ts_has_payload(packet))
+        return FALSE;
+
+    payload = ts_payload((uint8_t *)packet);
+    if (payload + PES_HEADER_SIZE_NOPTS > end || !pes_validate(payload) || !pes_validate_header(payload))
+        return FALSE;
+
+    for (es = payload + PES_HEADER_SIZE_NOPTS + pes_get_headerlength(payload); es + 4 <= end; ++es) {
+        if (es[0] != 0 || es[1] != 0 || es[2] != 1)
+            continue;
+        switch (codec) {
+            case DVB_READER_CODEC_MPEG2:
+                if (es[3] == 0xb3 || es[3] == 0xb8)
+                    return TRUE;
+                if (es[3] == 0x00)       /* picture without a sequence header */
+                    return FALSE;
+                break;
+            case DVB_READER_CODEC_H264:
+                nal = es[3] & 0x1f;
+                if (nal == 5 || nal == 7)
+                    return TRUE;
+                if (nal == 1)            /* non-IDR slice */
+                    return FALSE;
+                break;
+            case DVB_READER_CODEC_HEVC:
+                nal = (es[3] >> 1) & 0x3f;
+                if ((nal >= 16 && nal <= 21) || (nal >= 32 && nal <= 34))
+                    return TRUE;
+                if (nal < 16)            /* non-IRAP slice */
+                    return FALSE;
+                break;
+        }
+        es += 2;
+    }
+
+    return FALSE;
+}
+
+/* Looks up the marks the data thread set with the data; the pid table may have changed since. */
+gboolean dvb_reader_packet_is_random_access_point(DVBReader *reader, const guint8 *packet)
+{
+    struct DVBReaderDelivery *delivery = g_private_get(&dvb_reader_delivery);
+    gsize index;
+
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    if (!delivery || packet < delivery->data || packet >= delivery->data + delivery->size)
+        return FALSE;
+
+    index = (gsize)(packet - delivery->data) / TS_SIZE;
+    return (delivery->raps[index / 32] >> (index % 32)) & 1;
+}
+
+/* Start caching a new GOP, applying a changed size limit. */
+static void dvb_reader_gop_cache_restart(DVBReader *reader)
+{
+    gsize limit = (gsize)g_atomic_pointer_get(&reader->gop_cache_limit) / TS_SIZE * TS_SIZE;
+
+    if (limit != reader->gop_cache_capacity) {
+        g_free(reader->gop_cache);
+        reader->gop_cache = limit ? g_malloc(limit) : NULL;
+        g_atomic_pointer_set(&reader->gop_cache_capacity, limit);
+    }
+    g_atomic_pointer_set(&reader->gop_cache_size, 0);
+    reader->gop_cache_valid = limit != 0;
+}
+
+static inline void dvb_reader_gop_cache_append(DVBReader *reader, const uint8_t *packet)
+{
+    if (reader->gop_cache_size + TS_SIZE > reader->gop_cache_capacity) {
+        /* A partial GOP is useless, wait for the next random access point. */
+        reader->gop_cache_valid = FALSE;
+        g_atomic_pointer_set(&reader->gop_cache_size, 0);
+        g_atomic_int_inc(&reader->gop_cache_overflows);
+        return;
+    }
+    memcpy(&reader->gop_cache[reader->gop_cache_size], packet, TS_SIZE);
+    g_atomic_pointer_set(&reader->gop_cache_size, reader->gop_cache_size + TS_SIZE);
+}
+
+/* Pass the cached GOP to a listener waiting for a random access point. Returns FALSE if there is none, or if it
+ * does not fit into the listener's queue. */
+static gboolean dvb_reader_listener_replay_gop(DVBReader *reader, struct DVBReaderListener *listener)
+{
+    const uint8_t *packet;
+    gsize offset;
+
+    if (!reader->gop_cache_valid || !reader->gop_cache_size || !listener->have_pmt ||
+            reader->active_snapshot->slot_service[listener->slot] != 0)
+        return FALSE;
+    if (reader->gop_cache_size / DVB_READER_CHUNK_SIZE + 1 >= listener->high_water)
+        return FALSE;
+
+    /* the cache starts with the random access point */
+    for (offset = 0; offset < reader->gop_cache_size; offset += TS_SIZE) {
+        packet = &reader->gop_cache[offset];
+        if (dvb_reader_listener_wants_type(listener, reader->pid_table[ts_get_pid(packet)].type))
+            dvb_reader_listener_push_packet(listener, packet, offset == 0);
+    }
+    g_atomic_int_inc(&reader->gop_cache_replays);
+
+    return TRUE;
+}
+
+/* Append a packet of the service to the time-shift ring. Seek points go before keyframes, or audio frames of
+ * services without video, and are followed by the current tables. */
+static void dvb_reader_timeshift_append(DVBReader *reader, DVBTimeshift *timeshift, struct DVBPidEntry *entry,
+                                        const uint8_t *packet, gboolean rap)
+{
+    if (!rap && !reader->have_video && (entry->type & DVB_FILTER_AUDIO))
+        rap = ts_get_unitstart(packet) && ts_has_payload(packet);
+
+    /* the data thread replaces the tables, no need to lock */
+    if (rap && reader->pmt_packet_count && dvb_timeshift_mark_rap(timeshift)) {
+        dvb_timeshift_push(timeshift, reader->pat_data, reader->pat_packet_count * TS_SIZE);
+        dvb_timeshift_push(timeshift, reader->pmt_data, reader->pmt_packet_count * TS_SIZE);
+    }
+    dvb_timeshift_push(timeshift, packet, TS_SIZE);
+}
+
+/* Look for random access points, fill the GOP cache and the time-shift ring. Returns whether the packet is a
+ * random access point. */
+static inline gboolean dvb_reader_track_packet(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot,
+                                               struct DVBPidEntry *entry, const uint8_t *packet)
+{
+    gboolean rap = FALSE;
+
+    if (G_UNLIKELY(entry->codec) && dvb_reader_packet_is_rap(packet, entry->codec)) {
+        g_atomic_int_inc(&reader->random_access_points);
+        rap = TRUE;
+        if (entry->services & DVB_READER_MAIN_SERVICE)
+            dvb_reader_gop_cache_restart(reader);
+    }
+    /* GOP cache and time-shift hold the tuned service */
+    if (!(entry->services & DVB_READER_MAIN_SERVICE))
+        return rap;
+    if (reader->gop_cache_valid && (entry->type & DVB_READER_GOP_CACHE_TYPES))
+        dvb_reader_gop_cache_append(reader, packet);
+    if (snapshot->timeshift && (entry->type & DVB_READER_GOP_CACHE_TYPES))
+        dvb_reader_timeshift_append(reader, snapshot->timeshift, entry, packet, rap);
+
+    return rap;
+}
+
+/* Whether a packet is passed on as a random access point: a keyframe found by dvb_reader_track_packet(), or for
+ * services without video the start of an audio frame. Data thread only. */
+static inline gboolean dvb_reader_packet_marks_rap(DVBReader *reader, struct DVBPidEntry *entry,
+                                                   const uint8_t *packet, gboolean keyframe)
+{
+    if (keyframe)
+        return TRUE;
+    return (entry->type & DVB_FILTER_AUDIO) && (entry->services & ~reader->video_services) &&
+           ts_get_unitstart(packet) && ts_has_payload(packet);
+}
+
+/* Fast path if every listener wants every packet the tuner passes but the original PAT and PMT, which they get
+ * rewritten. Runs of wanted packets are copied into the shared chunk as a whole, and the chunk goes to every
+ * listener by reference. */
+static void dvb_reader_pass_packets(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot,
+                                    const uint8_t *packets, size_t count)
+{
+    const uint8_t *packet;
+    struct DVBPidEntry *entry;
+    guint64 raps = 0;         /* a batch has at most DVB_READER_PACKET_BATCH packets */
+    gboolean rap;
+    size_t i, start, n;
+
+    for (i = 0, start = 0; i <= count; ++i) {
+        if (i < count) {
+            packet = &packets[i * TS_SIZE];
+            entry = &reader->pid_table[ts_get_pid(packet)];
+            rap = dvb_reader_track_packet(reader, snapshot, entry, packet);
+            if (dvb_reader_packet_marks_rap(reader, entry, packet, rap))
+                raps |= (guint64)1 << i;
+            if (snapshot->type_listeners[entry->type] & snapshot->service_listeners[entry->services])
+                continue;
+        }
+
+        g_atomic_pointer_add(&reader->passthrough_bytes, (i - start) * TS_SIZE);
+        while (start < i) {
+            if (!reader->chunk)
+                reader->chunk = dvb_reader_listener_message_new(reader);
+            n = MIN(i - start, DVB_READER_CHUNK_PACKETS - reader->chunk_packets);
+            memcpy(&reader->chunk->data[reader->chunk->data_size], &packets[start * TS_SIZE], n * TS_SIZE);
+            reader->chunk->data_size += n * TS_SIZE;
+            reader->chunk->raps |= (guint32)((raps >> start) & (((guint64)1 << n) - 1)) << reader->chunk_packets;
+            reader->chunk_packets += n;
+            start += n;
+            if (reader->chunk_packets == DVB_READER_CHUNK_PACKETS)
+                dvb_reader_flush_chunk(reader, snapshot);
+        }
+        start = i + 1;
+    }
+}
+
+/* Append the packets wanted by any listener to the shared chunk. Listeners waiting for a random access point
+ * get packets from the first one on. */
+void dvb_reader_write_packets(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot,
+                              const uint8_t *packets, size_t count)
+{
+    const uint8_t *packet;
+    struct DVBPidEntry *entry;
+    guint32 mask;
+    size_t i;
+    gboolean rap;
+    gboolean passthrough = snapshot->passthrough && !reader->rap_waiting;
+
+    /* The mode changes with the listeners, a chunk is filled in one mode only. */
+    if (G_UNLIKELY(passthrough != reader->chunk_passthrough)) {
+        dvb_reader_flush_chunk(reader, snapshot);
+        reader->chunk_passthrough = passthrough;
+    }
+    if (passthrough) {
+        dvb_reader_pass_packets(reader, snapshot, packets, count);
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        packet = &packets[i * TS_SIZE];
+        entry = &reader->pid_table[ts_get_pid(packet)];
+        mask = snapshot->type_listeners[entry->type] & snapshot->service_listeners[entry->services];
+        rap = dvb_reader_track_packet(reader, snapshot, entry, packet);
+        if (rap)
+            reader->rap_waiting &= ~mask;
+        /* listeners wanting only the PCR of a stream get just the packets carrying it */
+        if ((entry->type & DVB_FILTER_PCR) && entry->type != DVB_FILTER_PCR &&
+                !(ts_has_adaptation(packet) && ts_get_adaptation(packet) && tsaf_has_pcr(packet)))
+            mask &= snapshot->type_listeners[entry->type & ~DVB_FILTER_PCR];
+        mask &= ~reader->rap_waiting;
+        if (!mask)
+            continue;
+
+        if (!reader->chunk)
+            reader->chunk = dvb_reader_listener_message_new(reader);
+
+        memcpy(&reader->chunk->data[reader->chunk->data_size], packet, TS_SIZE);
+        reader->chunk->data_size += TS_SIZE;
+        if (dvb_reader_packet_marks_rap(reader, entry, packet, rap))
+            reader->chunk->raps |= 1u << reader->chunk_packets;
+        reader->chunk_masks[reader->chunk_packets++] = mask;
+
+        if (reader->chunk_packets == DVB_READER_CHUNK_PACKETS)
+            dvb_reader_flush_chunk(reader, snapshot);
+    }
+}
+
+/* Pass the shared chunk to the listeners. Listeners wanting every packet of it get a reference, the selected
+ * packets are copied only for listeners whose filter differs. Only listeners wanting at least one packet of the
+ * chunk are visited. */
+void dvb_reader_flush_chunk(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot)
+{
+    struct DVBReaderListenerMessage *chunk = reader->chunk;
+    struct DVBReaderListener *listener;
+    guint32 all, wanted = 0;
+    guint32 bit, selection;
+    guint slot, i;
+
+    if (!chunk)
+        return;
+
+    if (reader->chunk_passthrough) {
+        for (wanted = snapshot->slots_used; wanted; wanted &= wanted - 1) {
+            listener = snapshot->slots[__builtin_ctz(wanted)];
+            /* data buffered before the fast path started goes first */
+            if (G_UNLIKELY(listener->buffer_size)) {
+                dvb_reader_listener_send_data(listener, listener->buffer, listener->buffer_size);
+                listener->buffer_size = 0;
+            }
+            g_atomic_int_inc(&chunk->refcount);
+            dvb_reader_listener_queue_message(listener, chunk);
+        }
+        g_atomic_int_add(&reader->shared_chunks, __builtin_popcount(snapshot->slots_used));
+        goto done;
+    }
+
+    all = (1u << reader->chunk_packets) - 1;
+    for (i = 0; i < reader->chunk_packets; ++i)
+        wanted |= reader->chunk_masks[i];
+
+    while (wanted) {
+        slot = __builtin_ctz(wanted);
+        bit = 1u << slot;
+        wanted &= ~bit;
+        listener = snapshot->slots[slot];
+
+        selection = 0;
+        for (i = 0; i < reader->chunk_packets; ++i) {
+            if (reader->chunk_masks[i] & bit)
+                selection |= 1u << i;
+        }
+
+        if (selection == all && listener->buffer_size == 0) {
+            g_atomic_int_inc(&chunk->refcount);
+            dvb_reader_listener_queue_message(listener, chunk);
+            g_atomic_int_inc(&reader->shared_chunks);
+            continue;
+        }
+
+        g_atomic_int_add(&reader->copied_packets, __builtin_popcount(selection));
+        for (; selection; selection &= selection - 1) {
+            i = __builtin_ctz(selection);
+            dvb_reader_listener_push_packet(listener, &chunk->data[i * TS_SIZE], (chunk->raps >> i) & 1);
+        }
     }
 
 done:
-    return dvb_reader_write_packet(reader, packet);
+    dvb_reader_listener_message_free(chunk, reader);
+    reader->chunk = NULL;
+    reader->chunk_packets = 0;
+}
+
+/* Reset the listeners that were (re)set since the last batch and send them the current tables. */
+static void dvb_reader_reset_listeners(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot)
+{
+    struct DVBReaderListener *listener;
+    guint32 reset = (guint32)g_atomic_int_and(&reader->listener_reset, 0) & snapshot->slots_used;
+
+    for (; reset; reset &= reset - 1) {
+        listener = snapshot->slots[__builtin_ctz(reset)];
+        listener->buffer_size = 0;
+        listener->have_pat = 0;
+        listener->have_pmt = 0;
+        reader->rap_waiting &= ~(1u << listener->slot);
+        if (listener->start_at_rap) {
+            dvb_reader_listener_drop_data(listener);
+            dvb_reader_listener_wait_for_rap(reader, listener, snapshot->slot_service[listener->slot]);
+        }
+        dvb_reader_listener_send_pat(reader, listener);
+        dvb_reader_listener_send_pmt(reader, listener);
+        /* Start right away with the current GOP if it is cached. */
+        if ((reader->rap_waiting & (1u << listener->slot)) && dvb_reader_listener_replay_gop(reader, listener))
+            reader->rap_waiting &= ~(1u << listener->slot);
+    }
+}
+
+/* Whether the PMT of a service is known and lists no video, so there is no random access point to wait for. */
+static gboolean dvb_reader_service_lacks_video(DVBReader *reader, guint8 index)
+{
+    struct DVBReaderService *service;
+
+    if (index == 0)
+        return reader->dvbpsi_have_pmt && !reader->have_video;
+    if (index >= DVB_READER_MAX_SERVICES || !(service = reader->services[index]))
+        return FALSE;
+    return service->have_pmt && !(reader->video_services & (1u << index));
+}
+
+/* Hold back the packets of a listener starting at a random access point until the next one. Call from the data
+ * thread, or while it is not running. */
+void dvb_reader_listener_wait_for_rap(DVBReader *reader, struct DVBReaderListener *listener, guint8 service)
+{
+    if (!listener->start_at_rap || !(listener->filter & DVB_FILTER_VIDEO))
+        return;
+    if (dvb_reader_service_lacks_video(reader, service))
+        return;
+    reader->rap_waiting |= 1u << listener->slot;
+    listener->rap_wait_since = 0;
+}
+
+/* Stop waiting for a random access point after a while, e.g. if the stream marks none we recognise. */
+static void dvb_reader_expire_rap_waiting(DVBReader *reader, struct DVBReaderListenerSnapshot *snapshot)
+{
+    struct DVBReaderListener *listener;
+    guint32 waiting;
+
+    for (waiting = reader->rap_waiting & snapshot->slots_used; waiting; waiting &= waiting - 1) {
+        listener = snapshot->slots[__builtin_ctz(waiting)];
+        if (!listener->rap_wait_since) {
+            listener->rap_wait_since = reader->read_time;
+        }
+        else if (reader->read_time - listener->rap_wait_since >= DVB_READER_RAP_TIMEOUT) {
+            LOG(reader->logger, "No random access point for listener %d (%p), starting anyway\n",
+                listener->fd, listener->callback);
+            reader->rap_waiting &= ~(1u << listener->slot);
+        }
+    }
+}
+
+/* Handle a run of packets. Tables are decoded for the whole batch first, so a new PAT/PMT is already sent to
+ * the listeners before the packets following it. */
+gboolean dvb_reader_handle_packets(const uint8_t *packets, size_t count, void *userdata)
+{
+    DVBReader *reader = (DVBReader *)userdata;
+    const uint8_t *packet;
+    struct DVBPidEntry *entry;
+    size_t i, n;
+
+    while (count) {
+        n = MIN(count, DVB_READER_PACKET_BATCH);
+
+        for (i = 0; i < n; ++i) {
+            packet = &packets[i * TS_SIZE];
+            entry = &reader->pid_table[ts_get_pid(packet)];
+            if (G_UNLIKELY(entry->psi_table != N_TS_TABLE_TYPES) && reader->dvbpsi_handles[entry->psi_table])
+                dvbpsi_packet_push(reader->dvbpsi_handles[entry->psi_table], (uint8_t *)packet);
+            if (G_UNLIKELY(entry->service_pmt))
+                dvb_reader_push_service_pmt(reader, entry->service_pmt, packet);
+        }
+
+        dvb_reader_write_packets(reader, reader->active_snapshot, packets, n);
+
+        packets += n * TS_SIZE;
+        count -= n;
+    }
+
+    return TRUE;
+}
+
+/* Process a buffer read from the tuner. The listener snapshot is picked up once per buffer; listener changes
+ * never block this thread. The shared chunk is passed on at the end, so it never outlives the snapshot. */
+void dvb_reader_process_buffer(DVBReader *reader, TsReader *ts_reader, const uint8_t *buffer, size_t size)
+{
+    reader->active_snapshot = dvb_reader_acquire_listener_snapshot(reader);
+    reader->read_time = g_get_monotonic_time();
+
+    if (G_UNLIKELY(g_atomic_int_get(&reader->service_changes)))
+        dvb_reader_update_services(reader);
+    if (G_UNLIKELY(g_atomic_int_get(&reader->listener_reset)))
+        dvb_reader_reset_listeners(reader, reader->active_snapshot);
+    if (G_UNLIKELY(reader->rap_waiting))
+        dvb_reader_expire_rap_waiting(reader, reader->active_snapshot);
+
+    ts_reader_push_buffer(ts_reader, buffer, size);
+
+    dvb_reader_flush_chunk(reader, reader->active_snapshot);
+    dvb_reader_flush_listener_buffers(reader, reader->active_snapshot);
+
+    reader->active_snapshot = NULL;
+    dvb_reader_release_listener_snapshot(reader);
+}
+
+void dvb_reader_get_statistics(DVBReader *reader, DVBReaderStatistics *stats)
+{
+    g_return_if_fail(reader != NULL);
+    g_return_if_fail(stats != NULL);
+
+    stats->message_pool_size = DVB_READER_MESSAGE_POOL_SIZE;
+    stats->message_pool_exhausted = g_atomic_int_get(&reader->message_pool_exhausted);
+    stats->shared_chunks = g_atomic_int_get(&reader->shared_chunks);
+    stats->copied_packets = g_atomic_int_get(&reader->copied_packets);
+    stats->spliced_chunks = g_atomic_int_get(&reader->spliced_chunks);
+    stats->random_access_points = g_atomic_int_get(&reader->random_access_points);
+    stats->gop_cache_size = (gsize)g_atomic_pointer_get(&reader->gop_cache_size);
+    stats->gop_cache_capacity = (gsize)g_atomic_pointer_get(&reader->gop_cache_capacity);
+    stats->gop_cache_overflows = g_atomic_int_get(&reader->gop_cache_overflows);
+    stats->gop_cache_replays = g_atomic_int_get(&reader->gop_cache_replays);
+    stats->passthrough_bytes = (gsize)g_atomic_pointer_get(&reader->passthrough_bytes);
+}
+
+gboolean dvb_reader_get_listener_statistics(DVBReader *reader, int fd, DVBReaderListenerCallback callback,
+                                            gpointer userdata, DVBReaderListenerStatistics *stats)
+{
+    g_return_val_if_fail(reader != NULL, FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    g_mutex_lock(&reader->listener_mutex);
+
+    GList *element = dvb_reader_find_listener(reader, fd, callback, userdata);
+
+    if (element) {
+        struct DVBReaderListener *listener = (struct DVBReaderListener *)element->data;
+        stats->write_bytes = (gsize)g_atomic_pointer_get(&listener->write_bytes);
+        stats->write_calls = (gsize)g_atomic_pointer_get(&listener->write_calls);
+        stats->bytes_per_call = stats->write_calls ? stats->write_bytes / stats->write_calls : 0;
+        stats->queued = g_atomic_int_get(&listener->pushed) - g_atomic_int_get(&listener->popped);
+        stats->dropped = g_atomic_int_get(&listener->dropped);
+    }
+
+    g_mutex_unlock(&reader->listener_mutex);
+
+    return element != NULL;
 }
 
 float dvb_reader_query_signal_strength(DVBReader *reader)
@@ -6,6 +6,7 @@
 #include "streaminfo.h"
 #include "filter.h"
 #include "logging.h"
+#include "timeshift.h"
 
 typedef struct _DVBReader DVBReader;
 
@@ -21,13 +22,80 @@ void dvb_reader_set_logger(DVBReader *reader, DVBRecorderLogger *logger);
 /* data, size, userdata */
 typedef void (*DVBReaderListenerCallback)(const guint8 *, gsize, gpointer);
 
+/* What to do with new data if a listener has high_water chunks queued. */
+typedef enum {
+    DVB_READER_OVERFLOW_DROP_NEWEST = 0,  /* drop new data until the queue is down to low_water */
+    DVB_READER_OVERFLOW_DROP_OLDEST,      /* drop queued data, keeping the newest low_water chunks */
+    DVB_READER_OVERFLOW_DROP_UNTIL_RAP    /* like DROP_NEWEST, but resume at a random access point */
+} DVBReaderOverflowPolicy;
+/* The data thread never waits for a listener, there is no blocking policy. Listeners that must not lose data, like
+ * recordings, can only set a large high_water; dropped data is reported with DVB_LISTENER_STATUS_OVERFLOW. */
+
+/* Thread passing a listener's data to its fd and callback. */
+typedef enum {
+    DVB_READER_DISPATCH_DEFAULT = 0,  /* DEDICATED for listeners with a callback, SHARED otherwise */
+    DVB_READER_DISPATCH_SHARED,       /* one of the reader's writer threads, see dvb_reader_set_writer_threads() */
+    DVB_READER_DISPATCH_DEDICATED     /* a thread of its own, for callbacks that may block */
+} DVBReaderDispatch;
+
+/* How data gets into a listener's fd. */
+typedef enum {
+    DVB_READER_OUTPUT_WRITE = 0,
+    DVB_READER_OUTPUT_VMSPLICE        /* pipes only: map the chunks into the pipe instead of copying them */
+} DVBReaderOutputMode;
+
+typedef struct {
+    DVBReaderOverflowPolicy overflow_policy;
+    guint high_water;    /* queued chunks, 0 for the default */
+    guint low_water;     /* 0 for half of high_water */
+    gsize chunk_size;    /* bytes per write or callback, rounded down to whole packets; 0 for the default */
+    guint max_latency;   /* ms until buffered data is passed on anyway, 0 for the default */
+    /* After starting, resuming or a channel change pass on PAT, PMT and then the data from the next video
+     * keyframe on, so a decoder can start right away. */
+    gboolean start_at_rap;
+    /* Service to pass on, 0 for the tuned one. Others must be added with dvb_reader_add_service(). */
+    guint16 program_number;
+    /* only used when the listener is added */
+    DVBReaderDispatch dispatch;
+    DVBReaderOutputMode output_mode;  /* falls back to WRITE if the fd is no pipe or vmsplice fails */
+} DVBReaderListenerOptions;
+
+/* options may be NULL for the defaults. The fd is switched to non-blocking mode. */
 void dvb_reader_set_listener(DVBReader *reader, DVBFilterType filter, int fd,
-                             DVBReaderListenerCallback callback, gpointer userdata);
-void dvb_reader_listener_set_running(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gboolean do_run);
-void dvb_reader_remove_listener(DVBReader *reader, int fd, DVBReaderListenerCallback callback);
+                             DVBReaderListenerCallback callback, gpointer userdata,
+                             const DVBReaderListenerOptions *options);
+/* Listeners without fd (-1) are identified by callback and userdata. */
+void dvb_reader_listener_set_running(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gpointer userdata,
+                                     gboolean do_run);
+void dvb_reader_remove_listener(DVBReader *reader, int fd, DVBReaderListenerCallback callback, gpointer userdata);
+/* Memory for the packets since the last keyframe, which listeners with start_at_rap get right away. Default 4 MB,
+ * 0 disables the cache. Applies from the next keyframe on. */
+void dvb_reader_set_gop_cache_size(DVBReader *reader, gsize size);
+/* Keep the last size bytes of the service in a time-shift ring, 0 (the default) drops it. Returns FALSE if the
+ * ring cannot be created; the previous one is kept then. */
+gboolean dvb_reader_set_timeshift_size(DVBReader *reader, gsize size);
+/* A reference to the current ring, NULL if there is none. */
+DVBTimeshift *dvb_reader_get_timeshift(DVBReader *reader);
+/* Number of threads shared by the listeners, default 2. Applies to listeners added afterwards. */
+void dvb_reader_set_writer_threads(DVBReader *reader, guint count);
+
+/* Demultiplex another service of the tuned transponder along with the tuned one, without retuning. Its listeners
+ * get a PAT listing only this program and its PMT. Services are kept across channel changes until removed; one
+ * not on the current transponder passes nothing. Returns FALSE if seven are added already. */
+gboolean dvb_reader_add_service(DVBReader *reader, guint16 program_number);
+void dvb_reader_remove_service(DVBReader *reader, guint16 program_number);
 
 gboolean dvb_reader_get_current_pat_packets(DVBReader *reader, guint8 **buffer, gsize *length);
 gboolean dvb_reader_get_current_pmt_packets(DVBReader *reader, guint8 **buffer, gsize *length);
+/* The rewritten tables of an added service, or of the tuned one for program_number 0. */
+gboolean dvb_reader_get_service_pat_packets(DVBReader *reader, guint16 program_number, guint8 **buffer, gsize *length);
+/* The PMT lists only the elementary streams of the types in filter, like the one sent to listeners with it. */
+gboolean dvb_reader_get_service_pmt_packets(DVBReader *reader, guint16 program_number, DVBFilterType filter,
+                                            guint8 **buffer, gsize *length);
+/* Whether a decoder can start at this packet: a keyframe of the service's video, or, for services without
+ * video, the start of an audio frame. Only valid from a listener callback, for a packet of the data passed to
+ * it; the data thread marked the packet when it was read. FALSE for any other packet. */
+gboolean dvb_reader_packet_is_random_access_point(DVBReader *reader, const guint8 *packet);
 
 DVBStreamInfo *dvb_reader_get_stream_info(DVBReader *reader);
 
@@ -51,3 +119,31 @@ EPGEvent *dvb_reader_get_event(DVBReader *reader, guint16 eventid); /* [no trans
 
 float dvb_reader_query_signal_strength(DVBReader *reader);
 
+typedef struct {
+    guint message_pool_size;         /* number of pooled listener messages */
+    guint message_pool_exhausted;    /* messages allocated because the pool was empty */
+    guint shared_chunks;             /* chunks passed to a listener by reference */
+    guint copied_packets;            /* packets copied for listeners wanting only part of a chunk */
+    guint spliced_chunks;            /* chunks mapped into pipes instead of copied */
+    guint random_access_points;      /* keyframes seen on video pids */
+    gsize gop_cache_size;            /* bytes of the current GOP cached */
+    gsize gop_cache_capacity;        /* bytes allocated for the GOP cache */
+    guint gop_cache_overflows;       /* GOPs too large for the cache */
+    guint gop_cache_replays;         /* listeners started with the cached GOP */
+    guint64 passthrough_bytes;       /* passed on by the fast path taken while all listeners want everything */
+} DVBReaderStatistics;
+
+void dvb_reader_get_statistics(DVBReader *reader, DVBReaderStatistics *stats);
+
+typedef struct {
+    guint64 write_bytes;             /* bytes passed to the fd */
+    guint64 write_calls;             /* syscalls writing them; queued chunks are gathered into one call */
+    guint64 bytes_per_call;
+    guint queued;                    /* chunks waiting to be written */
+    guint dropped;                   /* chunks dropped by the overflow policy */
+} DVBReaderListenerStatistics;
+
+/* Returns FALSE if there is no such listener. */
+gboolean dvb_reader_get_listener_statistics(DVBReader *reader, int fd, DVBReaderListenerCallback callback,
+                                            gpointer userdata, DVBReaderListenerStatistics *stats);
+
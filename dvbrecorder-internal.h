@@ -3,6 +3,35 @@
 #include "dvbrecorder.h"
 #include "scheduled.h"
 #include "dvbreader.h"
+#include "record-writer.h"
+#include "record-index-internal.h"
+
+#define DVB_RECORDER_MAX_RECORDINGS 8
+
+/* A recording of one service. It is the userdata of its record listener and stays in place after it stopped, so
+ * data still queued for the listener finds it. Everything but the status belongs to the record callback while the
+ * recording runs. */
+typedef struct {
+    DVBRecorder *recorder;
+    guint16 program_number;       /* 0 for the tuned service */
+    DVBFilterType filter;         /* the segments start with a PMT listing just these streams */
+
+    DVBRecordStatus status;
+    time_t start;
+    time_t end;                   /* keep data if stream was stopped, for last info */
+    gsize size;
+    guint dropped;                /* chunks lost while the disk fell behind, atomic */
+
+    RecordWriter *writer;         /* set and cleared under writer_lock, read by the statistics */
+    GMutex writer_lock;
+    DVBRecordIndexWriter *index;
+    gchar *filename;
+
+    guint segment;                /* number of the current segment from 1 on, 0 if not segmented */
+    guint64 segment_bytes;
+    gint64 segment_start;
+    gint64 segment_due;           /* when a limit was reached, 0 before */
+} DVBRecording;
 
 struct _DVBRecorder {
     DVBRecorderEventCallback event_cb;
@@ -18,16 +47,19 @@ struct _DVBRecorder {
 
     guint64 current_channel_id;
 
-    int record_fd;
-    gchar *record_filename;
+    RecordWriterOptions record_writer_options;
+    gboolean record_index_enabled;
     gchar *record_filename_pattern;
     gchar *capture_dir;
-    DVBRecordStatus record_status;
-    time_t record_start;
-    time_t record_end;             /* keep data if stream was stopped, for last info */
-    gsize record_size;
     DVBFilterType record_filter;
 
+    /* Limits of segmented recordings, set by the user, 0 for none. */
+    guint record_segment_duration;    /* seconds */
+    guint64 record_segment_size;      /* bytes */
+
+    /* The recording of the tuned service first, then those of other services on the transponder. */
+    DVBRecording recordings[DVB_RECORDER_MAX_RECORDINGS];
+
     guint scheduled_recordings_enabled : 1;
 
     GList *timed_events;
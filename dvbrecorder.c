@@ -17,6 +17,15 @@
 #include "dvbrecorder-internal.h"
 #include "timed-events.h"
 
+/* Cut a segment anyway if no random access point follows the limit within this time. */
+#define DVB_RECORDER_SEGMENT_RAP_TIMEOUT (5 * G_TIME_SPAN_SECOND)
+
+static gchar *dvb_recorder_build_filename(DVBRecorder *recorder, const gchar *dir, const gchar *pattern, guint segment,
+                                          guint16 program_number);
+static void dvb_recorder_recording_stop(DVBRecording *recording);
+static void dvb_recorder_stop_service_recordings(DVBRecorder *recorder);
+void dvb_recorder_record_callback(const guint8 *data, gsize size, DVBRecording *recording);
+
 void dvb_recorder_event_callback(DVBRecorderEvent *event, gpointer userdata)
 {
     FLOG("\n");
@@ -46,7 +55,8 @@ void dvb_recorder_event_callback(DVBRecorderEvent *event, gpointer userdata)
                 else if (ev->status == DVB_LISTENER_STATUS_TERMINATED) {
                     LOG(&recorder->logger, "listener terminated, remove it\n");
                     dvb_reader_remove_listener(recorder->reader, ev->fd_valid ? ev->listener_fd : -1,
-                                                                 ev->cb_valid ? ev->listener_cb : NULL);
+                                                                 ev->cb_valid ? ev->listener_cb : NULL,
+                                                                 ev->cb_valid ? ev->listener_data : NULL);
                 }
                 else if (ev->status == DVB_LISTENER_STATUS_WRITE_ERROR) {
                     if (ev->fd_valid && ev->listener_fd == recorder->video_pipe[1] && recorder->video_source_enabled) {
@@ -56,6 +66,20 @@ void dvb_recorder_event_callback(DVBRecorderEvent *event, gpointer userdata)
                                 NULL, NULL);
                     }
                 }
+                else if (ev->status == DVB_LISTENER_STATUS_OVERFLOW) {
+                    LOG(&recorder->logger, "listener overflow, %u chunks dropped\n", ev->dropped);
+                    recorder->event_cb(event, recorder->event_data);
+                    /* the recording has a gap now */
+                    if (ev->cb_valid && ev->listener_cb == (gpointer)dvb_recorder_record_callback) {
+                        DVBRecording *recording = (DVBRecording *)ev->listener_data;
+                        g_atomic_int_set(&recording->dropped, ev->dropped);
+                        dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_DATA_LOST,
+                                recorder->event_cb, recorder->event_data,
+                                "program-number", GUINT_TO_POINTER(recording->program_number),
+                                "dropped", GUINT_TO_POINTER(ev->dropped),
+                                NULL, NULL);
+                    }
+                }
             }
             break;
         default:
@@ -73,12 +97,18 @@ DVBRecorder *dvb_recorder_new(DVBRecorderEventCallback cb, gpointer userdata)
 
     recorder->video_pipe[0] = -1;
     recorder->video_pipe[1] = -1;
-    recorder->record_fd = -1;
 
     recorder->capture_dir = g_strdup(g_get_home_dir());
     recorder->record_filename_pattern = g_strdup("capture-${date:%Y%m%d-%H%M%S}.ts");
 
     recorder->record_filter = DVB_FILTER_ALL;
+    recorder->record_index_enabled = TRUE;
+
+    guint i;
+    for (i = 0; i < DVB_RECORDER_MAX_RECORDINGS; ++i) {
+        recorder->recordings[i].recorder = recorder;
+        g_mutex_init(&recorder->recordings[i].writer_lock);
+    }
 
     recorder->reader = dvb_reader_new(dvb_recorder_event_callback, recorder);
     if (!recorder->reader)
@@ -106,12 +136,19 @@ void dvb_recorder_destroy(DVBRecorder *recorder)
 
     if (recorder->video_pipe[0] >= 0)
         close(recorder->video_pipe[0]);
-    g_free(recorder->record_filename);
+    dvb_recorder_stop_service_recordings(recorder);
+
+    guint i;
+    for (i = 0; i < DVB_RECORDER_MAX_RECORDINGS; ++i)
+        g_free(recorder->recordings[i].filename);
     g_free(recorder->capture_dir);
     g_free(recorder->record_filename_pattern);
 
     dvb_reader_destroy(recorder->reader);
 
+    for (i = 0; i < DVB_RECORDER_MAX_RECORDINGS; ++i)
+        g_mutex_clear(&recorder->recordings[i].writer_lock);
+
     dvb_recorder_timed_events_clear(recorder);
 
     g_free(recorder);
@@ -140,10 +177,17 @@ int dvb_recorder_enable_video_source(DVBRecorder *recorder, gboolean enable)
         LOG(&recorder->logger, "video_pipe: %d/%d, reader: %p\n", recorder->video_pipe[0], recorder->video_pipe[1], recorder->reader);
 /*        fcntl(recorder->video_pipe[1], F_SETFL, O_NONBLOCK);*/
         /* for decoding (gstreamer) pat and pmt are necessary */
+        /* live view: rather skip ahead than fall behind, and let the decoder resume at a random access point */
+        DVBReaderListenerOptions options = {
+            .overflow_policy = DVB_READER_OVERFLOW_DROP_UNTIL_RAP,
+            .max_latency = 40,
+            .output_mode = DVB_READER_OUTPUT_VMSPLICE,
+            .start_at_rap = TRUE,
+        };
         dvb_reader_set_listener(recorder->reader,
                 DVB_FILTER_VIDEO | DVB_FILTER_AUDIO | DVB_FILTER_TELETEXT |
                 DVB_FILTER_SUBTITLES | DVB_FILTER_PAT | DVB_FILTER_PMT | DVB_FILTER_PCR/* | DVB_FILTER_UNKNOWN*/,
-                recorder->video_pipe[1], NULL, NULL);
+                recorder->video_pipe[1], NULL, NULL, &options);
 
         LOG(&recorder->logger, "video_pipe: %d\n", recorder->video_pipe[0]);
         return recorder->video_pipe[0];
@@ -151,7 +195,7 @@ int dvb_recorder_enable_video_source(DVBRecorder *recorder, gboolean enable)
     else {
         LOG(&recorder->logger, "enable_video_source: FALSE\n");
         if (recorder->video_pipe[1] >= 0) {
-            dvb_reader_remove_listener(recorder->reader, recorder->video_pipe[1], NULL);
+            dvb_reader_remove_listener(recorder->reader, recorder->video_pipe[1], NULL, NULL);
             close(recorder->video_pipe[1]);
         }
         if (recorder->video_pipe[0] >= 0) {
@@ -169,7 +213,7 @@ void dvb_recorder_video_source_run(DVBRecorder *recorder)
 {
     g_return_if_fail(recorder != NULL);
 
-    dvb_reader_listener_set_running(recorder->reader, recorder->video_pipe[1], NULL, TRUE);
+    dvb_reader_listener_set_running(recorder->reader, recorder->video_pipe[1], NULL, NULL, TRUE);
 }
 
 GList *dvb_recorder_get_channel_list(DVBRecorder *recorder)
@@ -194,8 +238,9 @@ gboolean dvb_recorder_set_channel(DVBRecorder *recorder, guint64 channel_id)
 
     if (chdata) {
         /* stop running recording first */
-        if (recorder->record_status == DVB_RECORD_STATUS_RECORDING)
+        if (recorder->recordings[0].status == DVB_RECORD_STATUS_RECORDING)
             dvb_recorder_record_stop(recorder);
+        dvb_recorder_stop_service_recordings(recorder);
 
         LOG(&recorder->logger, "dvbrecorder.c: dvb_reader_tune: chdata->polarization: %d\n", chdata->polarization);
         dvb_reader_tune(recorder->reader,
@@ -235,35 +280,208 @@ void dvb_recorder_stop(DVBRecorder *recorder)
     FLOG("\n");
     g_return_if_fail(recorder != NULL);
 
-    if (recorder->record_status == DVB_RECORD_STATUS_RECORDING)
+    if (recorder->recordings[0].status == DVB_RECORD_STATUS_RECORDING)
         dvb_recorder_record_stop(recorder);
+    dvb_recorder_stop_service_recordings(recorder);
 
     dvb_reader_stop(recorder->reader);
 }
 
-void dvb_recorder_record_callback(const guint8 *data, gsize size, DVBRecorder *recorder)
+static gboolean dvb_recorder_record_write(DVBRecording *recording, const guint8 *data, gsize size)
+{
+    dvb_record_index_writer_push(recording->index, data, size, record_writer_get_size(recording->writer));
+
+    if (!record_writer_write(recording->writer, data, size)) {
+        LOG(&recording->recorder->logger, "Could not write. Stop recording.\n");
+        return FALSE;
+    }
+
+    recording->size += size;
+    recording->segment_bytes += size;
+
+    return TRUE;
+}
+
+/* pattern with placeholder inserted before the extension, or appended */
+static gchar *dvb_recorder_pattern_insert(const gchar *pattern, const gchar *placeholder)
+{
+    const gchar *dot = strrchr(pattern, '.');
+
+    if (strstr(pattern, placeholder))
+        return g_strdup(pattern);
+    else if (!dot || strchr(dot, '/') || strchr(dot, '}'))
+        return g_strconcat(pattern, "-", placeholder, NULL);
+    else
+        return g_strdup_printf("%.*s-%s%s", (int)(dot - pattern), pattern, placeholder, dot);
+}
+
+/* Name of the current recording file. Segments always get a number and recordings of other services the program
+ * number; ${segment} and ${program_number} are inserted before the extension if the pattern lacks them. */
+static gchar *dvb_recorder_make_segment_filename(DVBRecording *recording)
+{
+    DVBRecorder *recorder = recording->recorder;
+    gchar *pattern = g_strdup(recorder->record_filename_pattern);
+    gchar *tmp, *result;
+
+    if (recording->program_number) {
+        tmp = dvb_recorder_pattern_insert(pattern, "${program_number}");
+        g_free(pattern);
+        pattern = tmp;
+    }
+    if (recording->segment) {
+        tmp = dvb_recorder_pattern_insert(pattern, "${segment}");
+        g_free(pattern);
+        pattern = tmp;
+    }
+
+    result = dvb_recorder_build_filename(recorder, recorder->capture_dir, pattern, recording->segment,
+                                         recording->program_number);
+    g_free(pattern);
+
+    return result;
+}
+
+/* Open the recording's filename and its index. */
+static gboolean dvb_recorder_record_open_file(DVBRecording *recording)
+{
+    DVBRecorder *recorder = recording->recorder;
+    RecordWriter *writer;
+    gchar *index_filename;
+
+    writer = record_writer_open(recording->filename, &recorder->record_writer_options, &recorder->logger);
+    if (!writer)
+        return FALSE;
+
+    g_mutex_lock(&recording->writer_lock);
+    recording->writer = writer;
+    g_mutex_unlock(&recording->writer_lock);
+
+    /* the recording goes on without an index if it cannot be written */
+    if (recorder->record_index_enabled) {
+        index_filename = dvb_record_index_filename(recording->filename);
+        recording->index = dvb_record_index_writer_new(index_filename, recorder->reader, &recorder->logger);
+        g_free(index_filename);
+    }
+
+    return TRUE;
+}
+
+static void dvb_recorder_record_close_file(DVBRecording *recording)
+{
+    DVBRecorder *recorder = recording->recorder;
+    RecordWriter *writer = recording->writer;
+
+    if (recording->index) {
+        if (!dvb_record_index_writer_free(recording->index))
+            LOG(&recorder->logger, "Index of %s may be incomplete\n", recording->filename);
+        recording->index = NULL;
+    }
+
+    if (!writer)
+        return;
+
+    g_mutex_lock(&recording->writer_lock);
+    recording->writer = NULL;
+    g_mutex_unlock(&recording->writer_lock);
+
+    if (!record_writer_close(writer))
+        LOG(&recorder->logger, "Recording %s may be incomplete\n", recording->filename);
+
+    if (recording->segment)
+        dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_SEGMENT_FINISHED,
+                recorder->event_cb, recorder->event_data,
+                "filename", recording->filename,
+                "segment", GUINT_TO_POINTER(recording->segment),
+                NULL, NULL);
+}
+
+/* Whether the current segment ends before packet: a limit was reached and the packet is a random access point,
+ * or none followed for a while. */
+static gboolean dvb_recorder_record_segment_cut(DVBRecording *recording, const guint8 *packet, guint64 bytes,
+                                                gint64 now)
+{
+    DVBRecorder *recorder = recording->recorder;
+
+    if (!recording->segment_due) {
+        if ((recorder->record_segment_size && bytes >= recorder->record_segment_size) ||
+                (recorder->record_segment_duration &&
+                 now - recording->segment_start >= recorder->record_segment_duration * G_TIME_SPAN_SECOND))
+            recording->segment_due = now;
+        else
+            return FALSE;
+    }
+
+    if (dvb_reader_packet_is_random_access_point(recorder->reader, packet))
+        return TRUE;
+
+    return now - recording->segment_due >= DVB_RECORDER_SEGMENT_RAP_TIMEOUT;
+}
+
+/* Close the current segment and continue in the next one, starting with the current PAT and PMT. */
+static gboolean dvb_recorder_record_next_segment(DVBRecording *recording, gint64 now)
+{
+    DVBRecorder *recorder = recording->recorder;
+    guint8 *tables;
+    gsize length;
+    gboolean ok = TRUE;
+
+    dvb_recorder_record_close_file(recording);
+
+    ++recording->segment;
+    g_free(recording->filename);
+    recording->filename = dvb_recorder_make_segment_filename(recording);
+    LOG(&recorder->logger, "next segment: %s\n", recording->filename);
+
+    if (!dvb_recorder_record_open_file(recording))
+        return FALSE;
+
+    recording->segment_bytes = 0;
+    recording->segment_start = now;
+    recording->segment_due = 0;
+
+    if (dvb_reader_get_service_pat_packets(recorder->reader, recording->program_number, &tables, &length)) {
+        ok = dvb_recorder_record_write(recording, tables, length);
+        g_free(tables);
+    }
+    if (ok && dvb_reader_get_service_pmt_packets(recorder->reader, recording->program_number,
+                                                    recording->filter, &tables, &length)) {
+        ok = dvb_recorder_record_write(recording, tables, length);
+        g_free(tables);
+    }
+
+    return ok;
+}
+
+void dvb_recorder_record_callback(const guint8 *data, gsize size, DVBRecording *recording)
 {
     FLOG("\n");
-    ssize_t nw, offset;
-    for (offset = 0; offset < size; offset += nw) {
-        if ((nw = write(recorder->record_fd, data + offset, (size_t)(size - offset))) <= 0) {
-            if (nw < 0) {
-                LOG(&recorder->logger, "Could not write. Stop recording: %d (%s)\n", errno, strerror(errno));
-                goto err;
-            }
-            else if (nw == 0) {
-                LOG(&recorder->logger, "Written zero bytes. Trying again.\n");
+    gsize offset, start = 0;
+    gint64 now;
+
+    /* the listener may still deliver queued data after an error stopped the recording */
+    if (!recording->writer)
+        return;
+
+    /* Split at packet boundaries, every packet goes to exactly one segment. */
+    if (recording->segment) {
+        now = g_get_monotonic_time();
+        for (offset = 0; offset + TS_SIZE <= size; offset += TS_SIZE) {
+            if (!dvb_recorder_record_segment_cut(recording, &data[offset],
+                        recording->segment_bytes + (offset - start), now))
                 continue;
-            }
-            break;
+            if (!dvb_recorder_record_write(recording, &data[start], offset - start) ||
+                    !dvb_recorder_record_next_segment(recording, now))
+                goto err;
+            start = offset;
         }
     }
 
-    recorder->record_size += size;
+    if (!dvb_recorder_record_write(recording, &data[start], size - start))
+        goto err;
 
     return;
 err:
-    dvb_recorder_record_stop(recorder);
+    dvb_recorder_recording_stop(recording);
 }
 
 void dvb_recorder_set_record_filename_pattern(DVBRecorder *recorder, const gchar *pattern)
@@ -292,6 +510,8 @@ void dvb_recorder_set_capture_dir(DVBRecorder *recorder, const gchar *capture_di
 struct _pattern_match_info {
     DVBStreamInfo *stream_info;
     struct tm *local_time;
+    guint segment;
+    guint16 program_number;
 };
 
 static gboolean dvb_recorder_filename_pattern_eval(const GMatchInfo *matchinfo, GString *res, struct _pattern_match_info *info)
@@ -326,6 +546,14 @@ static gboolean dvb_recorder_filename_pattern_eval(const GMatchInfo *matchinfo,
         }
         fprintf(stderr, "matched program_name\n");
     }
+    else if (g_strcmp0(match, "${segment}") == 0) {
+        if (info->segment)
+            g_string_append_printf(res, "%03u", info->segment);
+    }
+    else if (g_strcmp0(match, "${program_number}") == 0) {
+        if (info->program_number)
+            g_string_append_printf(res, "%u", info->program_number);
+    }
     else if (g_str_has_prefix(match, "${date:")) {
         fprintf(stderr, "matched date\n");
         match[strlen(match) - 1] = 0;
@@ -347,17 +575,30 @@ static gboolean dvb_recorder_filename_pattern_eval(const GMatchInfo *matchinfo,
 gchar *dvb_recorder_make_record_filename(DVBRecorder *recorder, const gchar *alternate_dir, const gchar *alternate_pattern)
 {
     FLOG("\n");
+    return dvb_recorder_build_filename(recorder,
+            alternate_dir ? alternate_dir : recorder->capture_dir,
+            alternate_pattern ? alternate_pattern : recorder->record_filename_pattern,
+            0, 0);
+}
+
+static gchar *dvb_recorder_build_filename(DVBRecorder *recorder, const gchar *dir, const gchar *pattern, guint segment,
+                                          guint16 program_number)
+{
     struct _pattern_match_info info;
-    info.stream_info = dvb_reader_get_stream_info(recorder->reader);
+    /* the stream info describes the tuned service only */
+    info.stream_info = program_number ? NULL : dvb_reader_get_stream_info(recorder->reader);
     time_t t;
     t = time(NULL);
     info.local_time = localtime(&t);
+    info.segment = segment;
+    info.program_number = program_number;
 
         /* in extra function: allow placeholders in (user-defined) filename:
      * %{station_name}, %{station_provider}, %{date:%Y%m%d} */
-    GRegex *regex = g_regex_new("\\${service_name}|\\${service_provider}|\\${program_name}|\\${date:[^}]*}",
+    GRegex *regex = g_regex_new("\\${service_name}|\\${service_provider}|\\${program_name}|\\${date:[^}]*}|\\${segment}|"
+                                "\\${program_number}",
                                 0, 0, NULL);
-    gchar *filename = g_regex_replace_eval(regex, alternate_pattern ? alternate_pattern : recorder->record_filename_pattern,
+    gchar *filename = g_regex_replace_eval(regex, pattern,
                                            -1, 0, 0,
                                            (GRegexEvalCallback)dvb_recorder_filename_pattern_eval, &info, NULL);
 
@@ -365,16 +606,119 @@ gchar *dvb_recorder_make_record_filename(DVBRecorder *recorder, const gchar *alt
 
     g_regex_unref(regex);
 
-    gchar *result = g_build_filename(
-            alternate_dir ? alternate_dir : recorder->capture_dir,
-            filename,
-            NULL);
+    gchar *result = g_build_filename(dir, filename, NULL);
 
     g_free(filename);
 
     return result;
 }
 
+static gboolean dvb_recorder_recording_start(DVBRecording *recording)
+{
+    DVBRecorder *recorder = recording->recorder;
+
+    LOG(&recorder->logger, "make record filename\n");
+
+    recording->segment = recorder->record_segment_duration || recorder->record_segment_size ? 1 : 0;
+    recording->segment_bytes = 0;
+    recording->segment_start = g_get_monotonic_time();
+    recording->segment_due = 0;
+
+    g_free(recording->filename);
+    recording->filename = dvb_recorder_make_segment_filename(recording);
+
+    /* g_path_get_dirname(), g_mkdir_with_parents */
+
+    if (!recording->filename) {
+        LOG(&recorder->logger, "Could not generate filename\n");
+        return FALSE;
+    }
+
+    LOG(&recorder->logger, "open record writer\n");
+
+    if (!dvb_recorder_record_open_file(recording))
+        return FALSE;
+
+    recording->size = 0;
+    g_atomic_int_set(&recording->dropped, 0);
+    time(&recording->start);
+    recording->status = DVB_RECORD_STATUS_RECORDING;
+
+    LOG(&recorder->logger, "set listener to record callback\n");
+    /* The data thread never waits for the disk. Queue up to 128 MB while it stalls and resume right after
+     * dropping; a gap is reported with DVB_RECORDER_EVENT_RECORD_DATA_LOST. The record writer collects the data
+     * into large blocks itself. */
+    DVBReaderListenerOptions options = {
+        .overflow_policy = DVB_READER_OVERFLOW_DROP_NEWEST,
+        .high_water = 32768,
+        .low_water = 32767,
+        .program_number = recording->program_number,
+    };
+    recording->filter = recorder->record_filter;
+    dvb_reader_set_listener(recorder->reader, recording->filter, -1,
+            (DVBReaderListenerCallback)dvb_recorder_record_callback, recording, &options);
+    dvb_reader_listener_set_running(recorder->reader, -1, (DVBReaderListenerCallback)dvb_recorder_record_callback,
+            recording, TRUE);
+
+    LOG(&recorder->logger, "send event about status change\n");
+    dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_STATUS_CHANGED,
+            recorder->event_cb, recorder->event_data,
+            "status", DVB_RECORD_STATUS_RECORDING,
+            "program-number", GUINT_TO_POINTER(recording->program_number),
+            NULL, NULL);
+
+    LOG(&recorder->logger, "finished sending event\n");
+
+    return TRUE;
+}
+
+static void dvb_recorder_recording_stop(DVBRecording *recording)
+{
+    DVBRecorder *recorder = recording->recorder;
+
+    dvb_reader_remove_listener(recorder->reader, -1, (DVBReaderListenerCallback)dvb_recorder_record_callback,
+            recording);
+    LOG(&recorder->logger, "dvb_recorder_record_stop: %u\n", recording->program_number);
+    dvb_recorder_record_close_file(recording);
+    if (recording->program_number)
+        dvb_reader_remove_service(recorder->reader, recording->program_number);
+    recording->status = DVB_RECORD_STATUS_STOPPED;
+    time(&recording->end);
+
+    dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_STATUS_CHANGED,
+            recorder->event_cb, recorder->event_data,
+            "status", DVB_RECORD_STATUS_STOPPED,
+            "program-number", GUINT_TO_POINTER(recording->program_number),
+            NULL, NULL);
+}
+
+/* Recordings of other services belong to the transponder, stop them before tuning elsewhere. */
+static void dvb_recorder_stop_service_recordings(DVBRecorder *recorder)
+{
+    guint i;
+
+    for (i = 1; i < DVB_RECORDER_MAX_RECORDINGS; ++i) {
+        if (recorder->recordings[i].status == DVB_RECORD_STATUS_RECORDING)
+            dvb_recorder_recording_stop(&recorder->recordings[i]);
+    }
+}
+
+/* The recording of program_number, the last one if it stopped; NULL if there was none. */
+static DVBRecording *dvb_recorder_find_recording(DVBRecorder *recorder, guint16 program_number)
+{
+    guint i;
+
+    if (!program_number)
+        return &recorder->recordings[0];
+
+    for (i = 1; i < DVB_RECORDER_MAX_RECORDINGS; ++i) {
+        if (recorder->recordings[i].program_number == program_number)
+            return &recorder->recordings[i];
+    }
+
+    return NULL;
+}
+
 gboolean dvb_recorder_record_start(DVBRecorder *recorder)
 {
     FLOG("\n");
@@ -382,7 +726,7 @@ gboolean dvb_recorder_record_start(DVBRecorder *recorder)
 
     LOG(&recorder->logger, "dvb_recorder_record_start\n");
 
-    if (recorder->record_status == DVB_RECORD_STATUS_RECORDING) {
+    if (recorder->recordings[0].status == DVB_RECORD_STATUS_RECORDING) {
         LOG(&recorder->logger, "Already recording\n");
         return FALSE;
     }
@@ -393,64 +737,89 @@ gboolean dvb_recorder_record_start(DVBRecorder *recorder)
         return FALSE;
     }
 
-    LOG(&recorder->logger, "make record filename\n");
+    return dvb_recorder_recording_start(&recorder->recordings[0]);
+}
+
+void dvb_recorder_record_stop(DVBRecorder *recorder)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
 
-    g_free(recorder->record_filename);
-    recorder->record_filename = dvb_recorder_make_record_filename(recorder, NULL, NULL);
+    dvb_recorder_recording_stop(&recorder->recordings[0]);
+}
 
-    /* g_path_get_dirname(), g_mkdir_with_parents */
+gboolean dvb_recorder_record_service_start(DVBRecorder *recorder, guint16 program_number)
+{
+    FLOG("\n");
+    g_return_val_if_fail(recorder != NULL, FALSE);
+    g_return_val_if_fail(program_number != 0, FALSE);
 
-    if (!recorder->record_filename) {
-        LOG(&recorder->logger, "Could not generate filename\n");
-        return FALSE;
-    }
+    LOG(&recorder->logger, "dvb_recorder_record_service_start: %u\n", program_number);
 
-    LOG(&recorder->logger, "open record fd\n");
+    DVBRecording *recording = dvb_recorder_find_recording(recorder, program_number);
+    DVBRecording *slot = NULL;
+    guint i;
 
-    recorder->record_fd = open(recorder->record_filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (recorder->record_fd == -1) {
-        LOG(&recorder->logger, "Failed to open %s: (%d) %s\n", recorder->record_filename, errno, strerror(errno));
+    if (recording && recording->status == DVB_RECORD_STATUS_RECORDING) {
+        LOG(&recorder->logger, "Already recording\n");
         return FALSE;
     }
 
-    recorder->record_size = 0;
-    time(&recorder->record_start);
-    recorder->record_status = DVB_RECORD_STATUS_RECORDING;
+    if (dvb_reader_get_stream_status(recorder->reader) != DVB_STREAM_STATUS_RUNNING) {
+        LOG(&recorder->logger, "Stream not running.\n");
+        return FALSE;
+    }
 
-    LOG(&recorder->logger, "set listener to record callback\n");
-    dvb_reader_set_listener(recorder->reader, recorder->record_filter, -1,
-            (DVBReaderListenerCallback)dvb_recorder_record_callback, recorder);
-    dvb_reader_listener_set_running(recorder->reader, -1, (DVBReaderListenerCallback)dvb_recorder_record_callback, TRUE);
+    /* reuse the slot of the last recording of the service, or the one that stopped first */
+    for (i = 1; !recording && i < DVB_RECORDER_MAX_RECORDINGS; ++i) {
+        if (recorder->recordings[i].status != DVB_RECORD_STATUS_RECORDING &&
+                (!slot || recorder->recordings[i].end < slot->end))
+            slot = &recorder->recordings[i];
+    }
+    if (!recording)
+        recording = slot;
+    if (!recording) {
+        LOG(&recorder->logger, "Too many recordings\n");
+        return FALSE;
+    }
 
-    LOG(&recorder->logger, "send event about status change\n");
-    dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_STATUS_CHANGED,
-            recorder->event_cb, recorder->event_data,
-            "status", DVB_RECORD_STATUS_RECORDING,
-            NULL, NULL);
+    if (!dvb_reader_add_service(recorder->reader, program_number))
+        return FALSE;
 
-    LOG(&recorder->logger, "finished sending event\n");
+    recording->program_number = program_number;
+    if (!dvb_recorder_recording_start(recording)) {
+        dvb_reader_remove_service(recorder->reader, program_number);
+        return FALSE;
+    }
 
     return TRUE;
 }
 
-void dvb_recorder_record_stop(DVBRecorder *recorder)
+void dvb_recorder_record_service_stop(DVBRecorder *recorder, guint16 program_number)
 {
     FLOG("\n");
     g_return_if_fail(recorder != NULL);
+    g_return_if_fail(program_number != 0);
 
-    dvb_reader_remove_listener(recorder->reader, -1, (DVBReaderListenerCallback)dvb_recorder_record_callback);
-    LOG(&recorder->logger, "dvb_recorder_record_stop, record_fd: %d\n", recorder->record_fd);
-    if (recorder->record_fd >= 0) {
-        close(recorder->record_fd);
-        recorder->record_fd = -1;
-    }
-    recorder->record_status = DVB_RECORD_STATUS_STOPPED;
-    time(&recorder->record_end);
+    DVBRecording *recording = dvb_recorder_find_recording(recorder, program_number);
 
-    dvb_recorder_event_send(DVB_RECORDER_EVENT_RECORD_STATUS_CHANGED,
-            recorder->event_cb, recorder->event_data,
-            "status", DVB_RECORD_STATUS_STOPPED,
-            NULL, NULL);
+    if (recording && recording->status == DVB_RECORD_STATUS_RECORDING)
+        dvb_recorder_recording_stop(recording);
+}
+
+static void dvb_recorder_recording_query_status(DVBRecording *recording, DVBRecorderRecordStatus *status)
+{
+    status->filesize = recording->size;
+    status->status = recording->status;
+    status->dropped = g_atomic_int_get(&recording->dropped);
+
+    time_t end;
+    if (recording->status == DVB_RECORD_STATUS_RECORDING)
+        time(&end);
+    else
+        end = recording->end;
+
+    status->elapsed_time = difftime(end, recording->start);
 }
 
 void dvb_recorder_query_record_status(DVBRecorder *recorder, DVBRecorderRecordStatus *status)
@@ -459,16 +828,22 @@ void dvb_recorder_query_record_status(DVBRecorder *recorder, DVBRecorderRecordSt
     g_return_if_fail(recorder != NULL);
     g_return_if_fail(status != NULL);
 
-    status->filesize = recorder->record_size;
-    status->status = recorder->record_status;
+    dvb_recorder_recording_query_status(&recorder->recordings[0], status);
+}
 
-    time_t end;
-    if (recorder->record_status == DVB_RECORD_STATUS_RECORDING)
-        time(&end);
-    else
-        end = recorder->record_end;
+gboolean dvb_recorder_query_service_record_status(DVBRecorder *recorder, guint16 program_number,
+                                                  DVBRecorderRecordStatus *status)
+{
+    FLOG("\n");
+    g_return_val_if_fail(recorder != NULL, FALSE);
+    g_return_val_if_fail(status != NULL, FALSE);
+
+    DVBRecording *recording = dvb_recorder_find_recording(recorder, program_number);
+    if (!recording)
+        return FALSE;
 
-    status->elapsed_time = difftime(end, recorder->record_start);
+    dvb_recorder_recording_query_status(recording, status);
+    return TRUE;
 }
 
 GList *dvb_recorder_get_epg(DVBRecorder *recorder)
@@ -519,6 +894,91 @@ DVBFilterType dvb_recorder_get_record_filter(DVBRecorder *recorder)
     return recorder->record_filter;
 }
 
+void dvb_recorder_set_record_buffer_size(DVBRecorder *recorder, gsize size)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_writer_options.buffer_size = size;
+}
+
+void dvb_recorder_set_record_direct_io(DVBRecorder *recorder, gboolean enable)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_writer_options.direct_io = enable;
+}
+
+void dvb_recorder_set_record_io_uring(DVBRecorder *recorder, gboolean enable, guint queue_depth)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_writer_options.io_uring = enable;
+    recorder->record_writer_options.queue_depth = queue_depth;
+}
+
+void dvb_recorder_set_record_index(DVBRecorder *recorder, gboolean enable)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_index_enabled = enable;
+}
+
+void dvb_recorder_set_record_segments(DVBRecorder *recorder, guint duration, guint64 size)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_segment_duration = duration;
+    recorder->record_segment_size = size;
+}
+
+void dvb_recorder_set_record_writeback_window(DVBRecorder *recorder, gsize window)
+{
+    FLOG("\n");
+    g_return_if_fail(recorder != NULL);
+
+    recorder->record_writer_options.writeback_window = window;
+}
+
+gboolean dvb_recorder_get_record_statistics(DVBRecorder *recorder, DVBRecorderRecordStatistics *stats)
+{
+    FLOG("\n");
+    g_return_val_if_fail(recorder != NULL, FALSE);
+    g_return_val_if_fail(stats != NULL, FALSE);
+
+    DVBRecording *recording = &recorder->recordings[0];
+    gboolean result = FALSE;
+
+    /* the record callback replaces the writer with each segment */
+    g_mutex_lock(&recording->writer_lock);
+    if (recording->writer) {
+        record_writer_get_statistics(recording->writer, stats);
+        result = TRUE;
+    }
+    g_mutex_unlock(&recording->writer_lock);
+
+    return result;
+}
+
+gboolean dvb_recorder_set_timeshift_size(DVBRecorder *recorder, gsize size)
+{
+    FLOG("\n");
+    g_return_val_if_fail(recorder != NULL, FALSE);
+
+    return dvb_reader_set_timeshift_size(recorder->reader, size);
+}
+
+DVBTimeshift *dvb_recorder_get_timeshift(DVBRecorder *recorder)
+{
+    g_return_val_if_fail(recorder != NULL, NULL);
+
+    return dvb_reader_get_timeshift(recorder->reader);
+}
+
 float dvb_recorder_get_signal_strength(DVBRecorder *recorder)
 {
     if (recorder)
@@ -8,6 +8,7 @@
 #include "streaminfo.h"
 #include "filter.h"
 #include "logging.h"
+#include "timeshift.h"
 
 typedef struct _DVBRecorder DVBRecorder;
 
@@ -24,8 +25,24 @@ typedef struct {
     DVBRecordStatus status;
     gdouble elapsed_time;
     gsize  filesize;
+    guint dropped;          /* chunks lost because the disk fell behind, see DVB_RECORDER_EVENT_RECORD_DATA_LOST */
 } DVBRecorderRecordStatus;
 
+typedef struct {
+    guint64 bytes_written;      /* bytes that reached the file */
+    guint64 writes;
+    guint queue_depth;          /* writes in flight (io_uring only) */
+    guint max_queue_depth;
+    guint64 queue_full_waits;   /* times recording had to wait for the disk with all buffers in flight */
+    guint64 write_latency_p50;  /* write latency percentiles in us, accurate to 25% */
+    guint64 write_latency_p90;
+    guint64 write_latency_p99;
+    guint64 write_latency_p999;
+    guint64 write_latency_max;
+    gboolean direct_io;         /* O_DIRECT is in use */
+    gboolean io_uring;          /* io_uring is in use */
+} DVBRecorderRecordStatistics;
+
 DVBRecorder *dvb_recorder_new(DVBRecorderEventCallback cb, gpointer userdata);
 void dvb_recorder_destroy(DVBRecorder *recorder);
 
@@ -37,6 +54,8 @@ void dvb_recorder_set_logger(DVBRecorder *recorder, DVBRecorderLoggerProc logger
 GList *dvb_recorder_get_channel_list(DVBRecorder *recorder);
 gboolean dvb_recorder_set_channel(DVBRecorder *recorder, guint64 channel_id);
 guint64 dvb_recorder_get_current_channel(DVBRecorder *recorder);
+/* Recording does not block the stream: if the disk falls about 128 MB behind, data is dropped and
+ * DVB_RECORDER_EVENT_RECORD_DATA_LOST is sent. */
 gboolean dvb_recorder_record_start(DVBRecorder *recorder);
 void dvb_recorder_record_stop(DVBRecorder *recorder);
 void dvb_recorder_stop(DVBRecorder *recorder);
@@ -44,6 +63,15 @@ void dvb_recorder_set_capture_dir(DVBRecorder *recorder, const gchar *capture_di
 void dvb_recorder_set_record_filename_pattern(DVBRecorder *recorder, const gchar *pattern);
 gchar *dvb_recorder_make_record_filename(DVBRecorder *recorder, const gchar *alternate_dir, const gchar *alternate_pattern);
 void dvb_recorder_query_record_status(DVBRecorder *recorder, DVBRecorderRecordStatus *status);
+/* Record another service of the tuned transponder along with the tuned one, without retuning. Up to seven run at
+ * once; they stop when the channel changes. The files get the program number through ${program_number}, which is
+ * inserted before the extension if the pattern lacks it; ${service_name} and ${program_name} are left empty.
+ * DVB_RECORDER_EVENT_RECORD_STATUS_CHANGED carries the program number. */
+gboolean dvb_recorder_record_service_start(DVBRecorder *recorder, guint16 program_number);
+void dvb_recorder_record_service_stop(DVBRecorder *recorder, guint16 program_number);
+/* Status of the last recording of program_number (0 for the tuned service), FALSE if there was none. */
+gboolean dvb_recorder_query_service_record_status(DVBRecorder *recorder, guint16 program_number,
+                                                  DVBRecorderRecordStatus *status);
 
 GList *dvb_recorder_get_epg(DVBRecorder *recorder);
 EPGEvent *dvb_recorder_get_epg_event(DVBRecorder *recorder, guint16 event_id);
@@ -59,6 +87,32 @@ DVBStreamStatus dvb_recorder_get_stream_status(DVBRecorder *recorder);
 
 void dvb_recorder_set_record_filter(DVBRecorder *recorder, DVBFilterType filter);
 DVBFilterType dvb_recorder_get_record_filter(DVBRecorder *recorder);
+/* Size of the aligned write buffer of recordings (1-8 MB, 0 for the default of 4 MB) and whether to bypass
+ * the page cache with O_DIRECT. Applies to the next recording. */
+void dvb_recorder_set_record_buffer_size(DVBRecorder *recorder, gsize size);
+void dvb_recorder_set_record_direct_io(DVBRecorder *recorder, gboolean enable);
+/* Submit recording writes through io_uring with up to queue_depth (0 for the default) writes in flight. Falls
+ * back to write() if the library was built without liburing or the kernel does not support it. */
+void dvb_recorder_set_record_io_uring(DVBRecorder *recorder, gboolean enable, guint queue_depth);
+/* Start writeback of recordings in windows of this size and drop older windows from the page cache
+ * (0 for the default of 8 MB, G_MAXSIZE to leave it to the kernel). Not used with direct I/O. */
+void dvb_recorder_set_record_writeback_window(DVBRecorder *recorder, gsize window);
+/* Write a seek index next to each recording file, see record-index.h. Enabled by default. */
+void dvb_recorder_set_record_index(DVBRecorder *recorder, gboolean enable);
+/* Split recordings into segments of about duration seconds or size bytes, whichever is reached first (0 for no
+ * limit, both 0 for a single file). Segments are cut at the next random access point and start with PAT and PMT.
+ * ${segment} in the filename pattern is replaced by the segment number, and inserted before the extension if the
+ * pattern lacks it. DVB_RECORDER_EVENT_RECORD_SEGMENT_FINISHED is sent for each closed segment. Applies to the
+ * next recording. */
+void dvb_recorder_set_record_segments(DVBRecorder *recorder, guint duration, guint64 size);
+/* Returns FALSE if no recording is running. */
+gboolean dvb_recorder_get_record_statistics(DVBRecorder *recorder, DVBRecorderRecordStatistics *stats);
+
+/* Keep the last size bytes of the current service in memory for time-shifted playback, see timeshift.h. 0 drops
+ * the ring; cursors keep using it until they are freed. Returns FALSE if it cannot be created. */
+gboolean dvb_recorder_set_timeshift_size(DVBRecorder *recorder, gsize size);
+/* A reference to the ring for creating cursors, NULL if time-shift is off. Drop it with dvb_timeshift_unref(). */
+DVBTimeshift *dvb_recorder_get_timeshift(DVBRecorder *recorder);
 
 float dvb_recorder_get_signal_strength(DVBRecorder *recorder);
 
@@ -27,6 +27,11 @@ void dvb_recorder_event_listener_status_changed_set_property(DVBRecorderEvent *e
         const gchar *prop_name, const gpointer prop_value);
 void dvb_recorder_event_channel_changed_set_property(DVBRecorderEvent *event,
         const gchar *prop_name, const gpointer prop_value);
+void dvb_recorder_event_record_segment_finished_set_property(DVBRecorderEvent *event,
+        const gchar *prop_name, const gpointer prop_value);
+void dvb_recorder_event_record_segment_finished_destroy(DVBRecorderEvent *event);
+void dvb_recorder_event_record_data_lost_set_property(DVBRecorderEvent *event,
+        const gchar *prop_name, const gpointer prop_value);
 
 static struct DREventClass event_classes[] = {
     { DVB_RECORDER_EVENT_TUNED, sizeof(DVBRecorderEventTuned),
@@ -51,6 +56,11 @@ static struct DREventClass event_classes[] = {
         NULL, NULL },
     { DVB_RECORDER_EVENT_CHANNEL_CHANGED, sizeof(DVBRecorderEventChannelChanged),
         dvb_recorder_event_channel_changed_set_property, NULL },
+    { DVB_RECORDER_EVENT_RECORD_SEGMENT_FINISHED, sizeof(DVBRecorderEventRecordSegmentFinished),
+        dvb_recorder_event_record_segment_finished_set_property,
+        dvb_recorder_event_record_segment_finished_destroy },
+    { DVB_RECORDER_EVENT_RECORD_DATA_LOST, sizeof(DVBRecorderEventRecordDataLost),
+        dvb_recorder_event_record_data_lost_set_property, NULL },
 };
 
 struct DREventClass *dvb_recorder_event_get_class(DVBRecorderEventType type)
@@ -235,6 +245,9 @@ void dvb_recorder_event_record_status_changed_set_property(DVBRecorderEvent *eve
     if (g_strcmp0(prop_name, "status") == 0) {
         ev->status = GPOINTER_TO_INT(prop_value);
     }
+    else if (g_strcmp0(prop_name, "program-number") == 0) {
+        ev->program_number = (guint16)GPOINTER_TO_UINT(prop_value);
+    }
     else {
         fprintf(stderr, "Unknown property: %s\n", prop_name);
     }
@@ -270,9 +283,15 @@ void dvb_recorder_event_listener_status_changed_set_property(DVBRecorderEvent *e
         ev->listener_cb = (gpointer)prop_value;
         ev->cb_valid = 1;
     }
+    else if (g_strcmp0(prop_name, "data") == 0) {
+        ev->listener_data = (gpointer)prop_value;
+    }
     else if (g_strcmp0(prop_name, "status") == 0) {
         ev->status = GPOINTER_TO_UINT(prop_value);
     }
+    else if (g_strcmp0(prop_name, "dropped") == 0) {
+        ev->dropped = GPOINTER_TO_UINT(prop_value);
+    }
     else {
         fprintf(stderr, "Unknown property: %s\n", prop_name);
     }
@@ -290,3 +309,44 @@ void dvb_recorder_event_channel_changed_set_property(DVBRecorderEvent *event,
     }
 }
 
+void dvb_recorder_event_record_segment_finished_set_property(DVBRecorderEvent *event,
+        const gchar *prop_name, const gpointer prop_value)
+{
+    if (!event)
+        return;
+    DVBRecorderEventRecordSegmentFinished *ev = (DVBRecorderEventRecordSegmentFinished *)event;
+
+    if (g_strcmp0(prop_name, "filename") == 0) {
+        g_free(ev->filename);
+        ev->filename = g_strdup((const gchar *)prop_value);
+    }
+    else if (g_strcmp0(prop_name, "segment") == 0) {
+        ev->segment = GPOINTER_TO_UINT(prop_value);
+    }
+    else {
+        fprintf(stderr, "Unknown property: %s\n", prop_name);
+    }
+}
+
+void dvb_recorder_event_record_segment_finished_destroy(DVBRecorderEvent *event)
+{
+    g_free(((DVBRecorderEventRecordSegmentFinished *)event)->filename);
+}
+
+void dvb_recorder_event_record_data_lost_set_property(DVBRecorderEvent *event,
+        const gchar *prop_name, const gpointer prop_value)
+{
+    if (!event)
+        return;
+    DVBRecorderEventRecordDataLost *ev = (DVBRecorderEventRecordDataLost *)event;
+
+    if (g_strcmp0(prop_name, "program-number") == 0) {
+        ev->program_number = (guint16)GPOINTER_TO_UINT(prop_value);
+    }
+    else if (g_strcmp0(prop_name, "dropped") == 0) {
+        ev->dropped = GPOINTER_TO_UINT(prop_value);
+    }
+    else {
+        fprintf(stderr, "Unknown property: %s\n", prop_name);
+    }
+}
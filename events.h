@@ -14,6 +14,8 @@ typedef enum {
     DVB_RECORDER_EVENT_LISTENER_STATUS_CHANGED,
     DVB_RECORDER_EVENT_VIDEO_DIED,
     DVB_RECORDER_EVENT_CHANNEL_CHANGED,
+    DVB_RECORDER_EVENT_RECORD_SEGMENT_FINISHED,
+    DVB_RECORDER_EVENT_RECORD_DATA_LOST,
     DVB_RECORDER_EVENT_COUNT
 } DVBRecorderEventType;
 
@@ -36,7 +38,8 @@ typedef enum {
     DVB_LISTENER_STATUS_UNKNOWN = 0,
     DVB_LISTENER_STATUS_EOS,
     DVB_LISTENER_STATUS_TERMINATED,
-    DVB_LISTENER_STATUS_WRITE_ERROR
+    DVB_LISTENER_STATUS_WRITE_ERROR,
+    DVB_LISTENER_STATUS_OVERFLOW
 } DVBListenerStatus;
 
 typedef struct {
@@ -78,6 +81,7 @@ typedef struct {
 typedef struct {
     DVBRecorderEvent parent;
     DVBRecordStatus status;
+    guint16 program_number;       /* 0 for the tuned service */
 } DVBRecorderEventRecordStatusChanged;
 
 typedef struct {
@@ -96,6 +100,8 @@ typedef struct {
     guint status;
     gint listener_fd;
     gpointer listener_cb;
+    gpointer listener_data;   /* with listener_cb, which may serve several listeners */
+    guint dropped;       /* chunks dropped so far, for DVB_LISTENER_STATUS_OVERFLOW */
 
     guint fd_valid : 1;
     guint cb_valid : 1;
@@ -110,5 +116,20 @@ typedef struct {
     guint channel_id;
 } DVBRecorderEventChannelChanged;
 
+/* A segment of a segmented recording was closed and may be processed. Sent from the recording thread. */
+typedef struct {
+    DVBRecorderEvent parent;
+    gchar *filename;
+    guint segment;
+} DVBRecorderEventRecordSegmentFinished;
+
+/* A recording lost data because the disk fell too far behind; the file has a gap. Sent from the recording
+ * thread, at most once a second while it lasts. */
+typedef struct {
+    DVBRecorderEvent parent;
+    guint16 program_number;       /* 0 for the tuned service */
+    guint dropped;                /* chunks lost by the recording so far */
+} DVBRecorderEventRecordDataLost;
+
 typedef void (*DVBRecorderEventCallback)(DVBRecorderEvent *, gpointer);
 void dvb_recorder_event_send(DVBRecorderEventType type, DVBRecorderEventCallback cb, gpointer data, ...);
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+#include <bitstream/mpeg/ts.h>
+
+/* Stream time from the PCR of one pid, in 90 kHz ticks since its first PCR. The PCR wraps after 2^33 ticks of
+ * its base; larger jumps are discontinuities and add no time, so the time never decreases. */
+#define PCR_CLOCK_MAX_STEP (10 * 90000)
+
+typedef struct {
+    guint64 last_pcr;
+    guint64 time;
+    guint16 pid;        /* first pid seen with a PCR, 0x1fff before */
+    guint8 valid;
+} PcrClock;
+
+static inline void pcr_clock_init(PcrClock *clock)
+{
+    clock->last_pcr = 0;
+    clock->time = 0;
+    clock->pid = 0x1fff;
+    clock->valid = 0;
+}
+
+/* Returns TRUE if the packet carried the clock's PCR. */
+static inline gboolean pcr_clock_update(PcrClock *clock, const uint8_t *packet)
+{
+    guint64 pcr, step;
+
+    if (!ts_has_adaptation(packet) || !ts_get_adaptation(packet) || !tsaf_has_pcr(packet))
+        return FALSE;
+    if (clock->pid == 0x1fff)
+        clock->pid = ts_get_pid(packet);
+    else if (ts_get_pid(packet) != clock->pid)
+        return FALSE;
+
+    pcr = tsaf_get_pcr(packet);
+    if (clock->valid) {
+        step = (pcr - clock->last_pcr) & ((G_GUINT64_CONSTANT(1) << 33) - 1);
+        if (step <= PCR_CLOCK_MAX_STEP)
+            clock->time += step;
+    }
+    clock->last_pcr = pcr;
+    clock->valid = 1;
+
+    return TRUE;
+}
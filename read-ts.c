@@ -3,6 +3,20 @@
 
 #include "read-ts.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TS_READER_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Number of consecutive sync bytes at packet distance required to accept a sync position. */
+#define TS_READER_SYNC_PACKETS 5
+/* Distance from a candidate position to the last sync byte we check. */
+#define TS_READER_SYNC_SPAN ((TS_READER_SYNC_PACKETS - 1) * TS_SIZE)
+
+/* Return the first offset in buffer where TS_READER_SYNC_PACKETS sync bytes follow each other at packet distance,
+ * or len if there is none. */
+typedef size_t (*TsReaderSyncFunc)(const uint8_t *, size_t);
+
 struct _TsReader {
     TsReaderClass klass;
     void *cb_userdata;
@@ -12,6 +26,9 @@ struct _TsReader {
     uint8_t *buffer;
     size_t remaining;
 
+    TsReaderSyncMethod sync_method;
+    TsReaderSyncFunc sync_func;
+
     guint32 error_occured : 1;
 };
 
@@ -30,42 +47,195 @@ static inline void ts_reader_advance_buffer(TsReader *reader, size_t len)
     reader->remaining -= len;
 }
 
-void ts_reader_sync_stream(TsReader *reader)
+static inline gboolean ts_reader_sync_confirm(const uint8_t *buffer)
+{
+    return buffer[TS_SIZE] == 0x47 &&
+           buffer[2 * TS_SIZE] == 0x47 &&
+           buffer[3 * TS_SIZE] == 0x47 &&
+           buffer[4 * TS_SIZE] == 0x47;
+}
+
+/* Check offsets from start up to (excluding) len - TS_READER_SYNC_SPAN one by one. memchr skips the
+ * garbage between candidates quickly, each candidate is confirmed by four more loads. */
+static size_t ts_reader_sync_scalar_from(const uint8_t *buffer, size_t start, size_t len)
+{
+    const uint8_t *candidate;
+    size_t end;
+
+    if (len <= TS_READER_SYNC_SPAN)
+        return len;
+    end = len - TS_READER_SYNC_SPAN;
+
+    while (start < end) {
+        if ((candidate = memchr(&buffer[start], 0x47, end - start)) == NULL)
+            break;
+        if (ts_reader_sync_confirm(candidate))
+            return (size_t)(candidate - buffer);
+        start = (size_t)(candidate - buffer) + 1;
+    }
+
+    return len;
+}
+
+static size_t ts_reader_sync_scalar(const uint8_t *buffer, size_t len)
+{
+    return ts_reader_sync_scalar_from(buffer, 0, len);
+}
+
+#ifdef TS_READER_HAVE_X86_SIMD
+/* Compare a whole block of candidate offsets at once: a lane is set only if all five bytes at packet distance
+ * are sync bytes, so the first set bit is the sync position. */
+__attribute__((target("sse2")))
+static size_t ts_reader_sync_sse2(const uint8_t *buffer, size_t len)
+{
+    const __m128i sync = _mm_set1_epi8(0x47);
+    __m128i match;
+    unsigned int mask;
+    size_t offset = 0;
+
+    while (offset + TS_READER_SYNC_SPAN + sizeof(__m128i) <= len) {
+        match = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buffer[offset]), sync);
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buffer[offset + TS_SIZE]), sync));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buffer[offset + 2 * TS_SIZE]), sync));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buffer[offset + 3 * TS_SIZE]), sync));
+        match = _mm_and_si128(match, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&buffer[offset + 4 * TS_SIZE]), sync));
+        if ((mask = (unsigned int)_mm_movemask_epi8(match)) != 0)
+            return offset + __builtin_ctz(mask);
+        offset += sizeof(__m128i);
+    }
+
+    return ts_reader_sync_scalar_from(buffer, offset, len);
+}
+
+__attribute__((target("avx2")))
+static size_t ts_reader_sync_avx2(const uint8_t *buffer, size_t len)
 {
-    /* return start of first valid sync byte */
+    const __m256i sync = _mm256_set1_epi8(0x47);
+    __m256i match;
+    unsigned int mask;
     size_t offset = 0;
-    int no_match = 0;
+
+    while (offset + TS_READER_SYNC_SPAN + sizeof(__m256i) <= len) {
+        match = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buffer[offset]), sync);
+        match = _mm256_and_si256(match, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buffer[offset + TS_SIZE]), sync));
+        match = _mm256_and_si256(match, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buffer[offset + 2 * TS_SIZE]), sync));
+        match = _mm256_and_si256(match, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buffer[offset + 3 * TS_SIZE]), sync));
+        match = _mm256_and_si256(match, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&buffer[offset + 4 * TS_SIZE]), sync));
+        if ((mask = (unsigned int)_mm256_movemask_epi8(match)) != 0)
+            return offset + __builtin_ctz(mask);
+        offset += sizeof(__m256i);
+    }
+
+    return ts_reader_sync_scalar_from(buffer, offset, len);
+}
+#endif
+
+static gboolean ts_reader_sync_method_supported(TsReaderSyncMethod method)
+{
+    switch (method) {
+        case TS_READER_SYNC_SCALAR:
+            return TRUE;
+#ifdef TS_READER_HAVE_X86_SIMD
+        case TS_READER_SYNC_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+        case TS_READER_SYNC_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+static TsReaderSyncFunc ts_reader_sync_method_func(TsReaderSyncMethod method)
+{
+    switch (method) {
+#ifdef TS_READER_HAVE_X86_SIMD
+        case TS_READER_SYNC_SSE2:
+            return ts_reader_sync_sse2;
+        case TS_READER_SYNC_AVX2:
+            return ts_reader_sync_avx2;
+#endif
+        default:
+            return ts_reader_sync_scalar;
+    }
+}
+
+const char *ts_reader_sync_method_name(TsReaderSyncMethod method)
+{
+    switch (method) {
+        case TS_READER_SYNC_AUTO:   return "auto";
+        case TS_READER_SYNC_SCALAR: return "scalar";
+        case TS_READER_SYNC_SSE2:   return "sse2";
+        case TS_READER_SYNC_AVX2:   return "avx2";
+        default:
+            return "unknown";
+    }
+}
+
+gboolean ts_reader_set_sync_method(TsReader *reader, TsReaderSyncMethod method)
+{
+    g_return_val_if_fail(reader != NULL, FALSE);
+
+    if (method == TS_READER_SYNC_AUTO) {
+        if (ts_reader_sync_method_supported(TS_READER_SYNC_AVX2))
+            method = TS_READER_SYNC_AVX2;
+        else if (ts_reader_sync_method_supported(TS_READER_SYNC_SSE2))
+            method = TS_READER_SYNC_SSE2;
+        else
+            method = TS_READER_SYNC_SCALAR;
+    }
+    else if (!ts_reader_sync_method_supported(method)) {
+        return FALSE;
+    }
+
+    reader->sync_method = method;
+    reader->sync_func = ts_reader_sync_method_func(method);
+
+    return TRUE;
+}
+
+TsReaderSyncMethod ts_reader_get_sync_method(TsReader *reader)
+{
+    g_return_val_if_fail(reader != NULL, TS_READER_SYNC_AUTO);
+
+    return reader->sync_method;
+}
+
+void ts_reader_sync_stream(TsReader *reader)
+{
+    /* return start of first valid sync byte; drop buffer if not enough bytes in buffer to sync */
+    size_t offset = reader->sync_func(reader->buffer, reader->remaining);
+
+    if (offset < reader->remaining)
+        ts_reader_advance_buffer(reader, offset);
+    else
+        reader->remaining = 0;
+}
+
+static inline void ts_reader_deliver_packets(TsReader *reader, const uint8_t *packets, size_t count)
+{
     size_t i;
-    while (offset < reader->remaining) {
-        if (ts_validate(reader->buffer)) { /* possible start */
-            no_match = 0;
-            /* check if we have the start of a packet (next five packets) */
-            for (i = 1; i < 5 && no_match == 0; ++i) {
-                if (offset + i * TS_SIZE < reader->remaining) {
-                    if (!ts_validate(&reader->buffer[offset + i * TS_SIZE]))
-                        no_match = 1;
-                }
-                else {
-                    goto err;
-                }
-            }
-            if (!no_match) {
-                ts_reader_advance_buffer(reader, offset);
-                return;
-            }
+
+    if (reader->klass.handle_packets) {
+        if (!reader->klass.handle_packets(packets, count, reader->cb_userdata))
+            reader->error_occured = 1;
+        return;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (!reader->klass.handle_packet(&packets[i * TS_SIZE], reader->cb_userdata)) {
+            reader->error_occured = 1;
+            return;
         }
-        ++offset;
     }
-err:
-    /* drop buffer if not enough bytes in buffer to sync */
-    reader->remaining = 0;
 }
 
-static inline void ts_reader_process_packet(TsReader *reader)
+static inline void ts_reader_process_packet(TsReader *reader, const uint8_t *packet)
 {
-    if (ts_validate(reader->packet_data)) {
-        if (!reader->klass.handle_packet(reader->packet_data, reader->cb_userdata))
-            reader->error_occured = 1;
+    if (ts_validate(packet)) {
+        ts_reader_deliver_packets(reader, packet, 1);
     }
     else {
         reader->bytes_read = 0;
@@ -73,6 +243,7 @@ static inline void ts_reader_process_packet(TsReader *reader)
     }
 }
 
+/* Stage a packet that straddles two buffers in packet_data. This is the only path that copies data. */
 static inline void ts_reader_read_packet_partial(TsReader *reader)
 {
     if (reader->remaining < TS_SIZE - reader->bytes_read) {
@@ -85,7 +256,27 @@ static inline void ts_reader_read_packet_partial(TsReader *reader)
     ts_reader_advance_buffer(reader, TS_SIZE - reader->bytes_read);
 
     reader->bytes_read = 0;
-    ts_reader_process_packet(reader);
+    ts_reader_process_packet(reader, reader->packet_data);
+}
+
+/* Hand out the run of valid packets lying completely inside the caller's buffer without copying them. An
+ * invalid packet is resynced from its own start, so no bytes are skipped. */
+static inline void ts_reader_read_packets_direct(TsReader *reader)
+{
+    const uint8_t *packets = reader->buffer;
+    size_t count = 0;
+
+    if (!ts_validate(packets)) {
+        ts_reader_sync_stream(reader);
+        return;
+    }
+
+    do {
+        ++count;
+    } while ((count + 1) * TS_SIZE <= reader->remaining && ts_validate(&packets[count * TS_SIZE]));
+
+    ts_reader_advance_buffer(reader, count * TS_SIZE);
+    ts_reader_deliver_packets(reader, packets, count);
 }
 
 TsReader *ts_reader_new(TsReaderClass *klass, void *userdata)
@@ -98,11 +289,13 @@ TsReader *ts_reader_new(TsReaderClass *klass, void *userdata)
     else
         reader->klass = ts_reader_class_fallback;
 
-    if (!reader->klass.handle_packet)
+    if (!reader->klass.handle_packet && !reader->klass.handle_packets)
         reader->klass.handle_packet = ts_reader_handle_packet_fallback;
 
     reader->cb_userdata = userdata;
 
+    ts_reader_set_sync_method(reader, TS_READER_SYNC_AUTO);
+
     return reader;
 }
 
@@ -113,15 +306,18 @@ void ts_reader_free(TsReader *reader)
 
 void ts_reader_push_buffer(TsReader *reader, const uint8_t *buffer, size_t len)
 {
-    /* if bytes_read < 188 read min{188-bytes_read,len} bytes from buffer
-     * else check if byte 0 valid; if not sync stream */
+    /* if bytes_read > 0 complete the staged packet first, then pass all complete packets directly from the
+     * buffer and stage the rest; if byte 0 of a packet is not valid sync stream */
     reader->buffer = (uint8_t *)buffer;
     reader->remaining = len;
 
-    if (reader->bytes_read == 0 && !ts_validate(reader->buffer))
+    if (reader->bytes_read == 0 && reader->remaining && !ts_validate(reader->buffer))
         ts_reader_sync_stream(reader);
 
     while (reader->remaining && !reader->error_occured) {
-        ts_reader_read_packet_partial(reader);
+        if (reader->bytes_read == 0 && reader->remaining >= TS_SIZE)
+            ts_reader_read_packets_direct(reader);
+        else
+            ts_reader_read_packet_partial(reader);
     }
 }
@@ -7,11 +7,28 @@ typedef struct _TsReader TsReader;
 
 typedef struct _TsReaderClass {
     /* callbacks for packets/tables/… */
-    /* Handle a packet. */
-    gboolean (*handle_packet)(const uint8_t *, void *); /* required */
+    /* Handle a packet. The packet usually points into the buffer passed to ts_reader_push_buffer() and is
+     * only valid during the call. */
+    gboolean (*handle_packet)(const uint8_t *, void *);
+    /* Handle a run of n contiguous, validated packets. Used instead of handle_packet if set. At least one of
+     * both is required. */
+    gboolean (*handle_packets)(const uint8_t *, size_t, void *);
 } TsReaderClass;
 
+/* Implementation used to find the next sync position after the stream was corrupted. */
+typedef enum {
+    TS_READER_SYNC_AUTO = 0,   /* best method supported by the cpu */
+    TS_READER_SYNC_SCALAR,
+    TS_READER_SYNC_SSE2,
+    TS_READER_SYNC_AVX2
+} TsReaderSyncMethod;
+
 TsReader *ts_reader_new(TsReaderClass *klass, void *userdata);
 void ts_reader_free(TsReader *reader);
 
+/* Select the resync implementation. Returns FALSE if the method is not supported on this machine. */
+gboolean ts_reader_set_sync_method(TsReader *reader, TsReaderSyncMethod method);
+TsReaderSyncMethod ts_reader_get_sync_method(TsReader *reader);
+const char *ts_reader_sync_method_name(TsReaderSyncMethod method);
+
 void ts_reader_push_buffer(TsReader *reader, const uint8_t *buffer, size_t len);
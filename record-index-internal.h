@@ -0,0 +1,14 @@
+#pragma once
+
+#include "record-index.h"
+#include "dvbreader.h"
+#include "logging.h"
+
+/* Writes the index while recording. Fed with the packets in the order they go to the file. */
+typedef struct _DVBRecordIndexWriter DVBRecordIndexWriter;
+
+DVBRecordIndexWriter *dvb_record_index_writer_new(const gchar *filename, DVBReader *reader, DVBRecorderLogger *logger);
+/* packets are written to the recording at offset */
+void dvb_record_index_writer_push(DVBRecordIndexWriter *writer, const guint8 *packets, gsize size, guint64 offset);
+/* Returns FALSE if the index is incomplete. */
+gboolean dvb_record_index_writer_free(DVBRecordIndexWriter *writer);
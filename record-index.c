@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/pes.h>
+
+#include "record-index.h"
+#include "record-index-internal.h"
+#include "pcr-clock.h"
+#include "logging-internal.h"
+
+#define DVB_RECORD_INDEX_INTERVAL 90000                /* between entries of a kind, 1 s */
+#define DVB_RECORD_INDEX_MAGIC_SIZE 8
+
+struct _DVBRecordIndexWriter {
+    FILE *file;
+    gchar *filename;
+    DVBReader *reader;
+    DVBRecorderLogger *logger;
+
+    PcrClock clock;
+    guint64 last_entry_time;
+    guint64 last_rap_time;
+
+    guint have_entry : 1;
+    guint have_rap : 1;
+    guint failed : 1;
+};
+
+struct _DVBRecordIndex {
+    guint8 *data;
+    gsize length;
+    guint count;
+    /* positions of the random access points */
+    guint *raps;
+    guint rap_count;
+};
+
+static void dvb_record_index_writer_add(DVBRecordIndexWriter *writer, guint64 offset, guint64 pts, guint32 flags);
+
+gchar *dvb_record_index_filename(const gchar *recording)
+{
+    g_return_val_if_fail(recording != NULL, NULL);
+
+    return g_strconcat(recording, ".idx", NULL);
+}
+
+DVBRecordIndexWriter *dvb_record_index_writer_new(const gchar *filename, DVBReader *reader, DVBRecorderLogger *logger)
+{
+    FLOG("\n");
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        LOG(logger, "Failed to open index %s: (%d) %s\n", filename, errno, strerror(errno));
+        return NULL;
+    }
+
+    DVBRecordIndexWriter *writer = g_malloc0(sizeof(DVBRecordIndexWriter));
+    writer->file = file;
+    writer->filename = g_strdup(filename);
+    writer->reader = reader;
+    writer->logger = logger;
+    pcr_clock_init(&writer->clock);
+
+    if (fwrite(DVB_RECORD_INDEX_MAGIC, DVB_RECORD_INDEX_MAGIC_SIZE, 1, file) != 1)
+        writer->failed = 1;
+
+    return writer;
+}
+
+static inline void dvb_record_index_put_le(guint8 *buffer, guint64 value, guint bytes)
+{
+    guint i;
+    for (i = 0; i < bytes; ++i, value >>= 8)
+        buffer[i] = (guint8)value;
+}
+
+static inline guint64 dvb_record_index_get_le(const guint8 *buffer, guint bytes)
+{
+    guint64 value = 0;
+    guint i;
+    for (i = bytes; i > 0; --i)
+        value = (value << 8) | buffer[i - 1];
+    return value;
+}
+
+static void dvb_record_index_writer_add(DVBRecordIndexWriter *writer, guint64 offset, guint64 pts, guint32 flags)
+{
+    guint8 entry[DVB_RECORD_INDEX_ENTRY_SIZE] = { 0 };
+
+    dvb_record_index_put_le(&entry[0], offset, 8);
+    dvb_record_index_put_le(&entry[8], writer->clock.time, 8);
+    dvb_record_index_put_le(&entry[16], pts, 8);
+    dvb_record_index_put_le(&entry[24], flags, 4);
+
+    if (!writer->failed && fwrite(entry, DVB_RECORD_INDEX_ENTRY_SIZE, 1, writer->file) != 1) {
+        LOG(writer->logger, "Could not write index %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+        writer->failed = 1;
+    }
+
+    writer->last_entry_time = writer->clock.time;
+    writer->have_entry = 1;
+    if (flags & DVB_RECORD_INDEX_FLAG_RAP) {
+        writer->last_rap_time = writer->clock.time;
+        writer->have_rap = 1;
+    }
+}
+
+static guint64 dvb_record_index_packet_pts(const guint8 *packet)
+{
+    const guint8 *payload;
+
+    if (!ts_get_unitstart(packet) || !ts_has_payload(packet))
+        return DVB_RECORD_INDEX_NO_PTS;
+
+    payload = ts_payload((uint8_t *)packet);
+    if (payload + PES_HEADER_SIZE_PTS > packet + TS_SIZE || !pes_validate(payload) || !pes_has_pts(payload))
+        return DVB_RECORD_INDEX_NO_PTS;
+
+    return pes_get_pts(payload);
+}
+
+void dvb_record_index_writer_push(DVBRecordIndexWriter *writer, const guint8 *packets, gsize size, guint64 offset)
+{
+    const guint8 *packet;
+    gsize i;
+
+    if (!writer)
+        return;
+
+    for (i = 0; i + TS_SIZE <= size; i += TS_SIZE) {
+        packet = &packets[i];
+
+        if (pcr_clock_update(&writer->clock, packet) &&
+                (!writer->have_entry || writer->clock.time - writer->last_entry_time >= DVB_RECORD_INDEX_INTERVAL))
+            dvb_record_index_writer_add(writer, offset + i, DVB_RECORD_INDEX_NO_PTS, 0);
+
+        /* keyframes may come several times a second; seeking needs no more than one per second */
+        if ((!writer->have_rap || writer->clock.time - writer->last_rap_time >= DVB_RECORD_INDEX_INTERVAL) &&
+                dvb_reader_packet_is_random_access_point(writer->reader, packet))
+            dvb_record_index_writer_add(writer, offset + i, dvb_record_index_packet_pts(packet),
+                                        DVB_RECORD_INDEX_FLAG_RAP);
+    }
+}
+
+gboolean dvb_record_index_writer_free(DVBRecordIndexWriter *writer)
+{
+    FLOG("\n");
+    if (!writer)
+        return FALSE;
+
+    if (fclose(writer->file) != 0 && !writer->failed) {
+        LOG(writer->logger, "Could not write index %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+        writer->failed = 1;
+    }
+
+    gboolean result = !writer->failed;
+
+    g_free(writer->filename);
+    g_free(writer);
+
+    return result;
+}
+
+static inline const guint8 *dvb_record_index_entry_data(DVBRecordIndex *index, guint position)
+{
+    return &index->data[DVB_RECORD_INDEX_MAGIC_SIZE + (gsize)position * DVB_RECORD_INDEX_ENTRY_SIZE];
+}
+
+static inline guint64 dvb_record_index_entry_time(DVBRecordIndex *index, guint position)
+{
+    return dvb_record_index_get_le(dvb_record_index_entry_data(index, position) + 8, 8);
+}
+
+static inline guint32 dvb_record_index_entry_flags(DVBRecordIndex *index, guint position)
+{
+    return (guint32)dvb_record_index_get_le(dvb_record_index_entry_data(index, position) + 24, 4);
+}
+
+DVBRecordIndex *dvb_record_index_open(const gchar *filename)
+{
+    FLOG("\n");
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    gchar *data;
+    gsize length;
+
+    if (!g_file_get_contents(filename, &data, &length, NULL))
+        return NULL;
+
+    if (length < DVB_RECORD_INDEX_MAGIC_SIZE || memcmp(data, DVB_RECORD_INDEX_MAGIC, DVB_RECORD_INDEX_MAGIC_SIZE) != 0) {
+        g_free(data);
+        return NULL;
+    }
+
+    DVBRecordIndex *index = g_malloc0(sizeof(DVBRecordIndex));
+    index->data = (guint8 *)data;
+    index->length = length;
+    /* a partially written last entry is ignored */
+    index->count = (guint)((length - DVB_RECORD_INDEX_MAGIC_SIZE) / DVB_RECORD_INDEX_ENTRY_SIZE);
+
+    guint position;
+    index->raps = g_new(guint, index->count + 1);
+    for (position = 0; position < index->count; ++position) {
+        if (dvb_record_index_entry_flags(index, position) & DVB_RECORD_INDEX_FLAG_RAP)
+            index->raps[index->rap_count++] = position;
+    }
+
+    return index;
+}
+
+void dvb_record_index_close(DVBRecordIndex *index)
+{
+    if (!index)
+        return;
+
+    g_free(index->raps);
+    g_free(index->data);
+    g_free(index);
+}
+
+guint dvb_record_index_get_count(DVBRecordIndex *index)
+{
+    g_return_val_if_fail(index != NULL, 0);
+
+    return index->count;
+}
+
+gboolean dvb_record_index_get_entry(DVBRecordIndex *index, guint position, DVBRecordIndexEntry *entry)
+{
+    g_return_val_if_fail(index != NULL, FALSE);
+
+    if (position >= index->count)
+        return FALSE;
+
+    if (entry) {
+        const guint8 *data = dvb_record_index_entry_data(index, position);
+        entry->offset = dvb_record_index_get_le(&data[0], 8);
+        entry->time = dvb_record_index_get_le(&data[8], 8);
+        entry->pts = dvb_record_index_get_le(&data[16], 8);
+        entry->flags = (guint32)dvb_record_index_get_le(&data[24], 4);
+    }
+
+    return TRUE;
+}
+
+guint64 dvb_record_index_get_duration(DVBRecordIndex *index)
+{
+    g_return_val_if_fail(index != NULL, 0);
+
+    if (!index->count)
+        return 0;
+
+    return dvb_record_index_entry_time(index, index->count - 1) / 90;
+}
+
+gboolean dvb_record_index_lookup(DVBRecordIndex *index, guint64 time_ms, gboolean random_access,
+                                 DVBRecordIndexEntry *entry)
+{
+    g_return_val_if_fail(index != NULL, FALSE);
+
+    guint64 time = time_ms * 90;
+    guint low = 0, high = random_access ? index->rap_count : index->count, mid;
+
+    /* first entry later than time; times never decrease */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (dvb_record_index_entry_time(index, random_access ? index->raps[mid] : mid) <= time)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low == 0)
+        return FALSE;
+
+    return dvb_record_index_get_entry(index, random_access ? index->raps[low - 1] : low - 1, entry);
+}
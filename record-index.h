@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glib.h>
+
+/* Seek index written next to a recording (see dvb_record_index_filename()). The file starts with the 8 byte
+ * magic "DVBIDX01", followed by fixed size entries in file order, all fields little endian:
+ *
+ *   guint64 offset   byte offset of the packet in the recording
+ *   guint64 time     90 kHz ticks since the start of the recording, derived from the PCR; never decreases
+ *   guint64 pts      PTS of the video frame starting at the packet, DVB_RECORD_INDEX_NO_PTS if none
+ *   guint32 flags    DVB_RECORD_INDEX_FLAG_*
+ *   guint32 reserved
+ *
+ * There is an entry for the first random access point of each second and about one per second of PCR in
+ * between. */
+
+#define DVB_RECORD_INDEX_MAGIC "DVBIDX01"
+#define DVB_RECORD_INDEX_ENTRY_SIZE 32
+#define DVB_RECORD_INDEX_NO_PTS G_MAXUINT64
+
+#define DVB_RECORD_INDEX_FLAG_RAP 0x01      /* a decoder can start at the packet */
+
+typedef struct {
+    guint64 offset;
+    guint64 time;
+    guint64 pts;
+    guint32 flags;
+} DVBRecordIndexEntry;
+
+typedef struct _DVBRecordIndex DVBRecordIndex;
+
+/* Name of the index belonging to a recording. */
+gchar *dvb_record_index_filename(const gchar *recording);
+
+/* Load an index file. Returns NULL if it cannot be read or is no index. */
+DVBRecordIndex *dvb_record_index_open(const gchar *filename);
+void dvb_record_index_close(DVBRecordIndex *index);
+
+guint dvb_record_index_get_count(DVBRecordIndex *index);
+gboolean dvb_record_index_get_entry(DVBRecordIndex *index, guint position, DVBRecordIndexEntry *entry);
+/* Duration covered by the index in ms. */
+guint64 dvb_record_index_get_duration(DVBRecordIndex *index);
+
+/* Find the last entry at or before time_ms (ms since the start of the recording), restricted to random access
+ * points if random_access is set. Returns FALSE if there is none. */
+gboolean dvb_record_index_lookup(DVBRecordIndex *index, guint64 time_ms, gboolean random_access,
+                                 DVBRecordIndexEntry *entry);
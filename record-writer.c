@@ -0,0 +1,686 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "record-writer.h"
+#include "logging-internal.h"
+
+typedef struct {
+    guint8 *data;               /* aligned to RECORD_WRITER_ALIGNMENT */
+    guint64 offset;             /* file position of the write in flight */
+    gsize length;
+    gsize done;
+    gint64 submit_time;
+    guint busy : 1;
+} RecordWriterBuffer;
+
+/* Write latency histogram: values below 4 us are exact, above that each power of two is split into four
+ * buckets, so percentiles are accurate to 25%. */
+#define RECORD_WRITER_LATENCY_BUCKETS 128
+
+/* ring entries beyond the buffers for the writeback of one window */
+#define RECORD_WRITER_WRITEBACK_OPS 3
+
+struct _RecordWriter {
+    int fd;
+    gchar *filename;
+    DVBRecorderLogger *logger;
+
+    /* one buffer for write(), one per write in flight for io_uring */
+    RecordWriterBuffer buffers[RECORD_WRITER_MAX_QUEUE_DEPTH];
+    guint buffer_count;
+    guint current;
+    guint8 *buffer;             /* data of the current buffer */
+    gsize buffer_size;
+    gsize buffer_fill;
+
+    guint64 offset;             /* file position of the buffer start */
+    guint64 allocated;          /* space reserved up to here */
+    gsize preallocate;
+
+    gsize writeback_window;
+    guint64 writeback_offset;   /* start of the window whose writeback was started last */
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    guint writeback_pending;    /* writeback requests in the ring */
+    guint fixed : 1;            /* buffers are registered with the ring */
+#endif
+    guint uring : 1;
+    guint direct : 1;
+    guint failed : 1;
+
+    GMutex stats_lock;
+    DVBRecorderRecordStatistics stats;
+    guint64 latency[RECORD_WRITER_LATENCY_BUCKETS];
+};
+
+static gboolean record_writer_flush(RecordWriter *writer, gsize length);
+static void record_writer_preallocate(RecordWriter *writer, guint64 end);
+static gboolean record_writer_submit(RecordWriter *writer);
+static void record_writer_free(RecordWriter *writer);
+static void record_writer_writeback(RecordWriter *writer);
+static void record_writer_add_latency(RecordWriter *writer, gint64 latency);
+#ifdef HAVE_LIBURING
+static gboolean record_writer_uring_init(RecordWriter *writer);
+static gboolean record_writer_uring_queue(RecordWriter *writer, RecordWriterBuffer *buf);
+static gboolean record_writer_uring_writeback(RecordWriter *writer, off_t start, off_t length);
+static gboolean record_writer_uring_reap(RecordWriter *writer, gboolean wait);
+#endif
+
+RecordWriter *record_writer_open(const gchar *filename, const RecordWriterOptions *options, DVBRecorderLogger *logger)
+{
+    FLOG("\n");
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    RecordWriterOptions defaults = { 0 };
+    if (!options)
+        options = &defaults;
+
+    RecordWriter *writer = g_malloc0(sizeof(RecordWriter));
+    writer->logger = logger;
+    writer->filename = g_strdup(filename);
+    writer->fd = -1;
+    g_mutex_init(&writer->stats_lock);
+
+    gsize size = options->buffer_size ? options->buffer_size : RECORD_WRITER_DEFAULT_BUFFER_SIZE;
+    size = CLAMP(size, RECORD_WRITER_MIN_BUFFER_SIZE, RECORD_WRITER_MAX_BUFFER_SIZE);
+    writer->buffer_size = size & ~((gsize)RECORD_WRITER_ALIGNMENT - 1);
+
+    if (options->preallocate == (gsize)-1)
+        writer->preallocate = 0;
+    else if (options->preallocate)
+        writer->preallocate = MAX(options->preallocate, writer->buffer_size);
+    else
+        writer->preallocate = RECORD_WRITER_PREALLOCATE_SIZE;
+
+    if (options->writeback_window == (gsize)-1)
+        writer->writeback_window = 0;
+    else if (options->writeback_window)
+        writer->writeback_window = (options->writeback_window + RECORD_WRITER_ALIGNMENT - 1)
+                                   & ~((gsize)RECORD_WRITER_ALIGNMENT - 1);
+    else
+        writer->writeback_window = RECORD_WRITER_WRITEBACK_WINDOW;
+
+    int flags = O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC;
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+    if (options->direct_io) {
+        writer->fd = open(filename, flags | O_DIRECT, mode);
+        if (writer->fd >= 0)
+            writer->direct = 1;
+        else if (errno != EINVAL)
+            goto failed;
+        else
+            LOG(logger, "%s does not support O_DIRECT, using buffered writes\n", filename);
+    }
+    if (writer->fd < 0)
+        writer->fd = open(filename, flags, mode);
+failed:
+    if (writer->fd < 0) {
+        LOG(logger, "Failed to open %s: (%d) %s\n", filename, errno, strerror(errno));
+        goto err;
+    }
+
+    writer->buffer_count = 1;
+    if (options->io_uring) {
+        writer->buffer_count = options->queue_depth ? options->queue_depth : RECORD_WRITER_DEFAULT_QUEUE_DEPTH;
+        writer->buffer_count = CLAMP(writer->buffer_count, 2, RECORD_WRITER_MAX_QUEUE_DEPTH);
+    }
+
+    guint k;
+    for (k = 0; k < writer->buffer_count; ++k) {
+        if (posix_memalign((void **)&writer->buffers[k].data, RECORD_WRITER_ALIGNMENT, writer->buffer_size) != 0) {
+            writer->buffers[k].data = NULL;
+            LOG(logger, "Could not allocate record buffer of %zu bytes\n", writer->buffer_size);
+            goto err;
+        }
+    }
+    writer->buffer = writer->buffers[0].data;
+
+    if (options->io_uring) {
+#ifdef HAVE_LIBURING
+        writer->uring = record_writer_uring_init(writer);
+#else
+        LOG(logger, "Built without io_uring support, using write()\n");
+#endif
+        if (!writer->uring) {
+            for (k = 1; k < writer->buffer_count; ++k) {
+                free(writer->buffers[k].data);
+                writer->buffers[k].data = NULL;
+            }
+            writer->buffer_count = 1;
+        }
+    }
+
+    return writer;
+
+err:
+    if (writer->fd >= 0)
+        close(writer->fd);
+    record_writer_free(writer);
+    return NULL;
+}
+
+static void record_writer_free(RecordWriter *writer)
+{
+    guint k;
+    for (k = 0; k < writer->buffer_count; ++k)
+        free(writer->buffers[k].data);
+    g_mutex_clear(&writer->stats_lock);
+    g_free(writer->filename);
+    g_free(writer);
+}
+
+/* Reserve space in large extents ahead of the data. KEEP_SIZE leaves the visible file size alone, so the
+ * recording can be read while it grows; the excess is trimmed on close. */
+static void record_writer_preallocate(RecordWriter *writer, guint64 end)
+{
+    if (!writer->preallocate || end <= writer->allocated)
+        return;
+
+    while (writer->allocated < end) {
+        if (fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, (off_t)writer->allocated, (off_t)writer->preallocate) != 0) {
+            if (errno != EOPNOTSUPP && errno != ENOSYS)
+                LOG(writer->logger, "fallocate failed on %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+            writer->preallocate = 0;
+            return;
+        }
+        writer->allocated += writer->preallocate;
+    }
+}
+
+/* Write the first length bytes of the buffer at the current offset. For O_DIRECT length has to be aligned. */
+static gboolean record_writer_flush(RecordWriter *writer, gsize length)
+{
+    gsize done = 0;
+    ssize_t nw;
+    gint64 start;
+
+    record_writer_preallocate(writer, writer->offset + length);
+
+    start = g_get_monotonic_time();
+    while (done < length) {
+        nw = pwrite(writer->fd, writer->buffer + done, length - done, (off_t)(writer->offset + done));
+        if (nw < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(writer->logger, "Could not write %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+            writer->failed = 1;
+            return FALSE;
+        }
+        if (nw == 0) {
+            LOG(writer->logger, "Written zero bytes to %s\n", writer->filename);
+            writer->failed = 1;
+            return FALSE;
+        }
+        done += (gsize)nw;
+    }
+
+    writer->offset += length;
+
+    g_mutex_lock(&writer->stats_lock);
+    writer->stats.bytes_written += length;
+    ++writer->stats.writes;
+    record_writer_add_latency(writer, g_get_monotonic_time() - start);
+    g_mutex_unlock(&writer->stats_lock);
+
+    return TRUE;
+}
+
+/* Called with stats_lock held. */
+static void record_writer_add_latency(RecordWriter *writer, gint64 latency)
+{
+    guint64 value = latency > 0 ? (guint64)latency : 0;
+    guint index;
+
+    if (value < 4) {
+        index = (guint)value;
+    }
+    else {
+        guint e = 63 - __builtin_clzll(value);
+        index = (e - 1) * 4 + ((value >> (e - 2)) & 3);
+    }
+
+    ++writer->latency[MIN(index, RECORD_WRITER_LATENCY_BUCKETS - 1)];
+    if (value > writer->stats.write_latency_max)
+        writer->stats.write_latency_max = value;
+}
+
+/* Upper bound of the latency below which fraction of the writes completed. Called with stats_lock held. */
+static guint64 record_writer_latency_percentile(RecordWriter *writer, gdouble fraction)
+{
+    guint64 rank = (guint64)(fraction * writer->stats.writes);
+    guint64 count = 0;
+    guint index;
+
+    if (!writer->stats.writes)
+        return 0;
+
+    for (index = 0; index < RECORD_WRITER_LATENCY_BUCKETS - 1; ++index) {
+        count += writer->latency[index];
+        if (count > rank)
+            break;
+    }
+
+    if (index < 4)
+        return index;
+
+    guint e = index / 4 + 1;
+    guint64 upper = ((guint64)(4 + index % 4 + 1) << (e - 2)) - 1;
+    return MIN(upper, writer->stats.write_latency_max);
+}
+
+/* Offset up to which all data reached the file. */
+static guint64 record_writer_completed(RecordWriter *writer)
+{
+    guint64 end = writer->offset;
+    guint k;
+
+    for (k = 0; k < writer->buffer_count; ++k) {
+        if (writer->buffers[k].busy && writer->buffers[k].offset < end)
+            end = writer->buffers[k].offset;
+    }
+
+    return end;
+}
+
+/* Start writeback of every completed window, then wait for the window before it and drop it from the page
+ * cache. A recording so keeps at most about two windows of dirty and cached pages instead of letting the
+ * kernel flush gigabytes at once. Not needed with O_DIRECT. */
+static void record_writer_writeback(RecordWriter *writer)
+{
+    if (!writer->writeback_window || writer->direct)
+        return;
+
+    guint64 end = record_writer_completed(writer);
+
+    while (end - writer->writeback_offset >= writer->writeback_window) {
+        off_t start = (off_t)writer->writeback_offset;
+        off_t length = (off_t)writer->writeback_window;
+
+#ifdef HAVE_LIBURING
+        /* let the ring wait for the disk; one window at a time, the rest follows with the next buffer */
+        if (writer->uring) {
+            if (writer->writeback_pending || !record_writer_uring_writeback(writer, start, length))
+                return;
+            writer->writeback_offset += writer->writeback_window;
+            continue;
+        }
+#endif
+        if (sync_file_range(writer->fd, start, length, SYNC_FILE_RANGE_WRITE) != 0) {
+            LOG(writer->logger, "sync_file_range failed on %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+            writer->writeback_window = 0;
+            return;
+        }
+        if (start >= length) {
+            sync_file_range(writer->fd, start - length, length,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(writer->fd, start - length, length, POSIX_FADV_DONTNEED);
+        }
+
+        writer->writeback_offset += writer->writeback_window;
+    }
+}
+
+#ifdef HAVE_LIBURING
+static gboolean record_writer_uring_init(RecordWriter *writer)
+{
+    struct iovec iov[RECORD_WRITER_MAX_QUEUE_DEPTH];
+    guint k;
+    int rc;
+
+    if ((rc = io_uring_queue_init(writer->buffer_count + RECORD_WRITER_WRITEBACK_OPS, &writer->ring, 0)) < 0) {
+        LOG(writer->logger, "io_uring not available: (%d) %s, using write()\n", -rc, strerror(-rc));
+        return FALSE;
+    }
+
+    for (k = 0; k < writer->buffer_count; ++k) {
+        iov[k].iov_base = writer->buffers[k].data;
+        iov[k].iov_len = writer->buffer_size;
+    }
+    /* registering may exceed RLIMIT_MEMLOCK; plain writes from the ring still work */
+    if ((rc = io_uring_register_buffers(&writer->ring, iov, writer->buffer_count)) < 0)
+        LOG(writer->logger, "Could not register record buffers: (%d) %s\n", -rc, strerror(-rc));
+    else
+        writer->fixed = 1;
+
+    return TRUE;
+}
+
+static struct io_uring_sqe *record_writer_uring_get_sqe(RecordWriter *writer)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&writer->ring);
+
+    if (!sqe) {
+        io_uring_submit(&writer->ring);
+        if (!(sqe = io_uring_get_sqe(&writer->ring)))
+            LOG(writer->logger, "io_uring submission queue full\n");
+    }
+
+    return sqe;
+}
+
+/* Queue the remaining part of buf. */
+static gboolean record_writer_uring_queue(RecordWriter *writer, RecordWriterBuffer *buf)
+{
+    struct io_uring_sqe *sqe = record_writer_uring_get_sqe(writer);
+    int rc;
+
+    if (!sqe)
+        return FALSE;
+
+    if (writer->fixed)
+        io_uring_prep_write_fixed(sqe, writer->fd, buf->data + buf->done, buf->length - buf->done,
+                buf->offset + buf->done, (int)(buf - writer->buffers));
+    else
+        io_uring_prep_write(sqe, writer->fd, buf->data + buf->done, buf->length - buf->done,
+                buf->offset + buf->done);
+    io_uring_sqe_set_data(sqe, buf);
+
+    if ((rc = io_uring_submit(&writer->ring)) < 0) {
+        LOG(writer->logger, "io_uring_submit failed: (%d) %s\n", -rc, strerror(-rc));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Start writeback of the window at start and, linked so they run in order, wait for the window before it
+ * and drop it from the page cache. The requests carry no buffer. */
+static gboolean record_writer_uring_writeback(RecordWriter *writer, off_t start, off_t length)
+{
+    struct io_uring_sqe *sqe;
+    int rc;
+
+    if (!(sqe = record_writer_uring_get_sqe(writer)))
+        return FALSE;
+    io_uring_prep_sync_file_range(sqe, writer->fd, (unsigned)length, (guint64)start, SYNC_FILE_RANGE_WRITE);
+    io_uring_sqe_set_data(sqe, NULL);
+    ++writer->writeback_pending;
+
+    if (start >= length) {
+        if (!(sqe = record_writer_uring_get_sqe(writer)))
+            goto submit;
+        io_uring_prep_sync_file_range(sqe, writer->fd, (unsigned)length, (guint64)(start - length),
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        io_uring_sqe_set_data(sqe, NULL);
+        ++writer->writeback_pending;
+
+        if (!(sqe = record_writer_uring_get_sqe(writer)))
+            goto submit;
+        io_uring_prep_fadvise(sqe, writer->fd, (guint64)(start - length), (guint32)length, POSIX_FADV_DONTNEED);
+        io_uring_sqe_set_data(sqe, NULL);
+        ++writer->writeback_pending;
+    }
+
+submit:
+    if ((rc = io_uring_submit(&writer->ring)) < 0) {
+        LOG(writer->logger, "io_uring_submit failed: (%d) %s\n", -rc, strerror(-rc));
+        writer->failed = 1;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Handle completed writes, waiting for at least one if wait is set. Short writes are queued again. */
+static gboolean record_writer_uring_reap(RecordWriter *writer, gboolean wait)
+{
+    struct io_uring_cqe *cqe;
+    RecordWriterBuffer *buf;
+    int rc;
+
+    while (1) {
+        if (wait) {
+            rc = io_uring_wait_cqe(&writer->ring, &cqe);
+            if (rc == -EINTR)
+                continue;
+            wait = FALSE;
+        }
+        else {
+            rc = io_uring_peek_cqe(&writer->ring, &cqe);
+            if (rc == -EAGAIN)
+                return TRUE;
+        }
+        if (rc < 0) {
+            LOG(writer->logger, "io_uring wait failed: (%d) %s\n", -rc, strerror(-rc));
+            writer->failed = 1;
+            return FALSE;
+        }
+
+        buf = io_uring_cqe_get_data(cqe);
+        rc = cqe->res;
+        io_uring_cqe_seen(&writer->ring, cqe);
+
+        if (!buf) {
+            /* writeback request; a failure only costs page cache, so stop the writeback as write() does */
+            --writer->writeback_pending;
+            if (rc < 0 && rc != -ECANCELED && writer->writeback_window) {
+                LOG(writer->logger, "sync_file_range failed on %s: (%d) %s\n", writer->filename, -rc, strerror(-rc));
+                writer->writeback_window = 0;
+            }
+            continue;
+        }
+
+        if (rc == -EINTR || rc == -EAGAIN) {
+            if (record_writer_uring_queue(writer, buf))
+                continue;
+            rc = -EIO;
+        }
+        else if (rc > 0) {
+            buf->done += (gsize)rc;
+            if (buf->done < buf->length) {
+                if (record_writer_uring_queue(writer, buf))
+                    continue;
+                rc = -EIO;
+            }
+        }
+        else if (rc == 0) {
+            rc = -EIO;
+        }
+
+        if (rc < 0) {
+            LOG(writer->logger, "Could not write %s: (%d) %s\n", writer->filename, -rc, strerror(-rc));
+            writer->failed = 1;
+        }
+
+        buf->busy = 0;
+
+        g_mutex_lock(&writer->stats_lock);
+        --writer->stats.queue_depth;
+        if (rc > 0) {
+            writer->stats.bytes_written += buf->length;
+            ++writer->stats.writes;
+            record_writer_add_latency(writer, g_get_monotonic_time() - buf->submit_time);
+        }
+        g_mutex_unlock(&writer->stats_lock);
+    }
+}
+#endif
+
+/* Hand the full current buffer to the backend and make the next buffer current. */
+static gboolean record_writer_submit(RecordWriter *writer)
+{
+    if (!writer->uring) {
+        if (!record_writer_flush(writer, writer->buffer_size))
+            return FALSE;
+        writer->buffer_fill = 0;
+        record_writer_writeback(writer);
+        return TRUE;
+    }
+
+#ifdef HAVE_LIBURING
+    RecordWriterBuffer *buf = &writer->buffers[writer->current];
+
+    record_writer_preallocate(writer, writer->offset + writer->buffer_size);
+
+    buf->offset = writer->offset;
+    buf->length = writer->buffer_size;
+    buf->done = 0;
+    buf->submit_time = g_get_monotonic_time();
+    buf->busy = 1;
+    if (!record_writer_uring_queue(writer, buf)) {
+        buf->busy = 0;
+        writer->failed = 1;
+        return FALSE;
+    }
+
+    writer->offset += writer->buffer_size;
+    writer->buffer_fill = 0;
+
+    g_mutex_lock(&writer->stats_lock);
+    if (++writer->stats.queue_depth > writer->stats.max_queue_depth)
+        writer->stats.max_queue_depth = writer->stats.queue_depth;
+    g_mutex_unlock(&writer->stats_lock);
+
+    /* continue in the next buffer; only wait for the disk if all buffers are in flight */
+    writer->current = (writer->current + 1) % writer->buffer_count;
+    record_writer_uring_reap(writer, FALSE);
+    if (writer->buffers[writer->current].busy) {
+        g_mutex_lock(&writer->stats_lock);
+        ++writer->stats.queue_full_waits;
+        g_mutex_unlock(&writer->stats_lock);
+    }
+    while (writer->buffers[writer->current].busy) {
+        if (!record_writer_uring_reap(writer, TRUE))
+            return FALSE;
+    }
+    writer->buffer = writer->buffers[writer->current].data;
+
+    record_writer_writeback(writer);
+#endif
+
+    return !writer->failed;
+}
+
+gboolean record_writer_write(RecordWriter *writer, const guint8 *data, gsize size)
+{
+    g_return_val_if_fail(writer != NULL, FALSE);
+
+    if (writer->failed)
+        return FALSE;
+
+#ifdef HAVE_LIBURING
+    /* pick up completions as they arrive so the latency is not inflated by the time to fill a buffer */
+    if (writer->uring && (writer->stats.queue_depth > 0 || writer->writeback_pending > 0) &&
+            !record_writer_uring_reap(writer, FALSE))
+        return FALSE;
+#endif
+
+    while (size > 0) {
+        gsize count = MIN(size, writer->buffer_size - writer->buffer_fill);
+        memcpy(writer->buffer + writer->buffer_fill, data, count);
+        writer->buffer_fill += count;
+        data += count;
+        size -= count;
+
+        if (writer->buffer_fill == writer->buffer_size && !record_writer_submit(writer))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean record_writer_close(RecordWriter *writer)
+{
+    FLOG("\n");
+    if (!writer)
+        return FALSE;
+
+#ifdef HAVE_LIBURING
+    if (writer->uring) {
+        /* wait for the writes and writeback in flight; the tail is written below */
+        while (writer->stats.queue_depth > 0 || writer->writeback_pending > 0) {
+            if (!record_writer_uring_reap(writer, TRUE))
+                break;
+        }
+        io_uring_queue_exit(&writer->ring);
+    }
+#endif
+
+    gboolean result = !writer->failed;
+
+    if (result && writer->buffer_fill > 0) {
+        /* O_DIRECT needs aligned lengths; write the aligned part directly and the tail through the page cache */
+        gsize aligned = writer->buffer_fill & ~((gsize)RECORD_WRITER_ALIGNMENT - 1);
+        if (writer->direct && aligned < writer->buffer_fill) {
+            if (aligned > 0) {
+                if (!record_writer_flush(writer, aligned))
+                    goto done;
+                memmove(writer->buffer, writer->buffer + aligned, writer->buffer_fill - aligned);
+                writer->buffer_fill -= aligned;
+            }
+            int flags = fcntl(writer->fd, F_GETFL);
+            if (flags == -1 || fcntl(writer->fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+                /* pad to the alignment and cut the file back afterwards */
+                gsize padded = (writer->buffer_fill + RECORD_WRITER_ALIGNMENT - 1) & ~((gsize)RECORD_WRITER_ALIGNMENT - 1);
+                memset(writer->buffer + writer->buffer_fill, 0, padded - writer->buffer_fill);
+                guint64 end = writer->offset + writer->buffer_fill;
+                if (record_writer_flush(writer, padded))
+                    writer->offset = end;
+                goto done;
+            }
+            writer->direct = 0;
+        }
+        record_writer_flush(writer, writer->buffer_fill);
+    }
+
+done:
+    /* drop preallocated space beyond the data (and any padding) */
+    if ((writer->allocated > writer->offset || writer->direct) && ftruncate(writer->fd, (off_t)writer->offset) != 0)
+        LOG(writer->logger, "Could not truncate %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+
+    if (close(writer->fd) != 0 && !writer->failed) {
+        LOG(writer->logger, "Could not close %s: (%d) %s\n", writer->filename, errno, strerror(errno));
+        writer->failed = 1;
+    }
+
+    result = !writer->failed;
+
+    record_writer_free(writer);
+
+    return result;
+}
+
+guint64 record_writer_get_size(RecordWriter *writer)
+{
+    g_return_val_if_fail(writer != NULL, 0);
+
+    return writer->offset + writer->buffer_fill;
+}
+
+gboolean record_writer_is_direct(RecordWriter *writer)
+{
+    g_return_val_if_fail(writer != NULL, FALSE);
+
+    return writer->direct;
+}
+
+void record_writer_get_statistics(RecordWriter *writer, DVBRecorderRecordStatistics *stats)
+{
+    g_return_if_fail(writer != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&writer->stats_lock);
+    *stats = writer->stats;
+    stats->write_latency_p50 = record_writer_latency_percentile(writer, 0.5);
+    stats->write_latency_p90 = record_writer_latency_percentile(writer, 0.9);
+    stats->write_latency_p99 = record_writer_latency_percentile(writer, 0.99);
+    stats->write_latency_p999 = record_writer_latency_percentile(writer, 0.999);
+    g_mutex_unlock(&writer->stats_lock);
+
+    stats->direct_io = writer->direct;
+    stats->io_uring = writer->uring;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glib.h>
+#include "dvbrecorder.h"
+#include "logging.h"
+
+/* Writes a recording to disk in large, aligned blocks. Data is collected in a buffer and only full buffers
+ * are written, so the file system sees few large sequential writes. With direct_io the page cache is bypassed
+ * (O_DIRECT); the unaligned tail is written on close. With io_uring (build with HAVE_LIBURING) full buffers
+ * are submitted asynchronously and up to queue_depth writes are kept in flight. */
+typedef struct _RecordWriter RecordWriter;
+
+#define RECORD_WRITER_ALIGNMENT         4096
+#define RECORD_WRITER_MIN_BUFFER_SIZE   (1024 * 1024)
+#define RECORD_WRITER_MAX_BUFFER_SIZE   (8 * 1024 * 1024)
+#define RECORD_WRITER_DEFAULT_BUFFER_SIZE (4 * 1024 * 1024)
+#define RECORD_WRITER_PREALLOCATE_SIZE  (64 * 1024 * 1024)
+#define RECORD_WRITER_WRITEBACK_WINDOW  (8 * 1024 * 1024)
+#define RECORD_WRITER_DEFAULT_QUEUE_DEPTH 4
+#define RECORD_WRITER_MAX_QUEUE_DEPTH   16
+
+typedef struct {
+    gsize buffer_size;          /* clamped to 1-8 MB and rounded to the alignment, 0 for the default */
+    gboolean direct_io;         /* open with O_DIRECT, falls back to buffered writes if not supported */
+    gsize preallocate;          /* reserve space ahead of the write position in extents of this size,
+                                   0 for the default, (gsize)-1 to disable */
+    gboolean io_uring;          /* submit writes through io_uring, falls back to write() if not available */
+    guint queue_depth;          /* io_uring writes in flight (2-16), 0 for the default */
+    gsize writeback_window;     /* start writeback and drop written data from the page cache in windows of
+                                   this size, 0 for the default, (gsize)-1 to disable */
+} RecordWriterOptions;
+
+/* options may be NULL for the defaults */
+RecordWriter *record_writer_open(const gchar *filename, const RecordWriterOptions *options, DVBRecorderLogger *logger);
+/* Returns FALSE if writing to the file failed. */
+gboolean record_writer_write(RecordWriter *writer, const guint8 *data, gsize size);
+/* Writes the buffered tail, trims the preallocated space and closes the file. Returns FALSE if data was lost. */
+gboolean record_writer_close(RecordWriter *writer);
+
+guint64 record_writer_get_size(RecordWriter *writer);
+gboolean record_writer_is_direct(RecordWriter *writer);
+void record_writer_get_statistics(RecordWriter *writer, DVBRecorderRecordStatistics *stats);
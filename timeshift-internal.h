@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include "timeshift.h"
+#include "logging.h"
+
+/* size is rounded up to whole packets and pages. Returns NULL if the ring cannot be created. */
+DVBTimeshift *dvb_timeshift_new(gsize size, DVBRecorderLogger *logger);
+
+/* The following are called by the data thread only. Record the write position as seek point before a random
+ * access point. Returns FALSE if the last one is too recent; otherwise the caller pushes the tables, then the
+ * packet. */
+gboolean dvb_timeshift_mark_rap(DVBTimeshift *timeshift);
+/* Append whole packets. */
+void dvb_timeshift_push(DVBTimeshift *timeshift, const uint8_t *packets, gsize size);
+/* The stream changed (e.g. a new channel), data before this point cannot be seeked to any more. */
+void dvb_timeshift_discontinuity(DVBTimeshift *timeshift);
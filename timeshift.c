@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "timeshift.h"
+#include "timeshift-internal.h"
+#include "pcr-clock.h"
+#include "logging-internal.h"
+
+#define DVB_TIMESHIFT_POINTS 16384            /* seek points remembered, power of two */
+#define DVB_TIMESHIFT_POINT_INTERVAL 45000    /* 90 kHz, minimum distance of seek points */
+#define DVB_TIMESHIFT_GUARD_DIVISOR 16        /* data within 1/16 of the ring of being overwritten is not handed out */
+
+struct DVBTimeshiftPoint {
+    guint64 position;
+    guint64 time;            /* 90 kHz stream time */
+};
+
+struct _DVBTimeshift {
+    gint refcount;
+    DVBRecorderLogger *logger;
+
+    int fd;
+    guint8 *map;             /* the ring, mapped twice in a row so that any range of it is contiguous */
+    gsize capacity;
+    gsize guard;
+
+    /* Positions count all bytes ever written; data at position p is at map[p % capacity]. The data thread is
+     * the only writer, write_position and live_time are published for the cursors. */
+    guint64 write_position;
+    guint64 live_time;
+    PcrClock clock;
+
+    GMutex lock;             /* protects the seek points */
+    struct DVBTimeshiftPoint points[DVB_TIMESHIFT_POINTS];
+    guint points_head;       /* next slot */
+    guint points_count;
+};
+
+struct _DVBTimeshiftCursor {
+    DVBTimeshift *timeshift;
+    guint64 position;
+    guint overruns;
+};
+
+static gboolean dvb_timeshift_find_point(DVBTimeshift *timeshift, guint64 time, guint64 *position);
+
+static gsize dvb_timeshift_gcd(gsize a, gsize b)
+{
+    gsize t;
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static int dvb_timeshift_create_fd(DVBRecorderLogger *logger)
+{
+    int fd = memfd_create("dvbreader-timeshift", MFD_CLOEXEC);
+    if (fd >= 0 || errno != ENOSYS)
+        return fd;
+
+    /* kernels without memfd: an unlinked temporary file */
+    gchar *filename = g_build_filename(g_get_tmp_dir(), "dvbreader-timeshift-XXXXXX", NULL);
+    fd = g_mkstemp(filename);
+    if (fd >= 0)
+        unlink(filename);
+    g_free(filename);
+
+    return fd;
+}
+
+DVBTimeshift *dvb_timeshift_new(gsize size, DVBRecorderLogger *logger)
+{
+    FLOG("\n");
+    g_return_val_if_fail(size > 0, NULL);
+
+    gsize page = (gsize)sysconf(_SC_PAGESIZE);
+    gsize unit = TS_SIZE / dvb_timeshift_gcd(TS_SIZE, page) * page;
+    gsize capacity = (size + unit - 1) / unit * unit;
+    guint8 *map;
+
+    int fd = dvb_timeshift_create_fd(logger);
+    if (fd < 0) {
+        LOG(logger, "Could not create time-shift buffer: (%d) %s\n", errno, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)capacity) != 0) {
+        LOG(logger, "Could not size time-shift buffer to %zu bytes: (%d) %s\n", capacity, errno, strerror(errno));
+        goto err;
+    }
+
+    /* reserve twice the size, then map the ring into both halves */
+    map = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        goto err_map;
+    if (mmap(map, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(map + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(map, 2 * capacity);
+        goto err_map;
+    }
+
+    DVBTimeshift *timeshift = g_malloc0(sizeof(DVBTimeshift));
+    timeshift->refcount = 1;
+    timeshift->logger = logger;
+    timeshift->fd = fd;
+    timeshift->map = map;
+    timeshift->capacity = capacity;
+    timeshift->guard = capacity / DVB_TIMESHIFT_GUARD_DIVISOR / TS_SIZE * TS_SIZE;
+    pcr_clock_init(&timeshift->clock);
+    g_mutex_init(&timeshift->lock);
+
+    return timeshift;
+
+err_map:
+    LOG(logger, "Could not map time-shift buffer: (%d) %s\n", errno, strerror(errno));
+err:
+    close(fd);
+    return NULL;
+}
+
+DVBTimeshift *dvb_timeshift_ref(DVBTimeshift *timeshift)
+{
+    if (timeshift)
+        g_atomic_int_inc(&timeshift->refcount);
+    return timeshift;
+}
+
+void dvb_timeshift_unref(DVBTimeshift *timeshift)
+{
+    if (!timeshift || !g_atomic_int_dec_and_test(&timeshift->refcount))
+        return;
+
+    munmap(timeshift->map, 2 * timeshift->capacity);
+    close(timeshift->fd);
+    g_mutex_clear(&timeshift->lock);
+    g_free(timeshift);
+}
+
+gsize dvb_timeshift_get_capacity(DVBTimeshift *timeshift)
+{
+    g_return_val_if_fail(timeshift != NULL, 0);
+
+    return timeshift->capacity;
+}
+
+static inline guint64 dvb_timeshift_write_position(DVBTimeshift *timeshift)
+{
+    return __atomic_load_n(&timeshift->write_position, __ATOMIC_ACQUIRE);
+}
+
+/* Oldest position handed out to cursors, keeping a guard distance to the writer. */
+static inline guint64 dvb_timeshift_oldest(DVBTimeshift *timeshift, guint64 end)
+{
+    gsize usable = timeshift->capacity - timeshift->guard;
+    return end > usable ? end - usable : 0;
+}
+
+gboolean dvb_timeshift_mark_rap(DVBTimeshift *timeshift)
+{
+    struct DVBTimeshiftPoint *last;
+
+    g_mutex_lock(&timeshift->lock);
+
+    if (timeshift->points_count) {
+        last = &timeshift->points[(timeshift->points_head - 1) & (DVB_TIMESHIFT_POINTS - 1)];
+        if (timeshift->clock.time - last->time < DVB_TIMESHIFT_POINT_INTERVAL) {
+            g_mutex_unlock(&timeshift->lock);
+            return FALSE;
+        }
+    }
+
+    timeshift->points[timeshift->points_head].position = timeshift->write_position;
+    timeshift->points[timeshift->points_head].time = timeshift->clock.time;
+    timeshift->points_head = (timeshift->points_head + 1) & (DVB_TIMESHIFT_POINTS - 1);
+    if (timeshift->points_count < DVB_TIMESHIFT_POINTS)
+        ++timeshift->points_count;
+
+    g_mutex_unlock(&timeshift->lock);
+
+    return TRUE;
+}
+
+void dvb_timeshift_push(DVBTimeshift *timeshift, const uint8_t *packets, gsize size)
+{
+    guint64 position = timeshift->write_position;
+    gsize offset, piece;
+
+    if (!packets || !size)
+        return;
+
+    for (offset = 0; offset + TS_SIZE <= size; offset += TS_SIZE)
+        pcr_clock_update(&timeshift->clock, &packets[offset]);
+
+    /* Published in pieces of at most the guard size, so data being overwritten is always within the guard
+     * distance ahead of write_position. The second mapping takes what runs over the end. */
+    for (offset = 0; offset < size; offset += piece) {
+        piece = MIN(size - offset, timeshift->guard);
+        memcpy(&timeshift->map[(position + offset) % timeshift->capacity], &packets[offset], piece);
+        __atomic_store_n(&timeshift->write_position, position + offset + piece, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&timeshift->live_time, timeshift->clock.time, __ATOMIC_RELAXED);
+}
+
+void dvb_timeshift_discontinuity(DVBTimeshift *timeshift)
+{
+    g_return_if_fail(timeshift != NULL);
+
+    g_mutex_lock(&timeshift->lock);
+    timeshift->points_count = 0;
+    g_mutex_unlock(&timeshift->lock);
+
+    /* keep counting from the current time, it must not go back */
+    timeshift->clock.pid = 0x1fff;
+    timeshift->clock.valid = 0;
+}
+
+/* Newest seek point at or before time that was not overwritten, else the oldest one. */
+static gboolean dvb_timeshift_find_point(DVBTimeshift *timeshift, guint64 time, guint64 *position)
+{
+    struct DVBTimeshiftPoint *point;
+    guint64 oldest = dvb_timeshift_oldest(timeshift, dvb_timeshift_write_position(timeshift));
+    gboolean found = FALSE;
+    guint k;
+
+    g_mutex_lock(&timeshift->lock);
+    for (k = 1; k <= timeshift->points_count; ++k) {
+        point = &timeshift->points[(timeshift->points_head - k) & (DVB_TIMESHIFT_POINTS - 1)];
+        if (point->position < oldest)
+            break;
+        *position = point->position;
+        found = TRUE;
+        if (point->time <= time)
+            break;
+    }
+    g_mutex_unlock(&timeshift->lock);
+
+    return found;
+}
+
+guint64 dvb_timeshift_get_duration(DVBTimeshift *timeshift)
+{
+    g_return_val_if_fail(timeshift != NULL, 0);
+
+    struct DVBTimeshiftPoint *point;
+    guint64 oldest = dvb_timeshift_oldest(timeshift, dvb_timeshift_write_position(timeshift));
+    guint64 live = __atomic_load_n(&timeshift->live_time, __ATOMIC_RELAXED);
+    guint64 time = live;
+    guint k;
+
+    g_mutex_lock(&timeshift->lock);
+    for (k = 1; k <= timeshift->points_count; ++k) {
+        point = &timeshift->points[(timeshift->points_head - k) & (DVB_TIMESHIFT_POINTS - 1)];
+        if (point->position < oldest)
+            break;
+        time = point->time;
+    }
+    g_mutex_unlock(&timeshift->lock);
+
+    return (live - time) / 90;
+}
+
+DVBTimeshiftCursor *dvb_timeshift_cursor_new(DVBTimeshift *timeshift)
+{
+    g_return_val_if_fail(timeshift != NULL, NULL);
+
+    DVBTimeshiftCursor *cursor = g_malloc0(sizeof(DVBTimeshiftCursor));
+    cursor->timeshift = dvb_timeshift_ref(timeshift);
+    dvb_timeshift_cursor_seek_live(cursor);
+
+    return cursor;
+}
+
+void dvb_timeshift_cursor_free(DVBTimeshiftCursor *cursor)
+{
+    if (!cursor)
+        return;
+
+    dvb_timeshift_unref(cursor->timeshift);
+    g_free(cursor);
+}
+
+/* The cursor was overtaken by the writer, continue with the oldest data a decoder can start at. */
+static void dvb_timeshift_cursor_overrun(DVBTimeshiftCursor *cursor, guint64 end)
+{
+    if (!dvb_timeshift_find_point(cursor->timeshift, 0, &cursor->position))
+        cursor->position = end;
+    ++cursor->overruns;
+}
+
+const guint8 *dvb_timeshift_cursor_peek(DVBTimeshiftCursor *cursor, gsize *length)
+{
+    g_return_val_if_fail(cursor != NULL, NULL);
+    g_return_val_if_fail(length != NULL, NULL);
+
+    DVBTimeshift *timeshift = cursor->timeshift;
+    guint64 end = dvb_timeshift_write_position(timeshift);
+
+    if (cursor->position < dvb_timeshift_oldest(timeshift, end))
+        dvb_timeshift_cursor_overrun(cursor, end);
+
+    if (cursor->position >= end) {
+        *length = 0;
+        return NULL;
+    }
+
+    *length = (gsize)(end - cursor->position);
+    return &timeshift->map[cursor->position % timeshift->capacity];
+}
+
+gboolean dvb_timeshift_cursor_consume(DVBTimeshiftCursor *cursor, gsize length)
+{
+    g_return_val_if_fail(cursor != NULL, FALSE);
+
+    DVBTimeshift *timeshift = cursor->timeshift;
+    guint64 end;
+
+    /* the caller's reads of the data happen before the reload, as in a seqlock reader */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    end = dvb_timeshift_write_position(timeshift);
+
+    /* The writer got past the start of the data in use, or may be copying over it: a write in progress reaches
+     * up to guard bytes beyond end. */
+    if (end + timeshift->guard > cursor->position + timeshift->capacity) {
+        dvb_timeshift_cursor_overrun(cursor, end);
+        return FALSE;
+    }
+
+    cursor->position = MIN(cursor->position + length, end);
+    return TRUE;
+}
+
+gboolean dvb_timeshift_cursor_seek(DVBTimeshiftCursor *cursor, guint64 delay_ms)
+{
+    g_return_val_if_fail(cursor != NULL, FALSE);
+
+    guint64 live = __atomic_load_n(&cursor->timeshift->live_time, __ATOMIC_RELAXED);
+    guint64 delay = delay_ms * 90;
+
+    return dvb_timeshift_find_point(cursor->timeshift, live > delay ? live - delay : 0, &cursor->position);
+}
+
+void dvb_timeshift_cursor_seek_live(DVBTimeshiftCursor *cursor)
+{
+    g_return_if_fail(cursor != NULL);
+
+    if (!dvb_timeshift_find_point(cursor->timeshift, G_MAXUINT64, &cursor->position))
+        cursor->position = dvb_timeshift_write_position(cursor->timeshift);
+}
+
+guint64 dvb_timeshift_cursor_get_delay(DVBTimeshiftCursor *cursor)
+{
+    g_return_val_if_fail(cursor != NULL, 0);
+
+    DVBTimeshift *timeshift = cursor->timeshift;
+    struct DVBTimeshiftPoint *point;
+    guint64 live = __atomic_load_n(&timeshift->live_time, __ATOMIC_RELAXED);
+    guint64 time = live;
+    guint k;
+
+    /* time of the last seek point the cursor passed */
+    g_mutex_lock(&timeshift->lock);
+    for (k = 1; k <= timeshift->points_count; ++k) {
+        point = &timeshift->points[(timeshift->points_head - k) & (DVB_TIMESHIFT_POINTS - 1)];
+        if (point->position <= cursor->position) {
+            time = point->time;
+            break;
+        }
+    }
+    g_mutex_unlock(&timeshift->lock);
+
+    return live > time ? (live - time) / 90 : 0;
+}
+
+guint dvb_timeshift_cursor_get_overruns(DVBTimeshiftCursor *cursor)
+{
+    g_return_val_if_fail(cursor != NULL, 0);
+
+    return cursor->overruns;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <glib.h>
+
+/* Time-shift ring: the last few hundred megabytes of the service in a shared memory ring, fed by the reader.
+ * Any number of cursors read from it independently; they may pause, seek back in time and catch up to live.
+ * Data is handed out as pointers into the ring, nothing is copied. Each random access point is preceded by the
+ * current PAT and PMT, so a cursor that seeked can be fed to a decoder right away. */
+typedef struct _DVBTimeshift DVBTimeshift;
+typedef struct _DVBTimeshiftCursor DVBTimeshiftCursor;
+
+DVBTimeshift *dvb_timeshift_ref(DVBTimeshift *timeshift);
+void dvb_timeshift_unref(DVBTimeshift *timeshift);
+
+gsize dvb_timeshift_get_capacity(DVBTimeshift *timeshift);
+/* ms of the service that can be seeked back to */
+guint64 dvb_timeshift_get_duration(DVBTimeshift *timeshift);
+
+/* A new cursor starts at the latest random access point. It holds a reference to the ring. */
+DVBTimeshiftCursor *dvb_timeshift_cursor_new(DVBTimeshift *timeshift);
+void dvb_timeshift_cursor_free(DVBTimeshiftCursor *cursor);
+
+/* Data available at the cursor, NULL if it caught up with live. The data is not copied and stays valid until it
+ * is overwritten; check with dvb_timeshift_cursor_consume() after using it. If the cursor fell behind the oldest
+ * data, it is moved to the oldest random access point first and the overrun is counted. */
+const guint8 *dvb_timeshift_cursor_peek(DVBTimeshiftCursor *cursor, gsize *length);
+/* Move past length bytes returned by peek. Returns FALSE if they were overwritten while in use; the cursor then
+ * continues at the oldest random access point. */
+gboolean dvb_timeshift_cursor_consume(DVBTimeshiftCursor *cursor, gsize length);
+
+/* Go back to the random access point delay_ms before live, or the oldest one. Returns FALSE if there is none. */
+gboolean dvb_timeshift_cursor_seek(DVBTimeshiftCursor *cursor, guint64 delay_ms);
+/* Catch up: continue at the latest random access point. */
+void dvb_timeshift_cursor_seek_live(DVBTimeshiftCursor *cursor);
+/* About how many ms the cursor is behind live. */
+guint64 dvb_timeshift_cursor_get_delay(DVBTimeshiftCursor *cursor);
+guint dvb_timeshift_cursor_get_overruns(DVBTimeshiftCursor *cursor);